@@ -0,0 +1,648 @@
+/*
+ * aio.c: asynchronous whole-file reads and writes for the image readers and
+ * writers, and reads of byte ranges for the readers that stream a file.
+ * Requests are queued and served either by an io_uring ring (HAVE_IO_URING,
+ * linux only) or by a small pool of blocking I/O threads, so many files can
+ * be in flight while the caller keeps decoding and computing.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "aio.h"
+#include "thread.h"
+
+#if defined(HAVE_IO_URING) && defined(__linux__)
+#define AIO_URING 1
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+#define AIO_OP_READ         0
+#define AIO_OP_WRITE        1
+
+#define AIO_DEFAULT_DEPTH   32
+#define AIO_MAX_THREADS     8
+#define AIO_URING_CHUNK     (1 << 30)   /* a cqe reports at most INT_MAX bytes */
+
+struct aio_req
+{
+    int op;
+    char *filename;
+    unsigned char *data;
+    size_t size;
+    size_t offset;              /* bytes transferred so far */
+    size_t start;               /* file offset of data[0] */
+    int range;                  /* read at most 'size' bytes from 'start' */
+    const char *error;
+    int done;
+    struct aio_req *next;
+#ifdef AIO_URING
+    int fd;
+    struct iovec iov;
+#endif
+};
+
+#ifdef AIO_URING
+typedef struct uring
+{
+    int fd;
+    int wake_fd;                /* eventfd written on submit, polled through the ring */
+    unsigned entries;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} uring_t;
+#endif
+
+static struct aio_state
+{
+    int initialized;
+    aio_backend_t backend;
+    int depth;
+
+    mutex_t lock;
+    cond_t work;                /* signalled when a request is queued */
+    cond_t done;                /* broadcast when a request completes */
+
+    aio_req_t *head, *tail;     /* requests not yet picked up */
+    int writes_pending;
+    const char *write_error;
+
+    thread_t threads[AIO_MAX_THREADS];
+    int num_threads;
+#ifdef AIO_URING
+    uring_t ring;
+#endif
+} aio;
+
+static void die(const char *message)
+{
+    fprintf(stderr, "aio: %s\n", message);
+    exit(1);
+}
+
+static char* copy_string(const char *str)
+{
+    char *copy = (char *) malloc(strlen(str) + 1);
+
+    if (!copy) { die("cannot allocate memory for request"); }
+    strcpy(copy, str);
+
+    return copy;
+}
+
+static aio_req_t* alloc_request(int op, const char *filename)
+{
+    aio_req_t *req = (aio_req_t *) calloc(1, sizeof(aio_req_t));
+
+    if (!req) { die("cannot allocate memory for request"); }
+
+    req->op       = op;
+    req->filename = copy_string(filename);
+
+    return req;
+}
+
+static void free_request(aio_req_t *req)
+{
+    free(req->filename);
+    free(req);
+}
+
+/* mark a request finished; writes are released here, reads by the waiter */
+static void complete_request(aio_req_t *req)
+{
+    mutex_lock(&aio.lock);
+
+    if (AIO_OP_WRITE == req->op) {
+        if (req->error && !aio.write_error) { aio.write_error = req->error; }
+        aio.writes_pending--;
+        free(req->data);
+        free_request(req);
+    } else {
+        req->done = 1;
+    }
+
+    cond_broadcast(&aio.done);
+    mutex_unlock(&aio.lock);
+}
+
+static void blocking_io(aio_req_t *req)
+{
+    FILE *fp = NULL;
+    long size;
+
+    if (AIO_OP_READ == req->op) {
+        if (NULL == (fp = fopen(req->filename, "rb"))) {
+            req->error = "cannot open file for reading";
+            return;
+        }
+
+        if (req->range) {
+            if (0 != fseek(fp, (long) req->start, SEEK_SET)) {
+                req->error = "cannot read image data from file";
+            } else if (NULL == (req->data = (unsigned char *) malloc(req->size > 0 ? req->size : 1))) {
+                req->error = "cannot allocate memory for file data";
+            } else {
+                req->size = fread(req->data, 1, req->size, fp);
+                if (ferror(fp)) { req->error = "cannot read image data from file"; }
+            }
+        } else if (0 != fseek(fp, 0, SEEK_END) || (size = ftell(fp)) < 0 || 0 != fseek(fp, 0, SEEK_SET)) {
+            req->error = "cannot read image data from file";
+        } else if (NULL == (req->data = (unsigned char *) malloc(size > 0 ? size : 1))) {
+            req->error = "cannot allocate memory for file data";
+        } else {
+            req->size = fread(req->data, 1, (size_t) size, fp);
+            if (req->size != (size_t) size) { req->error = "cannot read image data from file"; }
+        }
+    } else {
+        if (NULL == (fp = fopen(req->filename, "wb"))) {
+            req->error = "cannot open file for writing";
+            return;
+        }
+
+        if (fwrite(req->data, 1, req->size, fp) != req->size) {
+            req->error = "cannot write image data to file";
+        }
+    }
+
+    if (0 != fclose(fp) && !req->error) { req->error = "cannot write image data to file"; }
+}
+
+static void enqueue_request(aio_req_t *req)
+{
+    mutex_lock(&aio.lock);
+
+    if (AIO_OP_WRITE == req->op) { aio.writes_pending++; }
+
+    if (aio.tail) { aio.tail->next = req; } else { aio.head = req; }
+    aio.tail = req;
+
+    cond_signal(&aio.work);
+    mutex_unlock(&aio.lock);
+
+#ifdef AIO_URING
+    if (AIO_BACKEND_URING == aio.backend) {
+        /* end the ring thread's wait so it picks the request up */
+        unsigned long long one = 1;
+        ssize_t n = write(aio.ring.wake_fd, &one, sizeof(one));
+
+        (void) n;
+    }
+#endif
+}
+
+/* pop a queued request, the lock must be held */
+static aio_req_t* dequeue_request(void)
+{
+    aio_req_t *req = aio.head;
+
+    if (req) {
+        aio.head = req->next;
+        if (!aio.head) { aio.tail = NULL; }
+        req->next = NULL;
+    }
+
+    return req;
+}
+
+static void* io_thread_main(void *arg)
+{
+    aio_req_t *req;
+
+    (void) arg;
+
+    for (;;) {
+        mutex_lock(&aio.lock);
+        while (!aio.head) {
+            cond_wait(&aio.work, &aio.lock);
+        }
+        req = dequeue_request();
+        mutex_unlock(&aio.lock);
+
+        blocking_io(req);
+        complete_request(req);
+    }
+
+    return NULL;
+}
+
+#ifdef AIO_URING
+
+static int uring_setup(uring_t *ring, unsigned entries)
+{
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    unsigned char *sq_ptr, *cq_ptr;
+
+    memset(&p, 0, sizeof(p));
+
+    ring->fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0) { return -1; }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size) { sq_size = cq_size; }
+        cq_size = sq_size;
+    }
+
+    sq_ptr = (unsigned char *) mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                    ring->fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == sq_ptr) { close(ring->fd); return -1; }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    } else {
+        cq_ptr = (unsigned char *) mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                        ring->fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == cq_ptr) { close(ring->fd); return -1; }
+    }
+
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                                              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                              ring->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == (void *) ring->sqes) { close(ring->fd); return -1; }
+
+    ring->entries  = p.sq_entries;
+    ring->sq_tail  = (unsigned *) (sq_ptr + p.sq_off.tail);
+    ring->sq_mask  = (unsigned *) (sq_ptr + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq_ptr + p.sq_off.array);
+    ring->cq_head  = (unsigned *) (cq_ptr + p.cq_off.head);
+    ring->cq_tail  = (unsigned *) (cq_ptr + p.cq_off.tail);
+    ring->cq_mask  = (unsigned *) (cq_ptr + p.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *) (cq_ptr + p.cq_off.cqes);
+
+    ring->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ring->wake_fd < 0) { close(ring->fd); return -1; }
+
+    return 0;
+}
+
+
+/* open the file and size the buffer; returns 0 when the request is already finished */
+static int uring_open(aio_req_t *req)
+{
+    struct stat st;
+
+    if (AIO_OP_READ == req->op) {
+        if ((req->fd = open(req->filename, O_RDONLY)) < 0) {
+            req->error = "cannot open file for reading";
+            return 0;
+        }
+        if (0 != fstat(req->fd, &st)) {
+            req->error = "cannot read image data from file";
+            return 0;
+        }
+        if (!req->range) {
+            req->size = (size_t) st.st_size;
+        } else if ((size_t) st.st_size < req->start + req->size) {
+            req->size = (size_t) st.st_size > req->start ? (size_t) st.st_size - req->start : 0;
+        }
+        if (NULL == (req->data = (unsigned char *) malloc(req->size > 0 ? req->size : 1))) {
+            req->error = "cannot allocate memory for file data";
+            return 0;
+        }
+    } else {
+        if ((req->fd = open(req->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            req->error = "cannot open file for writing";
+            return 0;
+        }
+    }
+
+    return req->size > 0;
+}
+
+static void uring_finish(aio_req_t *req)
+{
+    if (req->fd >= 0) { close(req->fd); }
+    complete_request(req);
+}
+
+static void uring_queue(uring_t *ring, aio_req_t *req)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    size_t remain = req->size - req->offset;
+
+    req->iov.iov_base = req->data + req->offset;
+    req->iov.iov_len  = remain > AIO_URING_CHUNK ? AIO_URING_CHUNK : remain;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = AIO_OP_READ == req->op ? IORING_OP_READV : IORING_OP_WRITEV;
+    sqe->fd        = req->fd;
+    sqe->addr      = (unsigned long) &req->iov;
+    sqe->len       = 1;
+    sqe->off       = req->start + req->offset;
+    sqe->user_data = (unsigned long) req;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* arm a one-shot poll of the wake eventfd; its completion has user_data 0 */
+static void uring_queue_wake_poll(uring_t *ring)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode      = IORING_OP_POLL_ADD;
+    sqe->fd          = ring->wake_fd;
+    sqe->poll_events = POLLIN;
+    sqe->user_data   = 0;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Ring thread: moves queued requests into the submission ring (up to the ring
+ * depth), submits them and waits for completions. A poll of wake_fd stays
+ * armed in the ring, so a submitter's write to it ends the wait and new
+ * requests go out while earlier ones are still in flight. SQEs the kernel
+ * did not consume stay in the ring and are submitted on the next pass;
+ * partial transfers are resubmitted at the new offset.
+ */
+static void* uring_thread_main(void *arg)
+{
+    uring_t *ring = &aio.ring;
+    aio_req_t *retry = NULL, *fresh = NULL, *req;
+    unsigned inflight = 0, pending = 0, retries = 0, queued, head, tail;
+    int armed = 0, ret;
+
+    (void) arg;
+
+    for (;;) {
+        /* inflight and pending count the wake poll, so it always has its slot */
+        if (!armed) {
+            uring_queue_wake_poll(ring);
+            pending++;
+            armed = 1;
+        }
+
+        queued = 0;
+
+        mutex_lock(&aio.lock);
+        while (aio.head && inflight + pending + retries + queued < ring->entries) {
+            req = dequeue_request();
+            req->next = fresh;
+            fresh = req;
+            queued++;
+        }
+        mutex_unlock(&aio.lock);
+
+        retries = 0;
+        while (retry) {
+            req = retry;
+            retry = req->next;
+            uring_queue(ring, req);
+            pending++;
+        }
+        while (fresh) {
+            req = fresh;
+            fresh = req->next;
+            req->fd = -1;
+            if (uring_open(req)) {
+                uring_queue(ring, req);
+                pending++;
+            } else {
+                uring_finish(req);
+            }
+        }
+
+        /* submit what is pending and wait for a completion or a wake-up */
+        do {
+            ret = (int) syscall(__NR_io_uring_enter, ring->fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        } while (ret < 0 && EINTR == errno);
+
+        if (ret < 0 && (EAGAIN == errno || EBUSY == errno)) {
+            /* nothing consumed: let completions drain, then try again */
+            ret = 0;
+            if (inflight > 0) {
+                syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            } else {
+                usleep(1000);
+            }
+        }
+        if (ret < 0) { die("io_uring_enter failed"); }
+
+        pending  -= (unsigned) ret;
+        inflight += (unsigned) ret;
+
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+            req = (aio_req_t *) (unsigned long) cqe->user_data;
+            inflight--;
+            head++;
+
+            if (!req) {
+                unsigned long long count;
+                ssize_t n = read(ring->wake_fd, &count, sizeof(count));
+
+                (void) n;
+                armed = 0;
+            } else if (cqe->res <= 0) {
+                req->error = AIO_OP_READ == req->op ? "cannot read image data from file"
+                                                    : "cannot write image data to file";
+                uring_finish(req);
+            } else if ((req->offset += (size_t) cqe->res) < req->size) {
+                req->next = retry;
+                retry = req;
+                retries++;
+            } else {
+                uring_finish(req);
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+#endif
+
+static aio_backend_t default_backend(void)
+{
+    char *env = getenv("PPMTOOLS_AIO");
+
+    if (env && 0 == strcmp(env, "sync"))    { return AIO_BACKEND_SYNC; }
+    if (env && 0 == strcmp(env, "threads")) { return AIO_BACKEND_THREADS; }
+
+#ifdef AIO_URING
+    return AIO_BACKEND_URING;
+#else
+    return AIO_BACKEND_THREADS;
+#endif
+}
+
+/*
+ * Start the I/O backend. queue_depth bounds the requests in flight in the
+ * ring, or the number of I/O threads for the thread pool. Falls back to the
+ * thread pool when io_uring is not compiled in or refused by the kernel.
+ */
+void aio_init(aio_backend_t backend, int queue_depth)
+{
+    int i;
+
+    if (aio.initialized) { return; }
+
+    aio.initialized = 1;
+    aio.depth       = queue_depth > 0 ? queue_depth : AIO_DEFAULT_DEPTH;
+
+    mutex_init(&aio.lock);
+    cond_init(&aio.work);
+    cond_init(&aio.done);
+
+#ifdef AIO_URING
+    if (AIO_BACKEND_URING == backend) {
+        /* one more entry for the wake poll */
+        if (0 == uring_setup(&aio.ring, (unsigned) aio.depth + 1)) {
+            aio.backend     = AIO_BACKEND_URING;
+            aio.num_threads = 1;
+            thread_create(&aio.threads[0], uring_thread_main, NULL);
+            return;
+        }
+        backend = AIO_BACKEND_THREADS;
+    }
+#else
+    if (AIO_BACKEND_URING == backend) { backend = AIO_BACKEND_THREADS; }
+#endif
+
+    aio.backend = backend;
+
+    if (AIO_BACKEND_THREADS == backend) {
+        aio.num_threads = aio.depth > AIO_MAX_THREADS ? AIO_MAX_THREADS : aio.depth;
+        for (i = 0; i < aio.num_threads; i++) {
+            thread_create(&aio.threads[i], io_thread_main, NULL);
+        }
+    }
+}
+
+aio_backend_t aio_get_backend(void)
+{
+    if (!aio.initialized) { aio_init(default_backend(), 0); }
+
+    return aio.backend;
+}
+
+const char* aio_backend_name(void)
+{
+    switch (aio_get_backend()) {
+    case AIO_BACKEND_URING:   return "io_uring";
+    case AIO_BACKEND_THREADS: return "threads";
+    default:                  return "sync";
+    }
+}
+
+/* queue a whole-file read; the data is collected with aio_read_wait() */
+aio_req_t* aio_read_submit(const char *filename)
+{
+    aio_req_t *req = alloc_request(AIO_OP_READ, filename);
+
+    if (AIO_BACKEND_SYNC == aio_get_backend()) {
+        blocking_io(req);
+        req->done = 1;
+    } else {
+        enqueue_request(req);
+    }
+
+    return req;
+}
+
+/*
+ * Queue a read of at most 'size' bytes at file offset 'start'; fewer come
+ * back at the end of the file. Collected with aio_read_wait() as well.
+ */
+aio_req_t* aio_read_range_submit(const char *filename, size_t start, size_t size)
+{
+    aio_req_t *req = alloc_request(AIO_OP_READ, filename);
+
+    req->range = 1;
+    req->start = start;
+    req->size  = size;
+
+    if (AIO_BACKEND_SYNC == aio_get_backend()) {
+        blocking_io(req);
+        req->done = 1;
+    } else {
+        enqueue_request(req);
+    }
+
+    return req;
+}
+
+/* wait for a read and take its buffer; the request is released */
+unsigned char* aio_read_wait(aio_req_t *req, size_t *size)
+{
+    unsigned char *data;
+
+    if (AIO_BACKEND_SYNC != aio.backend) {
+        mutex_lock(&aio.lock);
+        while (!req->done) {
+            cond_wait(&aio.done, &aio.lock);
+        }
+        mutex_unlock(&aio.lock);
+    }
+
+    if (req->error) {
+        fprintf(stderr, "aio: %s '%s'\n", req->error, req->filename);
+        exit(1);
+    }
+
+    data  = req->data;
+    *size = req->size;
+    free_request(req);
+
+    return data;
+}
+
+/* queue a whole-file write; the request owns 'data' and frees it when done */
+void aio_write_submit(const char *filename, unsigned char *data, size_t size)
+{
+    aio_req_t *req = alloc_request(AIO_OP_WRITE, filename);
+
+    req->data = data;
+    req->size = size;
+
+    if (AIO_BACKEND_SYNC == aio_get_backend()) {
+        blocking_io(req);
+        if (req->error) { die(req->error); }
+        free(req->data);
+        free_request(req);
+    } else {
+        enqueue_request(req);
+    }
+}
+
+/* block until every submitted write has reached the file system */
+void aio_flush(void)
+{
+    if (!aio.initialized || AIO_BACKEND_SYNC == aio.backend) { return; }
+
+    mutex_lock(&aio.lock);
+    while (aio.writes_pending > 0) {
+        cond_wait(&aio.done, &aio.lock);
+    }
+    mutex_unlock(&aio.lock);
+
+    if (aio.write_error) { die(aio.write_error); }
+}
@@ -0,0 +1,34 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct aio_req aio_req_t;
+
+typedef enum aio_backend
+{
+    AIO_BACKEND_SYNC = 0,       /* blocking I/O on the calling thread */
+    AIO_BACKEND_THREADS,        /* blocking I/O on a pool of I/O threads */
+    AIO_BACKEND_URING           /* io_uring submission/completion ring */
+} aio_backend_t;
+
+void          aio_init(aio_backend_t backend, int queue_depth);
+aio_backend_t aio_get_backend(void);
+const char*   aio_backend_name(void);
+
+aio_req_t*     aio_read_submit(const char *filename);
+aio_req_t*     aio_read_range_submit(const char *filename, size_t start, size_t size);
+unsigned char* aio_read_wait(aio_req_t *req, size_t *size);
+
+void aio_write_submit(const char *filename, unsigned char *data, size_t size);
+void aio_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AIO_H */
@@ -0,0 +1,342 @@
+/*
+ * compare.c: change detection between two images of the same size.
+ *
+ * The frame is cut into square tiles and rows of tiles are spread over
+ * threads. Within a tile every row segment is first checked with memcmp,
+ * so unchanged areas cost a memory compare; only segments that differ are
+ * scanned for the per-pixel difference. Each tile owns its result slot, so
+ * the workers share no state. Byte-identical files are recognized before
+ * they are decoded; both inputs are passed to the read hook either way.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "compare.h"
+#include "pgm.h"
+#include "aio.h"
+#include "thread.h"
+
+typedef struct compare_job
+{
+    u_short **a;
+    u_short **b;
+    int channels;
+    int width;
+    int height;
+    int tile;
+    int threshold;
+    int tiles_x;
+    tile_diff_t *tiles;     /* every tile, tiles_x per tile row */
+} compare_job_t;
+
+static void die(char *message)
+{
+    fprintf(stderr, "compare: %s\n", message);
+    exit(1);
+}
+
+static void compare_tile(compare_job_t *job, tile_diff_t *t, int *diff)
+{
+    int c, x, y;
+
+    for (y = t->y; y < t->y + t->height; y++) {
+        size_t offset = (size_t) y * job->width + t->x;
+        int dirty = 0;
+
+        for (c = 0; c < job->channels; c++) {
+            const u_short *a = job->a[c] + offset;
+            const u_short *b = job->b[c] + offset;
+
+            if (0 == memcmp(a, b, t->width * sizeof(u_short))) { continue; }
+
+            if (!dirty) {
+                memset(diff, 0, t->width * sizeof(int));
+                dirty = 1;
+            }
+
+            for (x = 0; x < t->width; x++) {
+                int d = a[x] - b[x];
+
+                d = d < 0 ? -d : d;
+                diff[x] = d > diff[x] ? d : diff[x];
+            }
+        }
+
+        if (!dirty) { continue; }
+
+        for (x = 0; x < t->width; x++) {
+            if (diff[x] > t->max_diff) { t->max_diff = diff[x]; }
+            if (diff[x] > job->threshold) { t->changed++; }
+        }
+    }
+}
+
+static void compare_rows(void *arg, int begin, int end)
+{
+    compare_job_t *job = (compare_job_t *) arg;
+    int *diff = (int *) malloc(job->tile * sizeof(int));
+    int i, j;
+
+    if (!diff) { die("cannot allocate memory for scratch row"); }
+
+    for (j = begin; j < end; j++) {
+        for (i = 0; i < job->tiles_x; i++) {
+            tile_diff_t *t = job->tiles + (size_t) j * job->tiles_x + i;
+
+            t->x        = i * job->tile;
+            t->y        = j * job->tile;
+            t->width    = job->width - t->x < job->tile ? job->width - t->x : job->tile;
+            t->height   = job->height - t->y < job->tile ? job->height - t->y : job->tile;
+            t->max_diff = 0;
+            t->changed  = 0;
+
+            compare_tile(job, t, diff);
+        }
+    }
+
+    free(diff);
+}
+
+/*
+ * Compare the planes of two images tile by tile. A tile is dirty when one of
+ * its samples differs by more than threshold.
+ */
+image_diff_t* compare_planes(u_short **a, u_short **b, int channels, int width, int height,
+                             int tile, int threshold)
+{
+    image_diff_t *diff = (image_diff_t *) calloc(1, sizeof(image_diff_t));
+    compare_job_t job;
+    int tiles_y, i, n;
+
+    if (!diff) { die("cannot allocate memory for tile list"); }
+
+    job.a         = a;
+    job.b         = b;
+    job.channels  = channels;
+    job.width     = width;
+    job.height    = height;
+    job.tile      = tile;
+    job.threshold = threshold;
+    job.tiles_x   = (width + tile - 1) / tile;
+    tiles_y       = (height + tile - 1) / tile;
+    n             = job.tiles_x * tiles_y;
+    job.tiles     = (tile_diff_t *) malloc((n + 1) * sizeof(tile_diff_t));
+
+    if (!job.tiles) { die("cannot allocate memory for tile list"); }
+
+    parallel_for_bytes(tiles_y, 1, (size_t) 2 * tile * width * channels * sizeof(u_short), compare_rows, &job);
+
+    diff->width     = width;
+    diff->height    = height;
+    diff->tile      = tile;
+    diff->threshold = threshold;
+    diff->tiles     = job.tiles;
+
+    /* keep the dirty tiles, in place */
+    for (i = 0; i < n; i++) {
+        tile_diff_t *t = job.tiles + i;
+
+        if (t->max_diff > diff->max_diff) { diff->max_diff = t->max_diff; }
+        if (t->max_diff > threshold) { diff->tiles[diff->count++] = *t; }
+    }
+
+    return diff;
+}
+
+void free_image_diff(image_diff_t *diff)
+{
+    if (!diff) { return; }
+
+    free(diff->tiles);
+    free(diff);
+}
+
+/* write the dirty tiles of the second image to prefix_x_y.ppm (or .pgm) */
+static void write_tiles(image_diff_t *diff, u_short **planes, int channels, int maxval, char *prefix)
+{
+    char *name = (char *) malloc(strlen(prefix) + 32);
+    int i, c, y;
+
+    if (!name) { die("cannot allocate memory for file name"); }
+
+    for (i = 0; i < diff->count; i++) {
+        tile_diff_t *t = diff->tiles + i;
+        u_short *dst[3];
+        ppm_t *ppm = NULL;
+        pgm_t *pgm = NULL;
+
+        if (3 == channels) {
+            ppm = alloc_ppm_buffer(t->width, t->height, maxval);
+            if (!ppm) { die("cannot allocate memory for tile"); }
+            dst[0] = ppm->ch1;
+            dst[1] = ppm->ch2;
+            dst[2] = ppm->ch3;
+        } else {
+            pgm = alloc_pgm_buffer(t->width, t->height, maxval);
+            if (!pgm) { die("cannot allocate memory for tile"); }
+            dst[0] = pgm->ch;
+        }
+
+        for (c = 0; c < channels; c++) {
+            for (y = 0; y < t->height; y++) {
+                memcpy(dst[c] + (size_t) y * t->width,
+                       planes[c] + (size_t) (t->y + y) * diff->width + t->x,
+                       t->width * sizeof(u_short));
+            }
+        }
+
+        if (ppm) {
+            sprintf(name, "%s_%d_%d.ppm", prefix, t->x, t->y);
+            write_ppm_image(ppm, name);
+            free_ppm_buffer(ppm);
+        } else {
+            sprintf(name, "%s_%d_%d.pgm", prefix, t->x, t->y);
+            write_pgm_image(pgm, name);
+            free_pgm_buffer(pgm);
+        }
+    }
+
+    free(name);
+}
+
+/*
+ * Compare two PPM or PGM files. Byte-identical files return an empty
+ * result without being decoded. With a prefix, the dirty tiles of the
+ * second file are written out.
+ */
+image_diff_t* compare_files(char *name1, char *name2, int tile, int threshold, char *prefix)
+{
+    aio_req_t *req1 = aio_read_submit(name1);
+    aio_req_t *req2 = aio_read_submit(name2);
+    size_t size1 = 0, size2 = 0;
+    u_char *data1 = aio_read_wait(req1, &size1);
+    u_char *data2 = aio_read_wait(req2, &size2);
+    int gray = size1 > 1 && '5' == data1[1];
+    image_diff_t *diff = NULL;
+    ppm_hook_t ppm_hook = get_ppm_read_hook();
+    pgm_hook_t pgm_hook = get_pgm_read_hook();
+    u_short *a[3], *b[3];
+    int width, height, maxval;
+
+    if (size1 == size2 && 0 == memcmp(data1, data2, size1)) {
+        if (gray) {
+            read_pgm_header(data1, size1, &width, &height, &maxval);
+        } else {
+            read_ppm_header(data1, size1, &width, &height, &maxval);
+        }
+
+        if (!(diff = (image_diff_t *) calloc(1, sizeof(image_diff_t)))) {
+            die("cannot allocate memory for tile list");
+        }
+
+        diff->width     = width;
+        diff->height    = height;
+        diff->tile      = tile;
+        diff->threshold = threshold;
+
+        /* the read hook still sees both files, decoded once */
+        if (gray && pgm_hook) {
+            pgm_t *image = decode_pgm_image(data1, size1);
+
+            pgm_hook(image, name1);
+            pgm_hook(image, name2);
+            free_pgm_buffer(image);
+        } else if (!gray && ppm_hook) {
+            ppm_t *image = decode_ppm_image(data1, size1);
+
+            ppm_hook(image, name1);
+            ppm_hook(image, name2);
+            free_ppm_buffer(image);
+        }
+    } else if (gray) {
+        pgm_t *src = decode_pgm_image(data1, size1);
+        pgm_t *dst = decode_pgm_image(data2, size2);
+
+        if (pgm_hook) { pgm_hook(src, name1); pgm_hook(dst, name2); }
+        if (src->width != dst->width || src->height != dst->height) { die("images differ in size"); }
+
+        a[0] = src->ch;
+        b[0] = dst->ch;
+        diff = compare_planes(a, b, 1, src->width, src->height, tile, threshold);
+        if (prefix) { write_tiles(diff, b, 1, dst->maxval, prefix); }
+
+        free_pgm_buffer(src);
+        free_pgm_buffer(dst);
+    } else {
+        ppm_t *src = decode_ppm_image(data1, size1);
+        ppm_t *dst = decode_ppm_image(data2, size2);
+
+        if (ppm_hook) { ppm_hook(src, name1); ppm_hook(dst, name2); }
+        if (src->width != dst->width || src->height != dst->height) { die("images differ in size"); }
+
+        a[0] = src->ch1; a[1] = src->ch2; a[2] = src->ch3;
+        b[0] = dst->ch1; b[1] = dst->ch2; b[2] = dst->ch3;
+        diff = compare_planes(a, b, 3, src->width, src->height, tile, threshold);
+        if (prefix) { write_tiles(diff, b, 3, dst->maxval, prefix); }
+
+        free_ppm_buffer(src);
+        free_ppm_buffer(dst);
+    }
+
+    free(data1);
+    free(data2);
+
+    return diff;
+}
+
+static void print_json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        if ('"' == *s || '\\' == *s) {
+            fprintf(fp, "\\%c", *s);
+        } else if ((u_char) *s < 0x20) {
+            fprintf(fp, "\\u%04x", (u_char) *s);
+        } else {
+            fputc(*s, fp);
+        }
+    }
+    fputc('"', fp);
+}
+
+/* JSON report: overall result, bounding box of all dirty tiles and the tile list */
+void print_diff_json(FILE *fp, char *name1, char *name2, image_diff_t *diff)
+{
+    int x0 = diff->width, y0 = diff->height, x1 = 0, y1 = 0, i;
+
+    for (i = 0; i < diff->count; i++) {
+        tile_diff_t *t = diff->tiles + i;
+
+        if (t->x < x0) { x0 = t->x; }
+        if (t->y < y0) { y0 = t->y; }
+        if (t->x + t->width > x1) { x1 = t->x + t->width; }
+        if (t->y + t->height > y1) { y1 = t->y + t->height; }
+    }
+
+    fprintf(fp, "{\n  \"file1\": ");
+    print_json_string(fp, name1);
+    fprintf(fp, ",\n  \"file2\": ");
+    print_json_string(fp, name2);
+    fprintf(fp, ",\n");
+    fprintf(fp, "  \"width\": %d,\n  \"height\": %d,\n", diff->width, diff->height);
+    fprintf(fp, "  \"tile\": %d,\n  \"threshold\": %d,\n", diff->tile, diff->threshold);
+    fprintf(fp, "  \"identical\": %s,\n  \"max_diff\": %d,\n", 0 == diff->max_diff ? "true" : "false",
+            diff->max_diff);
+    fprintf(fp, "  \"dirty_tiles\": %d,\n", diff->count);
+
+    if (diff->count > 0) {
+        fprintf(fp, "  \"bbox\": { \"x\": %d, \"y\": %d, \"width\": %d, \"height\": %d },\n",
+                x0, y0, x1 - x0, y1 - y0);
+    } else {
+        fprintf(fp, "  \"bbox\": null,\n");
+    }
+
+    fprintf(fp, "  \"tiles\": [");
+    for (i = 0; i < diff->count; i++) {
+        tile_diff_t *t = diff->tiles + i;
+
+        fprintf(fp, "%s\n    { \"x\": %d, \"y\": %d, \"width\": %d, \"height\": %d, \"max_diff\": %d, \"changed\": %u }",
+                i ? "," : "", t->x, t->y, t->width, t->height, t->max_diff, t->changed);
+    }
+    fprintf(fp, "%s]\n}\n", diff->count ? "\n  " : "");
+}
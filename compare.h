@@ -0,0 +1,43 @@
+#ifndef COMPARE_H
+#define COMPARE_H
+
+#include <stdio.h>
+#include "ppm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* one tile whose largest sample difference is above the threshold */
+typedef struct tile_diff
+{
+    int x;
+    int y;
+    int width;
+    int height;
+    int max_diff;
+    unsigned changed;       /* pixels with a channel difference above the threshold */
+} tile_diff_t;
+
+typedef struct image_diff
+{
+    int width;
+    int height;
+    int tile;
+    int threshold;
+    int max_diff;
+    int count;              /* number of dirty tiles */
+    tile_diff_t *tiles;     /* dirty tiles in raster order */
+} image_diff_t;
+
+image_diff_t* compare_planes(u_short **a, u_short **b, int channels, int width, int height,
+                             int tile, int threshold);
+image_diff_t* compare_files(char *name1, char *name2, int tile, int threshold, char *prefix);
+void          free_image_diff(image_diff_t *diff);
+void          print_diff_json(FILE *fp, char *name1, char *name2, image_diff_t *diff);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMPARE_H */
@@ -0,0 +1,434 @@
+/*
+ * filter.c: integer convolution with separable or small 2D kernels.
+ *
+ * Rows are spread over threads in contiguous strips. Each strip keeps a
+ * ring of 'height' intermediate rows in its own scratch: a source row is
+ * copied once into a padded int row with the edge samples replicated, so
+ * the tap loops never clamp, and (separable case) filtered horizontally
+ * into the ring. Every output row is then a vertical sum over the ring.
+ * All inner loops run across x over contiguous ints and vectorize.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "filter.h"
+#include "thread.h"
+
+typedef struct filter_job
+{
+    plane_t *src;
+    plane_t *dst;
+    kernel_t *kernel;
+    int maxval;
+    int shift;          /* log2(divisor), or -1 when not a power of two */
+} filter_job_t;
+
+typedef struct preset
+{
+    const char *name;
+    const char *spec;
+} preset_t;
+
+static const preset_t presets[] = {
+    { "box3",    "sep:1,1,1" },
+    { "box5",    "sep:1,1,1,1,1" },
+    { "gauss3",  "sep:1,2,1" },
+    { "gauss5",  "sep:1,4,6,4,1" },
+    { "gauss7",  "sep:1,6,15,20,15,6,1" },
+    { "sharpen", "2d:3x3:0,-1,0,-1,5,-1,0,-1,0" },
+    { "sobel-x", "sep:-1,0,1/1,2,1" },
+    { "sobel-y", "sep:1,2,1/-1,0,1" },
+    { "laplace", "2d:3x3:0,1,0,1,-4,1,0,1,0" },
+    { NULL,      NULL }
+};
+
+static void die(char *message)
+{
+    fprintf(stderr, "filter: %s\n", message);
+    exit(1);
+}
+
+/* parse up to max comma or blank separated integers, returns the count */
+static int parse_taps(char **text, int *taps, int max)
+{
+    char *p = *text, *end;
+    int n = 0;
+
+    for (;;) {
+        while (' ' == *p || '\t' == *p || ',' == *p) { p++; }
+
+        taps[n] = (int) strtol(p, &end, 10);
+        if (end == p) { break; }
+        if (++n > max) { die("too many kernel taps"); }
+        p = end;
+    }
+
+    *text = p;
+    return n;
+}
+
+static kernel_t* alloc_kernel(int separable, int width, int height)
+{
+    kernel_t *kernel = (kernel_t *) calloc(1, sizeof(kernel_t));
+
+    if (!kernel) { die("cannot allocate memory for kernel"); }
+
+    if (0 == (width & 1) || 0 == (height & 1)) { die("kernel size must be odd"); }
+
+    kernel->separable = separable;
+    kernel->width     = width;
+    kernel->height    = height;
+
+    if (separable) {
+        kernel->h = (int *) malloc(width * sizeof(int));
+        kernel->v = (int *) malloc(height * sizeof(int));
+        if (!kernel->h || !kernel->v) { die("cannot allocate memory for kernel"); }
+    } else {
+        kernel->k = (int *) malloc((size_t) width * height * sizeof(int));
+        if (!kernel->k) { die("cannot allocate memory for kernel"); }
+    }
+
+    return kernel;
+}
+
+/* normalize by the tap sum; zero-sum kernels (edges, gradients) give |sum| */
+static void set_divisor(kernel_t *kernel, long long sum)
+{
+    kernel->divisor  = (int) (sum != 0 ? (sum < 0 ? -sum : sum) : 1);
+    kernel->absolute = sum <= 0;
+}
+
+static long long tap_sum(const int *taps, int n)
+{
+    long long sum = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        sum += taps[i];
+    }
+
+    return sum;
+}
+
+static kernel_t* parse_spec(char *spec);
+
+/*
+ * A kernel file holds either a spec string or a matrix of integers, one
+ * kernel row per line ('#' starts a comment). A single row is applied
+ * separably in both directions.
+ */
+static kernel_t* read_kernel_file(char *filename)
+{
+    FILE *fp = fopen(filename, "r");
+    int taps[FILTER_MAX_TAPS * FILTER_MAX_TAPS + 1];
+    int width = 0, height = 0, n = 0;
+    char line[4096];
+    kernel_t *kernel;
+
+    if (!fp) { die("cannot open kernel file"); }
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = line, *hash = strchr(line, '#');
+        int count;
+
+        if (hash) { *hash = 0; }
+        while (isspace((u_char) *p)) { p++; }
+        if (0 == *p) { continue; }
+
+        if (0 == height && (0 == strncmp(p, "sep:", 4) || 0 == strncmp(p, "2d:", 3))) {
+            fclose(fp);
+            return parse_spec(p);
+        }
+
+        count = parse_taps(&p, taps + n, FILTER_MAX_TAPS * FILTER_MAX_TAPS - n);
+        if (!isspace((u_char) *p) && 0 != *p) { die("invalid kernel file"); }
+        if (0 == count) { continue; }
+        if (height > 0 && count != width) { die("kernel rows differ in length"); }
+
+        width = count;
+        n += count;
+        if (++height > FILTER_MAX_TAPS) { die("too many kernel rows"); }
+    }
+
+    fclose(fp);
+
+    if (0 == height) { die("empty kernel file"); }
+    if (width > FILTER_MAX_TAPS) { die("too many kernel taps"); }
+
+    if (1 == height) {
+        kernel = alloc_kernel(1, width, width);
+        memcpy(kernel->h, taps, width * sizeof(int));
+        memcpy(kernel->v, taps, width * sizeof(int));
+        set_divisor(kernel, tap_sum(taps, width) * tap_sum(taps, width));
+    } else {
+        kernel = alloc_kernel(0, width, height);
+        memcpy(kernel->k, taps, n * sizeof(int));
+        set_divisor(kernel, tap_sum(taps, n));
+    }
+
+    return kernel;
+}
+
+static kernel_t* parse_spec(char *spec)
+{
+    int h[FILTER_MAX_TAPS + 1], v[FILTER_MAX_TAPS + 1];
+    kernel_t *kernel;
+    char *p;
+
+    if (0 == strncmp(spec, "sep:", 4)) {
+        int nh, nv;
+
+        p  = spec + 4;
+        nh = parse_taps(&p, h, FILTER_MAX_TAPS);
+
+        if ('/' == *p) {
+            p++;
+            nv = parse_taps(&p, v, FILTER_MAX_TAPS);
+        } else {
+            memcpy(v, h, nh * sizeof(int));
+            nv = nh;
+        }
+
+        while (isspace((u_char) *p)) { p++; }
+        if (0 == nh || 0 == nv || 0 != *p) { die("invalid separable kernel"); }
+
+        kernel = alloc_kernel(1, nh, nv);
+        memcpy(kernel->h, h, nh * sizeof(int));
+        memcpy(kernel->v, v, nv * sizeof(int));
+        set_divisor(kernel, tap_sum(h, nh) * tap_sum(v, nv));
+
+        return kernel;
+    }
+
+    if (0 == strncmp(spec, "2d:", 3)) {
+        int width = 0, height = 0, n, len = 0;
+        int *taps;
+
+        if (2 != sscanf(spec + 3, "%dx%d:%n", &width, &height, &len) || 0 == len ||
+            width < 1 || height < 1 || width > FILTER_MAX_TAPS || height > FILTER_MAX_TAPS) {
+            die("invalid 2d kernel");
+        }
+
+        kernel = alloc_kernel(0, width, height);
+        taps   = (int *) malloc(((size_t) width * height + 1) * sizeof(int));
+        if (!taps) { die("cannot allocate memory for kernel"); }
+
+        p = spec + 3 + len;
+        n = parse_taps(&p, taps, width * height);
+
+        while (isspace((u_char) *p)) { p++; }
+        if (n != width * height || 0 != *p) { die("invalid 2d kernel"); }
+
+        memcpy(kernel->k, taps, n * sizeof(int));
+        set_divisor(kernel, tap_sum(taps, n));
+        free(taps);
+
+        return kernel;
+    }
+
+    die("unknown kernel");
+
+    return NULL;
+}
+
+/*
+ * Kernel from a preset name (box3, box5, gauss3, gauss5, gauss7, sharpen,
+ * sobel-x, sobel-y, laplace), "sep:h0,h1,..[/v0,v1,..]" for a separable
+ * kernel (v defaults to h), "2d:WxH:k0,k1,.." for a row-major 2D kernel,
+ * or "@file" for a kernel file.
+ */
+kernel_t* parse_kernel(char *spec)
+{
+    const preset_t *preset;
+
+    for (preset = presets; preset->name; preset++) {
+        if (0 == strcmp(spec, preset->name)) {
+            return parse_spec((char *) preset->spec);
+        }
+    }
+
+    if ('@' == spec[0]) {
+        return read_kernel_file(spec + 1);
+    }
+
+    return parse_spec(spec);
+}
+
+void free_kernel(kernel_t *kernel)
+{
+    if (!kernel) { return; }
+
+    free(kernel->h);
+    free(kernel->v);
+    free(kernel->k);
+    free(kernel);
+}
+
+/* copy source row y into pad[radius .. radius + width), replicating the edges */
+static void pad_row(const plane_t *src, int y, int *pad, int radius)
+{
+    const u_short *s;
+    int x, w = src->width;
+
+    y = y < 0 ? 0 : (y >= src->height ? src->height - 1 : y);
+    s = src->data + (size_t) y * src->stride;
+
+    for (x = 0; x < radius; x++) {
+        pad[x] = s[0];
+        pad[radius + w + x] = s[w - 1];
+    }
+    for (x = 0; x < w; x++) {
+        pad[radius + x] = s[x];
+    }
+}
+
+static void store_row(filter_job_t *job, const int *acc, u_short *d, int width)
+{
+    kernel_t *kernel = job->kernel;
+    int maxval = job->maxval, div = kernel->divisor, shift = job->shift;
+    int x;
+
+    for (x = 0; x < width; x++) {
+        int val = acc[x];
+
+        if (kernel->absolute) { val = val < 0 ? -val : val; }
+        val = val < 0 ? 0 : val;
+        val = shift >= 0 ? (val + (div >> 1)) >> shift : (val + div / 2) / div;
+
+        d[x] = (u_short) (val > maxval ? maxval : val);
+    }
+}
+
+static void filter_rows(void *arg, int begin, int end)
+{
+    filter_job_t *job = (filter_job_t *) arg;
+    plane_t *src = job->src;
+    kernel_t *kernel = job->kernel;
+    int width = src->width, kw = kernel->width, kh = kernel->height;
+    int rx = kw / 2, ry = kh / 2;
+    int pw = width + 2 * rx;
+    int rw = kernel->separable ? width : pw;
+    int *pad  = (int *) malloc((size_t) pw * sizeof(int));
+    int *ring = (int *) malloc((size_t) rw * kh * sizeof(int));
+    int *acc  = (int *) malloc((size_t) width * sizeof(int));
+    int i, j, x, y;
+
+    if (!pad || !ring || !acc) { die("cannot allocate memory for scratch rows"); }
+
+    /* source rows begin - ry .. end - 1 + ry, each entering the ring once */
+    for (y = begin - ry; y < end + ry; y++) {
+        int *row = ring + (size_t) (((y % kh) + kh) % kh) * rw;
+        int out = y - ry;
+
+        if (kernel->separable) {
+            pad_row(src, y, pad, rx);
+
+            for (x = 0; x < width; x++) {
+                row[x] = kernel->h[0] * pad[x];
+            }
+            for (j = 1; j < kw; j++) {
+                const int *p = pad + j;
+                int w = kernel->h[j];
+
+                if (0 == w) { continue; }
+
+                for (x = 0; x < width; x++) {
+                    row[x] += w * p[x];
+                }
+            }
+        } else {
+            pad_row(src, y, row, rx);
+        }
+
+        if (out < begin) { continue; }
+
+        /* the ring now holds rows out - ry .. out + ry */
+        memset(acc, 0, (size_t) width * sizeof(int));
+
+        for (i = 0; i < kh; i++) {
+            int r = out - ry + i;
+            const int *t = ring + (size_t) (((r % kh) + kh) % kh) * rw;
+
+            if (kernel->separable) {
+                int w = kernel->v[i];
+
+                if (0 == w) { continue; }
+
+                for (x = 0; x < width; x++) {
+                    acc[x] += w * t[x];
+                }
+            } else {
+                for (j = 0; j < kw; j++) {
+                    const int *p = t + j;
+                    int w = kernel->k[i * kw + j];
+
+                    if (0 == w) { continue; }
+
+                    for (x = 0; x < width; x++) {
+                        acc[x] += w * p[x];
+                    }
+                }
+            }
+        }
+
+        store_row(job, acc, job->dst->data + (size_t) out * job->dst->stride, width);
+    }
+
+    free(pad);
+    free(ring);
+    free(acc);
+}
+
+static long long abs_sum(const int *taps, int n)
+{
+    long long sum = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        sum += taps[i] < 0 ? -taps[i] : taps[i];
+    }
+
+    return sum;
+}
+
+/* convolve src into dst (same size, distinct buffers), clamping to maxval */
+void filter_plane(plane_t *src, plane_t *dst, kernel_t *kernel, int maxval)
+{
+    filter_job_t job;
+    long long gain;
+
+    if (kernel->separable) {
+        gain = abs_sum(kernel->h, kernel->width) * abs_sum(kernel->v, kernel->height);
+    } else {
+        gain = abs_sum(kernel->k, kernel->width * kernel->height);
+    }
+
+    /* all sums are kept in 32 bits */
+    if (gain * maxval + kernel->divisor > INT_MAX) { die("kernel gain too large for this bit depth"); }
+
+    job.src    = src;
+    job.dst    = dst;
+    job.kernel = kernel;
+    job.maxval = maxval;
+    job.shift  = -1;
+
+    if (0 == (kernel->divisor & (kernel->divisor - 1))) {
+        for (job.shift = 0; (1 << job.shift) < kernel->divisor; job.shift++) { }
+    }
+
+    parallel_for_bytes(dst->height, 16, (size_t) (src->width + dst->width) * sizeof(u_short), filter_rows, &job);
+}
+
+void filter_image(ppm_t *src, ppm_t *dst, kernel_t *kernel)
+{
+    int chan;
+
+    for (chan = 0; chan < 3; chan++) {
+        plane_t s = ppm_plane(src, chan);
+        plane_t d = ppm_plane(dst, chan);
+
+        filter_plane(&s, &d, kernel, src->maxval);
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "resample.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FILTER_MAX_TAPS 63
+
+/* integer convolution kernel, separable (h x v) or small 2D */
+typedef struct kernel
+{
+    int separable;
+    int width;          /* taps, odd */
+    int height;
+    int *h;             /* separable: width horizontal taps */
+    int *v;             /* separable: height vertical taps */
+    int *k;             /* 2D: height * width taps, row major */
+    int divisor;        /* result = sum / divisor, rounded */
+    int absolute;       /* take |sum| first, for gradient kernels */
+} kernel_t;
+
+kernel_t* parse_kernel(char *spec);
+void      free_kernel(kernel_t *kernel);
+
+void filter_plane(plane_t *src, plane_t *dst, kernel_t *kernel, int maxval);
+void filter_image(ppm_t *src, ppm_t *dst, kernel_t *kernel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FILTER_H */
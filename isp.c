@@ -0,0 +1,326 @@
+/*
+ * isp.c: one-pass raw development: black level, white balance, bilinear
+ * demosaic, 3x3 colour correction and gamma.
+ *
+ * Black level, white balance and the scaling to 16 bit linear values are
+ * folded into one lookup table per CFA colour, applied as a source row
+ * enters a per-thread ring of three padded rows. Each output row is then
+ * demosaiced from the ring, colour corrected in fixed point and mapped
+ * through a 64K-entry gamma table straight into the output planes, so the
+ * raw frame is read once and the RGB image written once. Rows are spread
+ * over threads in strips.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "isp.h"
+#include "thread.h"
+
+typedef struct isp_job
+{
+    pgm_t *src;
+    ppm_t *dst;
+    const int *color;           /* CFA colour (0 R, 1 G, 2 B) of the 2x2 cell */
+    u_short *lin[3];            /* input sample to linear 16 bit, per colour */
+    u_short *gamma;             /* linear 16 bit to output */
+    int ccm[9];                 /* Q ISP_CCM_BITS */
+} isp_job_t;
+
+static const int cfa_color[4][4] = {
+    { 0, 1, 1, 2 },     /* RGGB */
+    { 1, 0, 2, 1 },     /* GRBG */
+    { 1, 2, 0, 1 },     /* GBRG */
+    { 2, 1, 1, 0 }      /* BGGR */
+};
+
+static void die(char *message)
+{
+    fprintf(stderr, "isp: %s\n", message);
+    exit(1);
+}
+
+static void config_error(char *filename, int line)
+{
+    fprintf(stderr, "isp: %s:%d: invalid setting\n", filename, line);
+    exit(1);
+}
+
+/* parse exactly n numbers from text; returns 0 on a count mismatch */
+static int parse_numbers(char *text, double *value, int n)
+{
+    char *end;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        value[i] = strtod(text, &end);
+        if (end == text) { return 0; }
+        text = end;
+    }
+
+    while (isspace((u_char) *text)) { text++; }
+
+    return 0 == *text;
+}
+
+/*
+ * Read "key value.." lines ('#' starts a comment) over the defaults:
+ *   cfa rggb|grbg|gbrg|bggr     black R G B (or one value)   white level
+ *   wb R G B    ccm m00 .. m22    gamma srgb|linear|exponent    depth bits
+ *   format raw10|raw12|raw16    size WxH    stride bytes
+ */
+void read_isp_config(char *filename, isp_config_t *config)
+{
+    static const char *cfa_name[4] = { "rggb", "grbg", "gbrg", "bggr" };
+    static const char *raw_name[3] = { "raw10", "raw12", "raw16" };
+    FILE *fp = fopen(filename, "r");
+    char text[1024];
+    int line = 0, i;
+
+    memset(config, 0, sizeof(isp_config_t));
+    config->wb[0] = config->wb[1] = config->wb[2] = 1.0;
+    config->ccm[0] = config->ccm[4] = config->ccm[8] = 1.0;
+    config->depth = 8;
+
+    if (!fp) { die("cannot open config file"); }
+
+    while (fgets(text, sizeof(text), fp)) {
+        char *key = text, *value, *hash = strchr(text, '#');
+        double v[9];
+        int ok = 0;
+
+        line++;
+        if (hash) { *hash = 0; }
+
+        while (isspace((u_char) *key)) { key++; }
+        if (0 == *key) { continue; }
+
+        for (value = key; *value && !isspace((u_char) *value) && '=' != *value; value++) { }
+        if (*value) { *value++ = 0; }
+        while (isspace((u_char) *value) || '=' == *value) { value++; }
+        for (i = (int) strlen(value); i > 0 && isspace((u_char) value[i - 1]); i--) { value[i - 1] = 0; }
+
+        if (0 == strcmp(key, "cfa")) {
+            for (i = 0; i < 4; i++) {
+                if (0 == strcmp(value, cfa_name[i])) { config->cfa = (cfa_t) i; ok = 1; }
+            }
+        } else if (0 == strcmp(key, "black")) {
+            if ((ok = parse_numbers(value, v, 3))) {
+                for (i = 0; i < 3; i++) { config->black[i] = (int) v[i]; }
+            } else if ((ok = parse_numbers(value, v, 1))) {
+                for (i = 0; i < 3; i++) { config->black[i] = (int) v[0]; }
+            }
+        } else if (0 == strcmp(key, "white")) {
+            ok = parse_numbers(value, v, 1) && v[0] > 0;
+            config->white = (int) v[0];
+        } else if (0 == strcmp(key, "wb")) {
+            ok = parse_numbers(value, config->wb, 3);
+        } else if (0 == strcmp(key, "ccm")) {
+            ok = parse_numbers(value, config->ccm, 9);
+        } else if (0 == strcmp(key, "gamma")) {
+            if (0 == strcmp(value, "srgb")) {
+                config->gamma = 0.0;
+                ok = 1;
+            } else if (0 == strcmp(value, "linear")) {
+                config->gamma = 1.0;
+                ok = 1;
+            } else {
+                ok = parse_numbers(value, &config->gamma, 1) && config->gamma > 0.0;
+            }
+        } else if (0 == strcmp(key, "depth")) {
+            ok = parse_numbers(value, v, 1) && v[0] >= 1 && v[0] <= 16;
+            config->depth = (int) v[0];
+        } else if (0 == strcmp(key, "format")) {
+            for (i = 0; i < 3; i++) {
+                if (0 == strcmp(value, raw_name[i])) { config->format = (raw_format_t) i; ok = 1; }
+            }
+            config->raw = ok;
+        } else if (0 == strcmp(key, "size")) {
+            ok = 2 == sscanf(value, "%dx%d", &config->width, &config->height) &&
+                 config->width > 0 && config->height > 0;
+        } else if (0 == strcmp(key, "stride")) {
+            ok = parse_numbers(value, v, 1) && v[0] >= 0;
+            config->stride = (int) v[0];
+        }
+
+        if (!ok) { config_error(filename, line); }
+    }
+
+    fclose(fp);
+
+    if (config->raw && (0 == config->width || 0 == config->height)) {
+        die("raw input needs a size");
+    }
+
+    for (i = 0; i < 9; i++) {
+        if (fabs(config->ccm[i]) >= 8.0) { die("colour matrix entries must be below 8"); }
+    }
+}
+
+/* reflect row or column i into 0 .. n - 1, keeping the CFA parity */
+static int reflect(int i, int n)
+{
+    if (i < 0) { return -i < n ? -i : 0; }
+    if (i >= n) { return 2 * n - 2 - i >= 0 ? 2 * n - 2 - i : n - 1; }
+    return i;
+}
+
+/* linearize source row y into pad[1 .. width], with one reflected sample each side */
+static void load_row(isp_job_t *job, int y, u_short *pad)
+{
+    pgm_t *src = job->src;
+    int width = src->width, x;
+    const u_short *s;
+    const u_short *lut0, *lut1;
+
+    y    = reflect(y, src->height);
+    s    = src->ch + (size_t) y * width;
+    lut0 = job->lin[job->color[(y & 1) * 2]];
+    lut1 = job->lin[job->color[(y & 1) * 2 + 1]];
+
+    for (x = 0; x + 1 < width; x += 2) {
+        pad[x + 1] = lut0[s[x]];
+        pad[x + 2] = lut1[s[x + 1]];
+    }
+    if (x < width) { pad[x + 1] = lut0[s[x]]; }
+
+    pad[0]         = pad[1 + reflect(-1, width)];
+    pad[width + 1] = pad[1 + reflect(width, width)];
+}
+
+/*
+ * Bilinear demosaic of the samples x0, x0 + 2, .. of the row c (rows u and
+ * d above and below), all of CFA colour 'color'; hcolor is the colour of
+ * their horizontal neighbours.
+ */
+static void demosaic_run(const u_short *u, const u_short *c, const u_short *d, int x0, int width,
+                         int color, int hcolor, int *rgb[3])
+{
+    int x;
+
+    if (1 != color) {
+        int *same = rgb[color], *other = rgb[2 - color], *g = rgb[1];
+
+        for (x = x0; x < width; x += 2) {
+            same[x]  = c[x + 1];
+            g[x]     = (c[x] + c[x + 2] + u[x + 1] + d[x + 1] + 2) >> 2;
+            other[x] = (u[x] + u[x + 2] + d[x] + d[x + 2] + 2) >> 2;
+        }
+    } else {
+        int *h = rgb[hcolor], *v = rgb[2 - hcolor], *g = rgb[1];
+
+        for (x = x0; x < width; x += 2) {
+            g[x] = c[x + 1];
+            h[x] = (c[x] + c[x + 2] + 1) >> 1;
+            v[x] = (u[x + 1] + d[x + 1] + 1) >> 1;
+        }
+    }
+}
+
+static void isp_rows(void *arg, int begin, int end)
+{
+    isp_job_t *job = (isp_job_t *) arg;
+    int width = job->src->width;
+    u_short *ring = (u_short *) malloc((size_t) 3 * (width + 2) * sizeof(u_short));
+    int *rgb[3];
+    const int *m = job->ccm;
+    int x, y;
+
+    rgb[0] = (int *) malloc((size_t) 3 * width * sizeof(int));
+    rgb[1] = rgb[0] + width;
+    rgb[2] = rgb[1] + width;
+
+    if (!ring || !rgb[0]) { die("cannot allocate memory for scratch rows"); }
+
+    load_row(job, begin - 1, ring + (size_t) (((begin - 1) % 3 + 3) % 3) * (width + 2));
+    load_row(job, begin, ring + (size_t) (begin % 3) * (width + 2));
+
+    for (y = begin; y < end; y++) {
+        const u_short *u = ring + (size_t) (((y - 1) % 3 + 3) % 3) * (width + 2);
+        const u_short *c = ring + (size_t) (y % 3) * (width + 2);
+        u_short *d = ring + (size_t) ((y + 1) % 3) * (width + 2);
+        const int *color = job->color + (y & 1) * 2;
+        u_short *r = job->dst->ch1 + (size_t) y * width;
+        u_short *g = job->dst->ch2 + (size_t) y * width;
+        u_short *b = job->dst->ch3 + (size_t) y * width;
+
+        load_row(job, y + 1, d);
+
+        demosaic_run(u, c, d, 0, width, color[0], color[1], rgb);
+        demosaic_run(u, c, d, 1, width, color[1], color[0], rgb);
+
+        for (x = 0; x < width; x++) {
+            int R = rgb[0][x], G = rgb[1][x], B = rgb[2][x];
+            int cr = (m[0] * R + m[1] * G + m[2] * B + (1 << (ISP_CCM_BITS - 1))) >> ISP_CCM_BITS;
+            int cg = (m[3] * R + m[4] * G + m[5] * B + (1 << (ISP_CCM_BITS - 1))) >> ISP_CCM_BITS;
+            int cb = (m[6] * R + m[7] * G + m[8] * B + (1 << (ISP_CCM_BITS - 1))) >> ISP_CCM_BITS;
+
+            r[x] = job->gamma[cr < 0 ? 0 : (cr > USHRT_MAX ? USHRT_MAX : cr)];
+            g[x] = job->gamma[cg < 0 ? 0 : (cg > USHRT_MAX ? USHRT_MAX : cg)];
+            b[x] = job->gamma[cb < 0 ? 0 : (cb > USHRT_MAX ? USHRT_MAX : cb)];
+        }
+    }
+
+    free(ring);
+    free(rgb[0]);
+}
+
+/* develop a bayer plane into an RGB image of config->depth bits */
+ppm_t* isp_process(pgm_t *src, isp_config_t *config)
+{
+    int white = config->white ? config->white : src->maxval;
+    int outmax = (1 << config->depth) - 1;
+    isp_job_t job;
+    int c, i;
+
+    if (src->width < 2 || src->height < 2) { die("raw image must be at least 2x2"); }
+
+    job.src   = src;
+    job.dst   = alloc_ppm_buffer(src->width, src->height, outmax);
+    job.color = cfa_color[config->cfa];
+    job.gamma = (u_short *) malloc((USHRT_MAX + 1) * sizeof(u_short));
+
+    if (!job.dst || !job.gamma) { die("cannot allocate memory for new image"); }
+
+    /* black level, white balance and normalization to 16 bits */
+    for (c = 0; c < 3; c++) {
+        double range = white - config->black[c];
+        double scale = range > 0 ? config->wb[c] * USHRT_MAX / range : 0.0;
+
+        job.lin[c] = (u_short *) malloc((USHRT_MAX + 1) * sizeof(u_short));
+        if (!job.lin[c]) { die("cannot allocate memory for lookup table"); }
+
+        for (i = 0; i <= USHRT_MAX; i++) {
+            double v = (i - config->black[c]) * scale + 0.5;
+
+            job.lin[c][i] = (u_short) (v < 0.0 ? 0 : (v > USHRT_MAX ? USHRT_MAX : v));
+        }
+    }
+
+    for (i = 0; i < 9; i++) {
+        job.ccm[i] = (int) floor(config->ccm[i] * (1 << ISP_CCM_BITS) + 0.5);
+    }
+
+    for (i = 0; i <= USHRT_MAX; i++) {
+        double v = (double) i / USHRT_MAX;
+
+        if (0.0 == config->gamma) {
+            v = v <= 0.0031308 ? 12.92 * v : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+        } else {
+            v = pow(v, 1.0 / config->gamma);
+        }
+
+        job.gamma[i] = (u_short) floor(v * outmax + 0.5);
+    }
+
+    parallel_for_bytes(src->height, 16, (size_t) src->width * 4 * sizeof(u_short), isp_rows, &job);
+
+    for (c = 0; c < 3; c++) {
+        free(job.lin[c]);
+    }
+    free(job.gamma);
+
+    return job.dst;
+}
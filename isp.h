@@ -0,0 +1,39 @@
+#ifndef ISP_H
+#define ISP_H
+
+#include "ppm.h"
+#include "pgm.h"
+#include "raw.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ISP_CCM_BITS 10
+
+typedef struct isp_config
+{
+    cfa_t cfa;
+    int black[3];           /* R, G, B black level in input units */
+    int white;              /* saturation level, 0 for the input maxval */
+    double wb[3];           /* R, G, B white balance gains */
+    double ccm[9];          /* camera RGB to output RGB, row major */
+    double gamma;           /* power law exponent, 0 for sRGB, 1 for linear */
+    int depth;              /* output bits per sample */
+
+    /* raw sensor input instead of a PGM, when format is set */
+    int raw;
+    raw_format_t format;
+    int width;
+    int height;
+    int stride;
+} isp_config_t;
+
+void   read_isp_config(char *filename, isp_config_t *config);
+ppm_t* isp_process(pgm_t *src, isp_config_t *config);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ISP_H */
@@ -10,6 +10,20 @@
 #include <stdarg.h>
 #include "ppm.h"
 #include "pgm.h"
+#include "aio.h"
+#include "resample.h"
+#include "stats.h"
+#include "yuv.h"
+#include "filter.h"
+#include "compare.h"
+#include "transform.h"
+#include "raw.h"
+#include "isp.h"
+#include "pfm.h"
+#include "temporal.h"
+#include "montage.h"
+#include "topology.h"
+#include "tile.h"
 #include "version.h"
 
 /* ---------- macro definition ---------- */
@@ -33,10 +47,31 @@ void usage(void)
 {
     fprintf (stdout, "usage: ppmtools option [arguments]");
     fprintf (stdout, "\n  -d  file1.ppm  file2.ppm  diff_file.ppm                                \
-                      \n  -s  in_file.ppm  out_file.ppm  bit_depth (8 - 16)                              \
-                      \n  -z  in_file.ppm  out_file.ppm  scale_factor (0.1 - 8.0)                      \
+                      \n  -D  file1.ppm  file2.ppm  [threshold (0)]  [tile_size (64)]  [tile_prefix]     \
+                      \n  -s  in_file.ppm  out_file.ppm  bit_depth (8 - 16, 32: float pfm)                \
+                      \n  -z  in_file.ppm  out_file.ppm  scale_factor (0.1 - 8.0)  [filter]  [linear]    \
+                      \n        filter: auto, float, bicubic, bilinear, lanczos3, mitchell                  \
+                      \n  -f  in_file.ppm  out_file.ppm  kernel                                        \
+                      \n        kernel: box3, box5, gauss3, gauss5, gauss7, sharpen, sobel-x, sobel-y,       \
+                      \n        laplace, sep:h0,h1,..[/v0,v1,..], 2d:WxH:k0,k1,.., @file                  \
+                      \n  -t  in_file.ppm  out_file.ppm  operation                                     \
+                      \n        operation: rot90, rot180, rot270, flip-h, flip-v, transpose, transverse     \
                       \n  -c  in_file.ppm  out_file.ppm  convert_opt (0: yuv to rgb, 1: rgb to yuv)      \
-                      \n  -b  in_file.ppm  out_file.ppm  convert_opt (0: ppm to bayer, 1: bayer to ppm)  \
+                      \n  -y  in_file.ppm  out_file.yuv  format  [matrix]  [range]                           \
+                      \n  -Y  in_file.yuv  out_file.ppm  WxH  format  [matrix]  [range]  [bit_depth]        \
+                      \n        format: i420, nv12, yuv422p, yuv444p  matrix: 601, 709, 2020               \
+                      \n        range: limited, full                                                        \
+                      \n  -b  in_file.ppm  out_file.ppm  convert_opt (0: ppm to bayer, 1: bayer to ppm)  [cfa] \
+                      \n  -r  in_file.raw  out_file.ppm  WxH  format  [stride (0: packed)]  [cfa]          \
+                      \n        format: raw10, raw12, raw16[:bit_depth]  cfa: rggb, grbg, gbrg, bggr        \
+                      \n  --pyramid  in_file.ppm  out_prefix  [min_size (64)]                               \
+                      \n  --isp  in_file.pgm  out_file.ppm  config_file                                 \
+                      \n  --temporal  out_prefix  frame1.ppm  [frame2.ppm ..] | @frame_list.txt              \
+                      \n  --montage  out_file.ppm  columns  WxH  in1.ppm  [in2.ppm ..] | @file_list.txt      \
+                      \n  --tiles  in_file.ppm  out_prefix  level | all | zoom  [cache_mb (256)]              \
+                      \n  --stats-image  in_file.ppm  [histogram.txt]                                       \
+                      \n  --stats  stats.txt  option [arguments]                                            \
+                      \n  --numa  report.txt  option [arguments]                                            \
                       \n  -v  version number                                                             \
                       \n  -h  help                                                                       \
                       \n");
@@ -45,7 +80,7 @@ void usage(void)
 
 void version_num(void)
 {
-    fprintf (stdout, "%s\n", version);
+    fprintf (stdout, "%s (aio: %s)\n", version, aio_backend_name());
 }
 
 static void die(const char *fmt, ...)
@@ -195,77 +230,142 @@ void apply_bilinear(ppm_t *src, ppm_t *dst, int dst_width, int dst_height)
     }
 }
 
+/* true when name ends in ".pfm" */
+static int is_pfm_name(char *name)
+{
+    size_t len = strlen(name);
+
+    return len > 4 && 0 == strcmp(name + len - 4, ".pfm");
+}
+
+/*
+ * Difference of two images of the same size, each normalized by its own
+ * maxval. A .pfm output keeps the signed float difference of the encoded
+ * samples; otherwise the magnitude is scaled to the first image's maxval.
+ */
 void diff_image(char *diff_name, char *src_name, char *dst_name)
 {
-    int x = 0, y = 0;
-    ppm_t *src = read_ppm_image(src_name);
-    ppm_t *dst = read_ppm_image(dst_name);
-    ppm_t *diff = 0;
+    aio_req_t *src_req = aio_read_submit(src_name);
+    aio_req_t *dst_req = aio_read_submit(dst_name);
+    ppm_t *src = NULL, *dst = NULL, *diff = NULL;
+    pfm_t *a = NULL, *b = NULL;
+    size_t i, count;
+    int c;
 
-    if (NULL == (diff = alloc_ppm_buffer(src->width, src->height, src->maxval))) {
-        die("error: %s", "insufficient memory available");
-    }
+    /* both reads are in flight before the first one is decoded */
+    src = wait_ppm_image(src_req, src_name);
+    dst = wait_ppm_image(dst_req, dst_name);
 
     if ((src->width != dst->width) || (src->height != dst->height)) {
-        return ;
+        die("error: images '%s' and '%s' differ in size", src_name, dst_name);
     }
 
-    for (y = 0; y < src->height; y++) {
-        for (x = 0; x < src->width; x++) {
-            float val1 = ((float)src->ch1[y * src->width + x] / (float)src->maxval) -
-                         ((float)dst->ch1[y * dst->width + x] / (float)dst->maxval);
-            float val2 = ((float)src->ch2[y * src->width + x] / (float)src->maxval) -
-                         ((float)dst->ch2[y * dst->width + x] / (float)dst->maxval);
-            float val3 = ((float)src->ch3[y * src->width + x] / (float)src->maxval) -
-                         ((float)dst->ch3[y * dst->width + x] / (float)dst->maxval);
-
-            diff->ch1[y * diff->width + x] = (int)(SIGN(val1) * (float)diff->maxval);
-            diff->ch2[y * diff->width + x] = (int)(SIGN(val2) * (float)diff->maxval);
-            diff->ch3[y * diff->width + x] = (int)(SIGN(val3) * (float)diff->maxval);
+    a = ppm_to_pfm(src, 0);
+    b = ppm_to_pfm(dst, 0);
+    count = (size_t) src->width * src->height;
+
+    for (c = 0; c < 3; c++) {
+        float *fa = a->ch[c];
+        const float *fb = b->ch[c];
+
+        for (i = 0; i < count; i++) {
+            fa[i] -= fb[i];
         }
     }
 
     printf("diff image '%s'", diff_name);
-    write_ppm_image(diff, diff_name);
 
+    if (is_pfm_name(diff_name)) {
+        write_pfm_image(a, diff_name);
+    } else {
+        if (NULL == (diff = alloc_ppm_buffer(src->width, src->height, src->maxval))) {
+            die("error: %s", "insufficient memory available");
+        }
+
+        for (c = 0; c < 3; c++) {
+            float *fa = a->ch[c];
+            u_short *d = (0 == c ? diff->ch1 : (1 == c ? diff->ch2 : diff->ch3));
+
+            for (i = 0; i < count; i++) {
+                fa[i] = SIGN(fa[i]);
+            }
+            float_to_u16(fa, d, count, (float) diff->maxval, 0.f, diff->maxval);
+        }
+
+        write_ppm_image(diff, diff_name);
+        free_ppm_buffer(diff);
+    }
+
+    free_pfm_buffer(a);
+    free_pfm_buffer(b);
     free_ppm_buffer(src);
     free_ppm_buffer(dst);
-    free_ppm_buffer(diff);
 }
 
+/*
+ * Rescale a PPM or PFM file to bit_depth bits, or to a PFM file for
+ * bit_depth 32. PFM files hold linear light, so PPM samples are sRGB
+ * decoded on the way in and PFM samples encoded (and rounded) on the way
+ * out. PPM to PPM outputs truncate like the original float code.
+ */
 void conv_bitdepth(char *src_name, char *dst_name, int bit_depth)
 {
-    int x = 0, y = 0;
-    ppm_t *src = read_ppm_image(src_name);
-    ppm_t *dst = NULL;
-    int dst_maxval = (1 << bit_depth) - 1;
+    size_t size = 0;
+    u_char *data = aio_read_wait(aio_read_submit(src_name), &size);
+    int dst_maxval = 32 == bit_depth ? 0 : (1 << bit_depth) - 1;
+    ppm_t *image = NULL, *dst = NULL;
+    pfm_t *src = NULL;
+
+    if (is_pfm_data(data, size)) {
+        src = decode_pfm_image(data, size);
+        free(data);
+
+        printf("rescaled image '%s'", dst_name);
+
+        if (32 == bit_depth) {
+            write_pfm_image(src, dst_name);
+        } else {
+            dst = pfm_to_ppm(src, dst_maxval, 1);
+            write_ppm_image(dst, dst_name);
+            free_ppm_buffer(dst);
+        }
 
-    if (NULL == (dst = alloc_ppm_buffer(src->width, src->height, src->maxval))) {
-        die("error: %s", "insufficient memory available");
+        free_pfm_buffer(src);
+        return;
     }
 
-    if ((src->width <= 0) || (src->height <= 0)) {
-        return ;
-    }
+    image = decode_ppm_image(data, size);
+    free(data);
 
-    for (y = 0; y < src->height; y++) {
-        for (x = 0; x < src->width; x++) {
-            float val1 = (float)src->ch1[y * src->width + x] / (float)src->maxval;
-            float val2 = (float)src->ch2[y * src->width + x] / (float)src->maxval;
-            float val3 = (float)src->ch3[y * src->width + x] / (float)src->maxval;
+    {
+        ppm_hook_t hook = get_ppm_read_hook();
 
-            dst->ch1[y * dst->width + x] = (u_short)(val1 * (float)dst_maxval);
-            dst->ch2[y * dst->width + x] = (u_short)(val2 * (float)dst_maxval);
-            dst->ch3[y * dst->width + x] = (u_short)(val3 * (float)dst_maxval);
-        }
+        if (hook) { hook(image, src_name); }
     }
-    dst->maxval = dst_maxval;
+
+    src = ppm_to_pfm(image, 32 == bit_depth);
+    free_ppm_buffer(image);
 
     printf("rescaled image '%s'", dst_name);
-    write_ppm_image(dst, dst_name);
 
-    free_ppm_buffer(src);
-    free_ppm_buffer(dst);
+    if (32 == bit_depth) {
+        write_pfm_image(src, dst_name);
+    } else {
+        size_t count = (size_t) src->width * src->height;
+
+        if (NULL == (dst = alloc_ppm_buffer(src->width, src->height, dst_maxval))) {
+            die("error: %s", "insufficient memory available");
+        }
+
+        float_to_u16(src->ch[0], dst->ch1, count, (float) dst_maxval, 0.f, dst_maxval);
+        float_to_u16(src->ch[1], dst->ch2, count, (float) dst_maxval, 0.f, dst_maxval);
+        float_to_u16(src->ch[2], dst->ch3, count, (float) dst_maxval, 0.f, dst_maxval);
+
+        write_ppm_image(dst, dst_name);
+        free_ppm_buffer(dst);
+    }
+
+    free_pfm_buffer(src);
 }
 
 void ppm_to_bayer(char *src_name, char *dst_name)
@@ -317,10 +417,23 @@ void ppm_to_bayer(char *src_name, char *dst_name)
     free_pgm_buffer(dst);
 }
 
-void bayer_to_ppm(char *src_name, char *dst_name)
+/*
+ * Demosaic a bayer plane: every 2x2 cell is filled with its own red, green
+ * and blue samples and the result is smoothed by bicubic (or bilinear)
+ * interpolation. cfa gives the colour order of the cell; the green sample
+ * of the cell's first row fills the even columns, the other one the odd.
+ */
+ppm_t* demosaic_bayer(pgm_t *src, cfa_t cfa)
 {
+    /* row and column of R, first-row G, second-row G and B in the cell */
+    static const int cell[4][4][2] = {
+        { { 0, 0 }, { 0, 1 }, { 1, 0 }, { 1, 1 } },     /* RGGB */
+        { { 0, 1 }, { 0, 0 }, { 1, 1 }, { 1, 0 } },     /* GRBG */
+        { { 1, 0 }, { 0, 0 }, { 1, 1 }, { 0, 1 } },     /* GBRG */
+        { { 1, 1 }, { 0, 1 }, { 1, 0 }, { 0, 0 } }      /* BGGR */
+    };
+    const int (*pos)[2] = cell[cfa];
     int x = 0, y = 0;
-    pgm_t *src = read_pgm_image(src_name);
     ppm_t *bilinear = NULL;
     ppm_t *dst = NULL;
 
@@ -332,31 +445,32 @@ void bayer_to_ppm(char *src_name, char *dst_name)
         die("error: %s", "insufficient memory available");
     }
 
-    if ((src->width <= 0) || (src->height <= 0)) {
-        return ;
-    }
-
     for (y = 0; y < src->height; y+=2) {
         for (x = 0; x < src->width; x+=2) {
-            u_short R1 = src->ch[(y+0) * src->width + (x+0)];
-            u_short G2 = src->ch[(y+0) * src->width + (x+1)];
-            u_short G3 = src->ch[(y+1) * src->width + (x+0)];
-            u_short B4 = src->ch[(y+1) * src->width + (x+1)];
-
-            dst->ch1[(y+0) * dst->width + (x+0)] = R1;
-            dst->ch1[(y+0) * dst->width + (x+1)] = R1;
-            dst->ch1[(y+1) * dst->width + (x+0)] = R1;
-            dst->ch1[(y+1) * dst->width + (x+1)] = R1;
-
-            dst->ch2[(y+0) * dst->width + (x+0)] = G2;
-            dst->ch2[(y+0) * dst->width + (x+1)] = G3;
-            dst->ch2[(y+1) * dst->width + (x+0)] = G2;
-            dst->ch2[(y+1) * dst->width + (x+1)] = G3;
-
-            dst->ch3[(y+0) * dst->width + (x+0)] = B4;
-            dst->ch3[(y+0) * dst->width + (x+1)] = B4;
-            dst->ch3[(y+1) * dst->width + (x+0)] = B4;
-            dst->ch3[(y+1) * dst->width + (x+1)] = B4;
+            /* an odd last row or column reuses the cell's first one */
+            int y1 = y + 1 < src->height ? y + 1 : y;
+            int x1 = x + 1 < src->width ? x + 1 : x;
+            u_short v[4];
+            int i;
+
+            for (i = 0; i < 4; i++) {
+                v[i] = src->ch[(pos[i][0] ? y1 : y) * src->width + (pos[i][1] ? x1 : x)];
+            }
+
+            dst->ch1[y  * dst->width + x ] = v[0];
+            dst->ch1[y  * dst->width + x1] = v[0];
+            dst->ch1[y1 * dst->width + x ] = v[0];
+            dst->ch1[y1 * dst->width + x1] = v[0];
+
+            dst->ch2[y  * dst->width + x ] = v[1];
+            dst->ch2[y  * dst->width + x1] = v[2];
+            dst->ch2[y1 * dst->width + x ] = v[1];
+            dst->ch2[y1 * dst->width + x1] = v[2];
+
+            dst->ch3[y  * dst->width + x ] = v[3];
+            dst->ch3[y  * dst->width + x1] = v[3];
+            dst->ch3[y1 * dst->width + x ] = v[3];
+            dst->ch3[y1 * dst->width + x1] = v[3];
         }
     }
     dst->maxval = src->maxval;
@@ -367,8 +481,32 @@ void bayer_to_ppm(char *src_name, char *dst_name)
         apply_bilinear(dst, bilinear, dst->width, dst->height);
     }
 
+    free_ppm_buffer(dst);
+
+    return bilinear;
+}
+
+void bayer_to_ppm(char *src_name, char *dst_name, cfa_t cfa)
+{
+    pgm_t *src = read_pgm_image(src_name);
+    ppm_t *dst = demosaic_bayer(src, cfa);
+
+    printf("ppm image '%s'", dst_name);
+    write_ppm_image(dst, dst_name);
+
+    free_pgm_buffer(src);
+    free_ppm_buffer(dst);
+}
+
+/* demosaic a packed or 16 bit raw sensor dump, without a PGM in between */
+void raw_to_ppm(char *src_name, char *dst_name, int width, int height, int stride,
+                raw_format_t format, int depth, cfa_t cfa)
+{
+    pgm_t *src = read_raw_image(src_name, width, height, stride, format, depth);
+    ppm_t *dst = demosaic_bayer(src, cfa);
+
     printf("ppm image '%s'", dst_name);
-    write_ppm_image(bilinear, dst_name);
+    write_ppm_image(dst, dst_name);
 
     free_pgm_buffer(src);
     free_ppm_buffer(dst);
@@ -440,15 +578,72 @@ void yuv_to_rgb(char *src_name, char *dst_name)
     free_ppm_buffer(dst);
 }
 
-void scale_image(char *src_name, char *dst_name, float scale) {
+/* RGB ppm to raw planar YUV; chroma decimation is fused into the conversion */
+void rgb_to_yuv_planar(char *src_name, char *dst_name, yuv_format_t format, yuv_matrix_t matrix, int full_range)
+{
+    ppm_t *src = read_ppm_image(src_name);
+    yuv_t *dst = ppm_to_yuv(src, format, matrix, full_range);
+
+    printf("raw yuv image '%s' %dx%d %d bit", dst_name, dst->width, dst->height, dst->depth);
+    write_yuv_image(dst, dst_name);
+
+    free_ppm_buffer(src);
+    free_yuv_buffer(dst);
+}
+
+/* raw planar YUV to RGB ppm; chroma upsampling is fused into the conversion */
+void yuv_planar_to_rgb(char *src_name, char *dst_name, int width, int height, int depth,
+                       yuv_format_t format, yuv_matrix_t matrix, int full_range)
+{
+    yuv_t *src = read_yuv_image(src_name, width, height, depth, format);
+    ppm_t *dst = yuv_to_ppm(src, matrix, full_range);
+
+    printf("ppm rgb image '%s'", dst_name);
+    write_ppm_image(dst, dst_name);
+
+    free_yuv_buffer(src);
+    free_ppm_buffer(dst);
+}
+
+/*
+ * Box factor to apply while decoding a reduction by 'scale': the integer
+ * part of the reduction for the area filter, half of it for the kernel
+ * filters so they still see at least 2:1. Linear light, the float filter and
+ * a read hook need the full-size image.
+ */
+static int shrink_factor(float scale, resample_filter_t filter, int linear)
+{
+    int factor;
+
+    if (linear || FILTER_FLOAT == filter || get_ppm_read_hook() || scale >= 0.5f) {
+        return 1;
+    }
+
+    factor = (int) (1.f / scale + 1e-4f);
+    if (FILTER_AUTO != filter) { factor /= 2; }
+
+    return factor < PPM_MAX_REDUCTION ? factor : PPM_MAX_REDUCTION;
+}
+
+void scale_image(char *src_name, char *dst_name, float scale, resample_filter_t filter, int linear) {
 
     int y, x;
-    ppm_t *src = read_ppm_image(src_name);
+    int factor = shrink_factor(scale, filter, linear);
+    ppm_t *src = NULL;
     ppm_t *dst = NULL;
-    int dst_width, dst_height;
+    int width, height, dst_width, dst_height;
+
+    if (factor > 1) {
+        /* shrink-on-load, then refine the remaining ratio below */
+        src = read_ppm_image_reduced(src_name, factor, &width, &height);
+    } else {
+        src    = read_ppm_image(src_name);
+        width  = src->width;
+        height = src->height;
+    }
 
-    dst_width  = (long)((float)src->width  * scale);
-    dst_height = (long)((float)src->height * scale);
+    dst_width  = (long)((float)width  * scale);
+    dst_height = (long)((float)height * scale);
 
     if (NULL == (dst = alloc_ppm_buffer(dst_width, dst_height, src->maxval))) {
         die("error: %s", "insufficient memory available");
@@ -458,14 +653,36 @@ void scale_image(char *src_name, char *dst_name, float scale) {
         return ;
     }
 
-    for (y = 0; y < dst->height; y++) {
-        float v = (float)y / (float)scale;
-
-        for (x = 0; x < dst->width; ++x) {
-            float u = (float)x / (float)scale;
-            dst->ch1[y * dst->width + x] = bicubic(src->ch1, u, v, src->width, src->height, src->maxval);
-            dst->ch2[y * dst->width + x] = bicubic(src->ch2, u, v, src->width, src->height, src->maxval);
-            dst->ch3[y * dst->width + x] = bicubic(src->ch3, u, v, src->width, src->height, src->maxval);
+    if (factor > 1 && src->width == dst->width && src->height == dst->height) {
+        /* the box reduction already hit the target size */
+        memcpy(dst->ch1, src->ch1, (size_t) dst->width * dst->height * sizeof(u_short));
+        memcpy(dst->ch2, src->ch2, (size_t) dst->width * dst->height * sizeof(u_short));
+        memcpy(dst->ch3, src->ch3, (size_t) dst->width * dst->height * sizeof(u_short));
+    } else if (factor > 1 && FILTER_AUTO == filter) {
+        area_downscale_reduced(src, dst, width, height, factor);
+    } else if (factor > 1) {
+        kernel_scale_image(src, dst, scale * factor, filter);
+    } else if (linear) {
+        /* filter linear light, through sRGB tables fused into load and store */
+        linear_scale_image(src, dst, scale, filter);
+    } else if (FILTER_AUTO == filter && exact_scale_image(src, dst, scale)) {
+        /* 2x, 4x, 0.5x and 0.25x use fixed integer kernels */
+    } else if (FILTER_AUTO == filter && scale < 1.f) {
+        /* a fixed 4x4 kernel aliases on reduction; average the covered area instead */
+        area_downscale_image(src, dst);
+    } else if (FILTER_FLOAT != filter && FILTER_AUTO != filter) {
+        /* polyphase banks built once per scale factor */
+        kernel_scale_image(src, dst, scale, filter);
+    } else {
+        for (y = 0; y < dst->height; y++) {
+            float v = (float)y / (float)scale;
+
+            for (x = 0; x < dst->width; ++x) {
+                float u = (float)x / (float)scale;
+                dst->ch1[y * dst->width + x] = bicubic(src->ch1, u, v, src->width, src->height, src->maxval);
+                dst->ch2[y * dst->width + x] = bicubic(src->ch2, u, v, src->width, src->height, src->maxval);
+                dst->ch3[y * dst->width + x] = bicubic(src->ch3, u, v, src->width, src->height, src->maxval);
+            }
         }
     }
 
@@ -476,11 +693,512 @@ void scale_image(char *src_name, char *dst_name, float scale) {
     free_ppm_buffer(dst);
 }
 
+/*
+ * Write a mip chain prefix_0.ppm (full size), prefix_1.ppm (1/2), ... until
+ * the longer side drops below min_size. The source is read once and every
+ * level is reduced 2:1 from the previous one; writes are queued to the async
+ * writer, so each level is written while the next one is computed.
+ */
+void pyramid_image(char *src_name, char *prefix, int min_size)
+{
+    int level = 0, chan;
+    ppm_t *src = read_ppm_image(src_name);
+    ppm_t *dst = NULL;
+    char *dst_name = (char *) malloc(strlen(prefix) + 32);
+
+    if (!dst_name) { die("error: %s", "insufficient memory available"); }
+
+    for (;;) {
+        sprintf(dst_name, "%s_%d.ppm", prefix, level);
+        printf("pyramid level %d %dx%d '%s'\n", level, src->width, src->height, dst_name);
+        write_ppm_image(src, dst_name);
+
+        if ((src->width > src->height ? src->width : src->height) / 2 < min_size) {
+            break;
+        }
+
+        if (NULL == (dst = alloc_ppm_buffer((src->width + 1) / 2, (src->height + 1) / 2, src->maxval))) {
+            die("error: %s", "insufficient memory available");
+        }
+
+        for (chan = 0; chan < 3; chan++) {
+            plane_t s = ppm_plane(src, chan);
+            plane_t d = ppm_plane(dst, chan);
+
+            reduce2_plane(&s, &d);
+        }
+
+        free_ppm_buffer(src);
+        src = dst;
+        level++;
+    }
+
+    free_ppm_buffer(src);
+    free(dst_name);
+}
+
+/* print per-channel statistics of a PPM or PGM file, optionally with its histogram */
+void stats_image(char *src_name, char *hist_name)
+{
+    size_t size = 0;
+    u_char *data = aio_read_wait(aio_read_submit(src_name), &size);
+    image_stats_t *stats = NULL;
+
+    if (size > 1 && '5' == data[1]) {
+        pgm_t *src = decode_pgm_image(data, size);
+        stats = pgm_stats(src);
+        free_pgm_buffer(src);
+    } else {
+        ppm_t *src = decode_ppm_image(data, size);
+        stats = ppm_stats(src);
+        free_ppm_buffer(src);
+    }
+    free(data);
+
+    print_stats(stdout, src_name, stats);
+
+    if (NULL != hist_name) {
+        FILE *fp = fopen(hist_name, "w");
+
+        if (!fp) { die("error: cannot open '%s' for writing", hist_name); }
+
+        print_histogram(fp, stats);
+        fclose(fp);
+    }
+
+    free_stats(stats);
+}
+
+/*
+ * Report the tiles that differ between two PPM or PGM files as JSON on
+ * stdout; returns 1 when any tile is above the threshold, like cmp(1).
+ */
+int compare_image(char *name1, char *name2, int threshold, int tile, char *prefix)
+{
+    image_diff_t *diff = compare_files(name1, name2, tile, threshold, prefix);
+    int differ = diff->count > 0;
+
+    print_diff_json(stdout, name1, name2, diff);
+    free_image_diff(diff);
+
+    return differ;
+}
+
+/* convolve a PPM or PGM file with the given kernel; the read hook sees the input */
+void filter_file(char *src_name, char *dst_name, char *spec)
+{
+    kernel_t *kernel = parse_kernel(spec);
+    size_t size = 0;
+    u_char *data = aio_read_wait(aio_read_submit(src_name), &size);
+
+    if (size > 1 && '5' == data[1]) {
+        pgm_t *src = decode_pgm_image(data, size);
+        pgm_t *dst = alloc_pgm_buffer(src->width, src->height, src->maxval);
+        pgm_hook_t hook = get_pgm_read_hook();
+        plane_t s, d;
+
+        if (!dst) { die("error: %s", "insufficient memory available"); }
+        if (hook) { hook(src, src_name); }
+
+        s.data   = src->ch;
+        s.width  = src->width;
+        s.height = src->height;
+        s.stride = src->width;
+        d        = s;
+        d.data   = dst->ch;
+
+        filter_plane(&s, &d, kernel, src->maxval);
+
+        printf("pgm filtered image '%s'", dst_name);
+        write_pgm_image(dst, dst_name);
+
+        free_pgm_buffer(src);
+        free_pgm_buffer(dst);
+    } else {
+        ppm_t *src = decode_ppm_image(data, size);
+        ppm_t *dst = alloc_ppm_buffer(src->width, src->height, src->maxval);
+        ppm_hook_t hook = get_ppm_read_hook();
+
+        if (!dst) { die("error: %s", "insufficient memory available"); }
+        if (hook) { hook(src, src_name); }
+
+        filter_image(src, dst, kernel);
+
+        printf("ppm filtered image '%s'", dst_name);
+        write_ppm_image(dst, dst_name);
+
+        free_ppm_buffer(src);
+        free_ppm_buffer(dst);
+    }
+
+    free(data);
+    free_kernel(kernel);
+}
+
+/* rotate or mirror a PPM or PGM file, transforming while the file is decoded */
+void transform_image(char *src_name, char *dst_name, transform_t op)
+{
+    size_t size = 0;
+    u_char *data = aio_read_wait(aio_read_submit(src_name), &size);
+
+    if (size > 1 && '5' == data[1]) {
+        pgm_t *image = decode_pgm_transformed(data, size, op);
+        pgm_hook_t hook = get_pgm_read_hook();
+
+        if (hook) { hook(image, src_name); }
+
+        printf("pgm transformed image '%s'", dst_name);
+        write_pgm_image(image, dst_name);
+        free_pgm_buffer(image);
+    } else {
+        ppm_t *image = decode_ppm_transformed(data, size, op);
+        ppm_hook_t hook = get_ppm_read_hook();
+
+        if (hook) { hook(image, src_name); }
+
+        printf("ppm transformed image '%s'", dst_name);
+        write_ppm_image(image, dst_name);
+        free_ppm_buffer(image);
+    }
+
+    free(data);
+}
+
+/* develop a bayer PGM, or the raw dump described in the config, to RGB */
+void isp_image(char *src_name, char *dst_name, char *config_name)
+{
+    isp_config_t config;
+    pgm_t *src = NULL;
+    ppm_t *dst = NULL;
+
+    read_isp_config(config_name, &config);
+
+    if (config.raw) {
+        src = read_raw_image(src_name, config.width, config.height, config.stride, config.format, 0);
+    } else {
+        src = read_pgm_image(src_name);
+    }
+
+    dst = isp_process(src, &config);
+
+    printf("ppm image '%s'", dst_name);
+    write_ppm_image(dst, dst_name);
+
+    free_pgm_buffer(src);
+    free_ppm_buffer(dst);
+}
+
+/* frame names from a list file, one per line; blank lines and '#' comments are skipped */
+static char** read_name_list(char *list_name, int *count)
+{
+    FILE *fp = fopen(list_name, "r");
+    char **names = NULL;
+    char line[4096];
+    int size = 0;
+
+    if (!fp) { die("error: cannot open '%s' for reading", list_name); }
+
+    *count = 0;
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = line, *end;
+
+        while (*p == ' ' || *p == '\t') { p++; }
+        end = p + strcspn(p, "\r\n");
+        while (end > p && (end[-1] == ' ' || end[-1] == '\t')) { end--; }
+        *end = 0;
+
+        if (0 == *p || '#' == *p) { continue; }
+
+        if (*count == size) {
+            size  = size ? 2 * size : 64;
+            names = (char **) realloc(names, size * sizeof(char *));
+            if (!names) { die("error: %s", "insufficient memory available"); }
+        }
+
+        if (NULL == (names[*count] = (char *) malloc(strlen(p) + 1))) {
+            die("error: %s", "insufficient memory available");
+        }
+        strcpy(names[(*count)++], p);
+    }
+
+    fclose(fp);
+
+    return names;
+}
+
+/*
+ * Per-pixel mean, minimum, maximum and variance over a frame sequence,
+ * written as prefix_mean, prefix_min, prefix_max (.ppm or .pgm, like the
+ * frames) and prefix_var.pfm. The next frame is read while the current one
+ * is accumulated, so only two file images are in memory at any time.
+ */
+void temporal_image(char *prefix, char **names, int count)
+{
+    static const char *stat_name[3] = { "mean", "min", "max" };
+    const char *ext;
+    char *dst_name = (char *) malloc(strlen(prefix) + 32);
+    temporal_t *acc = NULL;
+    aio_req_t *req;
+    pfm_t *var;
+    int i, stat;
+
+    if (!dst_name) { die("error: %s", "insufficient memory available"); }
+    if (count < 1) { die("error: %s", "no frames given"); }
+
+    req = aio_read_submit(names[0]);
+
+    for (i = 0; i < count; i++) {
+        size_t size;
+        u_char *data = aio_read_wait(req, &size);
+
+        if (i + 1 < count) { req = aio_read_submit(names[i + 1]); }
+
+        if (!acc) {
+            int width, height, channels, maxval;
+
+            read_frame_header(data, size, &width, &height, &channels, &maxval);
+            acc = alloc_temporal_buffer(width, height, channels, maxval);
+        }
+
+        temporal_add_frame(acc, data, size);
+        free(data);
+    }
+
+    ext = 3 == acc->channels ? "ppm" : "pgm";
+
+    for (stat = TEMPORAL_MEAN; stat <= TEMPORAL_MAX; stat++) {
+        sprintf(dst_name, "%s_%s.%s", prefix, stat_name[stat], ext);
+
+        if (3 == acc->channels) {
+            ppm_t *dst = alloc_ppm_buffer(acc->width, acc->height, acc->maxval);
+            u_short *planes[3];
+
+            if (!dst) { die("error: %s", "insufficient memory available"); }
+
+            planes[0] = dst->ch1;
+            planes[1] = dst->ch2;
+            planes[2] = dst->ch3;
+            temporal_planes(acc, (temporal_stat_t) stat, planes);
+            write_ppm_image(dst, dst_name);
+            free_ppm_buffer(dst);
+        } else {
+            pgm_t *dst = alloc_pgm_buffer(acc->width, acc->height, acc->maxval);
+
+            if (!dst) { die("error: %s", "insufficient memory available"); }
+
+            temporal_planes(acc, (temporal_stat_t) stat, &dst->ch);
+            write_pgm_image(dst, dst_name);
+            free_pgm_buffer(dst);
+        }
+    }
+
+    sprintf(dst_name, "%s_var.pfm", prefix);
+    var = temporal_variance(acc);
+    write_pfm_image(var, dst_name);
+
+    printf("temporal reduce of %d frames %dx%d '%s_*'", acc->frames, acc->width, acc->height, prefix);
+
+    free_pfm_buffer(var);
+    free_temporal_buffer(acc);
+    free(dst_name);
+}
+
+/* contact sheet of 'count' images, 'columns' per row in tile_width x tile_height slots */
+void montage_image(char *dst_name, int columns, int tile_width, int tile_height, char **names, int count)
+{
+    ppm_t *dst = montage_images(names, count, columns, tile_width, tile_height);
+
+    printf("ppm montage of %d images %dx%d '%s'", count, dst->width, dst->height, dst_name);
+    write_ppm_image(dst, dst_name);
+
+    free_ppm_buffer(dst);
+}
+
+typedef struct tiles_job
+{
+    tiled_image_t *image;
+    int level;
+    float zoom;             /* > 0: tiles of this zoom instead of 'level' */
+    int columns;
+    tile_t **tiles;
+} tiles_job_t;
+
+static void make_tiles(void *arg, int begin, int end)
+{
+    tiles_job_t *job = (tiles_job_t *) arg;
+    int i;
+
+    for (i = begin; i < end; i++) {
+        if (job->zoom > 0.f) {
+            job->tiles[i] = get_zoom_tile(job->image, job->zoom, i % job->columns, i / job->columns);
+        } else {
+            job->tiles[i] = get_tile(job->image, job->level, i % job->columns, i / job->columns);
+        }
+    }
+}
+
+/*
+ * Write every tile of one zoom level (or of all levels, level < 0) as
+ * prefix_level_x_y.ppm, or of any zoom in (0, 1] as prefix_x_y.ppm. Tiles
+ * are made in parallel through the shared cache, each decoded straight from
+ * its source rectangle.
+ */
+void tiles_image(char *src_name, char *prefix, int level, float zoom, size_t cache_limit)
+{
+    tiled_image_t *image = open_tiled_image(src_name, cache_limit);
+    char *dst_name = (char *) malloc(strlen(prefix) + 64);
+    int first = level < 0 ? 0 : level;
+    int last  = level < 0 ? image->levels - 1 : level;
+    int count = 0, i;
+
+    if (!dst_name) { die("error: %s", "insufficient memory available"); }
+    if (zoom > 0.f) { first = last = 0; }
+    if (last >= image->levels) { die("error: level %d out of range (0 - %d)", last, image->levels - 1); }
+
+    for (level = first; level <= last; level++) {
+        tiles_job_t job;
+        int n, rows;
+
+        if (zoom > 0.f) {
+            int width, height;
+
+            get_zoom_size(image, zoom, &width, &height);
+            job.columns = (width + TILE_SIZE - 1) / TILE_SIZE;
+            rows        = (height + TILE_SIZE - 1) / TILE_SIZE;
+        } else {
+            job.columns = get_tile_columns(image, level);
+            rows        = get_tile_rows(image, level);
+        }
+
+        n = job.columns * rows;
+
+        job.image = image;
+        job.level = level;
+        job.zoom  = zoom;
+        job.tiles = (tile_t **) malloc(n * sizeof(tile_t *));
+        if (!job.tiles) { die("error: %s", "insufficient memory available"); }
+
+        parallel_for(n, 1, make_tiles, &job);
+
+        for (i = 0; i < n; i++) {
+            if (zoom > 0.f) {
+                sprintf(dst_name, "%s_%d_%d.ppm", prefix, i % job.columns, i / job.columns);
+            } else {
+                sprintf(dst_name, "%s_%d_%d_%d.ppm", prefix, level, i % job.columns, i / job.columns);
+            }
+            write_ppm_image(job.tiles[i]->image, dst_name);
+            release_tile(image, job.tiles[i]);
+        }
+
+        count += n;
+        free(job.tiles);
+    }
+
+    printf("%d tiles of '%s' %dx%d, %d levels, cache hits %llu misses %llu",
+           count, src_name, image->width, image->height, image->levels, image->hits, image->misses);
+
+    close_tiled_image(image);
+    free(dst_name);
+}
+
+cfa_t get_cfa(char *name)
+{
+    if (NULL == name || 0 == strcmp(name, "rggb")) { return CFA_RGGB; }
+    if (0 == strcmp(name, "grbg"))                 { return CFA_GRBG; }
+    if (0 == strcmp(name, "gbrg"))                 { return CFA_GBRG; }
+    if (0 == strcmp(name, "bggr"))                 { return CFA_BGGR; }
+
+    die("error: unknown cfa pattern '%s'", name);
+
+    return CFA_RGGB;
+}
+
+/* raw10, raw12 or raw16[:depth] */
+raw_format_t get_raw_format(char *name, int *depth)
+{
+    *depth = 0;
+
+    if (0 == strcmp(name, "raw10")) { return RAW_RAW10; }
+    if (0 == strcmp(name, "raw12")) { return RAW_RAW12; }
+    if (0 == strcmp(name, "raw16")) { return RAW_RAW16; }
+    if (1 == sscanf(name, "raw16:%d", depth) && *depth >= 1 && *depth <= 16) { return RAW_RAW16; }
+
+    die("error: unknown raw format '%s'", name);
+
+    return RAW_RAW16;
+}
+
+transform_t get_transform(char *name)
+{
+    if (0 == strcmp(name, "rot90"))      { return TRANSFORM_ROT90; }
+    if (0 == strcmp(name, "rot180"))     { return TRANSFORM_ROT180; }
+    if (0 == strcmp(name, "rot270"))     { return TRANSFORM_ROT270; }
+    if (0 == strcmp(name, "flip-h"))     { return TRANSFORM_FLIP_H; }
+    if (0 == strcmp(name, "flip-v"))     { return TRANSFORM_FLIP_V; }
+    if (0 == strcmp(name, "transpose"))  { return TRANSFORM_TRANSPOSE; }
+    if (0 == strcmp(name, "transverse")) { return TRANSFORM_TRANSVERSE; }
+
+    die("error: unknown transform '%s'", name);
+
+    return TRANSFORM_NONE;
+}
+
+resample_filter_t get_filter(char *name)
+{
+    if (0 == strcmp(name, "auto"))     { return FILTER_AUTO; }
+    if (0 == strcmp(name, "float"))    { return FILTER_FLOAT; }
+    if (0 == strcmp(name, "bicubic"))  { return FILTER_BICUBIC; }
+    if (0 == strcmp(name, "bilinear")) { return FILTER_BILINEAR; }
+    if (0 == strcmp(name, "lanczos3")) { return FILTER_LANCZOS3; }
+    if (0 == strcmp(name, "mitchell")) { return FILTER_MITCHELL; }
+
+    die("error: unknown filter '%s'", name);
+
+    return FILTER_AUTO;
+}
+
+yuv_format_t get_yuv_format(char *name)
+{
+    if (0 == strcmp(name, "i420"))    { return YUV_I420; }
+    if (0 == strcmp(name, "nv12"))    { return YUV_NV12; }
+    if (0 == strcmp(name, "yuv422p")) { return YUV_422P; }
+    if (0 == strcmp(name, "yuv444p")) { return YUV_444P; }
+
+    die("error: unknown yuv format '%s'", name);
+
+    return YUV_I420;
+}
+
+yuv_matrix_t get_yuv_matrix(char *name)
+{
+    if (NULL == name || 0 == strcmp(name, "601")) { return YUV_BT601; }
+    if (0 == strcmp(name, "709"))                 { return YUV_BT709; }
+    if (0 == strcmp(name, "2020"))                { return YUV_BT2020; }
+
+    die("error: unknown yuv matrix '%s'", name);
+
+    return YUV_BT601;
+}
+
+int get_yuv_range(char *name)
+{
+    if (NULL == name || 0 == strcmp(name, "limited")) { return 0; }
+    if (0 == strcmp(name, "full"))                    { return 1; }
+
+    die("error: unknown yuv range '%s'", name);
+
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     char *arg = NULL;
+    FILE *stats_fp = NULL;
+    FILE *numa_fp = NULL;
+    int status = 0;
 
-    if (5 != argc && 2 != argc) { usage(); }
+    if (argc < 2) { usage(); }
 
     while ((arg = argv[1]) != NULL) {
         if (*arg != '-')
@@ -511,7 +1229,7 @@ int main(int argc, char *argv[])
                     if (0 == conv_opt) {
                         ppm_to_bayer(src_name, dst_name);       //PPM to Bayer
                     } else if (1 == conv_opt) {
-                        bayer_to_ppm(src_name, dst_name);       //Bayer to PPM
+                        bayer_to_ppm(src_name, dst_name, get_cfa(argv[5]));   //Bayer to PPM
                     } else {
                         die("error: %s ", "incorrect argument");
                     }
@@ -530,7 +1248,7 @@ int main(int argc, char *argv[])
                     dst_name = argv[3];
                     bit_depth = atoi(argv[4]);
 
-                    if (!(bit_depth >= 8 && bit_depth <= 16)) {
+                    if (!((bit_depth >= 8 && bit_depth <= 16) || 32 == bit_depth)) {
                         die("error: %s ", "incorrect argument");
                     }
 
@@ -552,6 +1270,74 @@ int main(int argc, char *argv[])
                     diff_image(diff_name, src_name, dst_name);
                     continue;
                 }
+            case 'f':
+                {
+                    if (NULL == argv[2] || NULL == argv[3] || NULL == argv[4]) {
+                        die("error: %s ", "incorrect argument");
+                    }
+
+                    filter_file(argv[2], argv[3], argv[4]);
+                    continue;
+                }
+            case 'D':
+                {
+                    int threshold = 0, tile = 64;
+                    char *prefix = NULL;
+
+                    if (NULL == argv[2] || NULL == argv[3]) {
+                        die("error: %s ", "incorrect argument");
+                    }
+
+                    if (NULL != argv[4]) {
+                        threshold = atoi(argv[4]);
+                        if (NULL != argv[5]) {
+                            tile = atoi(argv[5]);
+                            prefix = argv[6];
+                        }
+                    }
+
+                    if (threshold < 0 || tile < 1 || tile > 4096) {
+                        die("error: %s ", "incorrect argument");
+                    }
+
+                    status |= compare_image(argv[2], argv[3], threshold, tile, prefix);
+                    continue;
+                }
+            case 'r':
+                {
+                    int width = 0, height = 0, stride = 0, depth = 0;
+                    raw_format_t format;
+
+                    if (NULL == argv[2] || NULL == argv[3] || NULL == argv[4] || NULL == argv[5]) {
+                        die("error: %s ", "incorrect argument");
+                    }
+
+                    if (2 != sscanf(argv[4], "%dx%d", &width, &height) || width < 1 || height < 1) {
+                        die("error: %s ", "incorrect argument");
+                    }
+
+                    format = get_raw_format(argv[5], &depth);
+
+                    if (NULL != argv[6]) {
+                        stride = atoi(argv[6]);
+                        if (stride < 0) {
+                            die("error: %s ", "incorrect argument");
+                        }
+                    }
+
+                    raw_to_ppm(argv[2], argv[3], width, height, stride, format, depth,
+                               get_cfa(NULL != argv[6] ? argv[7] : NULL));
+                    continue;
+                }
+            case 't':
+                {
+                    if (NULL == argv[2] || NULL == argv[3] || NULL == argv[4]) {
+                        die("error: %s ", "incorrect argument");
+                    }
+
+                    transform_image(argv[2], argv[3], get_transform(argv[4]));
+                    continue;
+                }
             case 'c':
                 {
                     char *src_name = NULL, *dst_name = NULL;
@@ -578,10 +1364,63 @@ int main(int argc, char *argv[])
                     }
                     continue;
                 }
+            case 'y':
+                {
+                    /* -y in.ppm out.yuv format [matrix] [range] */
+                    char *matrix = NULL, *range = NULL;
+
+                    if (NULL == argv[2] || NULL == argv[3] || NULL == argv[4]) {
+                        die("error: %s ", "incorrect argument");
+                    }
+
+                    if (NULL != argv[5]) {
+                        matrix = argv[5];
+                        range  = argv[6];
+                    }
+
+                    rgb_to_yuv_planar(argv[2], argv[3], get_yuv_format(argv[4]),
+                                      get_yuv_matrix(matrix), get_yuv_range(range));
+                    continue;
+                }
+            case 'Y':
+                {
+                    /* -Y in.yuv out.ppm WxH format [matrix] [range] [bit_depth] */
+                    char *matrix = NULL, *range = NULL;
+                    int width = 0, height = 0, depth = 8;
+
+                    if (NULL == argv[2] || NULL == argv[3] || NULL == argv[4] || NULL == argv[5]) {
+                        die("error: %s ", "incorrect argument");
+                    }
+
+                    if (2 != sscanf(argv[4], "%dx%d", &width, &height) ||
+                        width < 1 || height < 1 || width > SHRT_MAX || height > SHRT_MAX) {
+                        die("error: %s ", "incorrect argument");
+                    }
+
+                    if (NULL != argv[6]) {
+                        matrix = argv[6];
+                        if (NULL != argv[7]) {
+                            range = argv[7];
+                            if (NULL != argv[8]) {
+                                depth = atoi(argv[8]);
+                            }
+                        }
+                    }
+
+                    if (depth < 8 || depth > 16) {
+                        die("error: %s ", "incorrect argument");
+                    }
+
+                    yuv_planar_to_rgb(argv[2], argv[3], width, height, depth, get_yuv_format(argv[5]),
+                                      get_yuv_matrix(matrix), get_yuv_range(range));
+                    continue;
+                }
             case 'z':
                 {
                     char *src_name = NULL, *dst_name = NULL;
                     float scale_fact = 1.f;
+                    resample_filter_t filter = FILTER_AUTO;
+                    int linear = 0;
 
                     if (NULL == argv[2] || NULL == argv[3] || NULL == argv[4]) {
                         die("error: %s ", "incorrect argument");
@@ -591,13 +1430,156 @@ int main(int argc, char *argv[])
                     dst_name = argv[3];
                     scale_fact = (float)atof(argv[4]);
 
+                    if (NULL != argv[5]) {
+                        if (0 == strcmp(argv[5], "linear")) {
+                            linear = 1;
+                        } else {
+                            filter = get_filter(argv[5]);
+                            if (NULL != argv[6]) {
+                                if (0 != strcmp(argv[6], "linear")) {
+                                    die("error: %s ", "incorrect argument");
+                                }
+                                linear = 1;
+                            }
+                        }
+                    }
+
                     if (!(scale_fact > 0.f && scale_fact <= 8.f)) {
                         die("error: %s ", "incorrect argument");
                     }
 
-                    scale_image(src_name, dst_name, scale_fact);
+                    scale_image(src_name, dst_name, scale_fact, filter, linear);
                     continue;
                 }
+            case '-':
+                {
+                    /* long options */
+                    if (0 == strcmp(arg, "-pyramid")) {
+                        int min_size = 64;
+
+                        if (NULL == argv[2] || NULL == argv[3]) {
+                            die("error: %s ", "incorrect argument");
+                        }
+
+                        if (NULL != argv[4]) {
+                            min_size = atoi(argv[4]);
+                        }
+
+                        if (min_size < 1) {
+                            die("error: %s ", "incorrect argument");
+                        }
+
+                        pyramid_image(argv[2], argv[3], min_size);
+                    } else if (0 == strcmp(arg, "-isp")) {
+                        if (NULL == argv[2] || NULL == argv[3] || NULL == argv[4]) {
+                            die("error: %s ", "incorrect argument");
+                        }
+
+                        isp_image(argv[2], argv[3], argv[4]);
+                    } else if (0 == strcmp(arg, "-temporal")) {
+                        char **names = argv + 3;
+                        int count = 0;
+
+                        if (NULL == argv[2] || NULL == argv[3]) {
+                            die("error: %s ", "incorrect argument");
+                        }
+
+                        if ('@' == argv[3][0]) {
+                            names = read_name_list(argv[3] + 1, &count);
+                        } else {
+                            while (NULL != names[count]) { count++; }
+                        }
+
+                        temporal_image(argv[2], names, count);
+
+                        if ('@' == argv[3][0]) {
+                            while (count > 0) { free(names[--count]); }
+                            free(names);
+                        }
+                    } else if (0 == strcmp(arg, "-montage")) {
+                        char **names = argv + 5;
+                        int columns, tile_width, tile_height, count = 0;
+
+                        if (NULL == argv[2] || NULL == argv[3] || NULL == argv[4] || NULL == argv[5]) {
+                            die("error: %s ", "incorrect argument");
+                        }
+
+                        columns = atoi(argv[3]);
+                        if (columns < 1 || 2 != sscanf(argv[4], "%dx%d", &tile_width, &tile_height) ||
+                            tile_width < 1 || tile_height < 1) {
+                            die("error: %s ", "incorrect argument");
+                        }
+
+                        if ('@' == argv[5][0]) {
+                            names = read_name_list(argv[5] + 1, &count);
+                        } else {
+                            while (NULL != names[count]) { count++; }
+                        }
+
+                        montage_image(argv[2], columns, tile_width, tile_height, names, count);
+
+                        if ('@' == argv[5][0]) {
+                            while (count > 0) { free(names[--count]); }
+                            free(names);
+                        }
+                    } else if (0 == strcmp(arg, "-tiles")) {
+                        size_t cache_limit = TILE_CACHE_DEFAULT;
+                        int level = -1;
+                        float zoom = 0.f;
+
+                        if (NULL == argv[2] || NULL == argv[3] || NULL == argv[4]) {
+                            die("error: %s ", "incorrect argument");
+                        }
+
+                        if (strchr(argv[4], '.')) {
+                            zoom = (float) atof(argv[4]);
+                            if (!(zoom > 0.f && zoom <= 1.f)) { die("error: %s ", "incorrect argument"); }
+                        } else if (0 != strcmp(argv[4], "all")) {
+                            level = atoi(argv[4]);
+                            if (level < 0) { die("error: %s ", "incorrect argument"); }
+                        }
+
+                        if (NULL != argv[5]) {
+                            if (atoi(argv[5]) < 1) { die("error: %s ", "incorrect argument"); }
+                            cache_limit = (size_t) atoi(argv[5]) << 20;
+                        }
+
+                        tiles_image(argv[2], argv[3], level, zoom, cache_limit);
+                    } else if (0 == strcmp(arg, "-stats-image")) {
+                        if (NULL == argv[2]) {
+                            die("error: %s ", "incorrect argument");
+                        }
+
+                        stats_image(argv[2], argv[3]);
+                    } else if (0 == strcmp(arg, "-stats")) {
+                        /* side output for the operation that follows */
+                        if (NULL == argv[2] || NULL != stats_fp) {
+                            die("error: %s ", "incorrect argument");
+                        }
+
+                        if (NULL == (stats_fp = fopen(argv[2], "w"))) {
+                            die("error: cannot open '%s' for writing", argv[2]);
+                        }
+
+                        stats_side_output(stats_fp);
+                        argv++;
+                    } else if (0 == strcmp(arg, "-numa")) {
+                        /* pinned, node-placed run of the operation that follows */
+                        if (NULL == argv[2] || NULL != numa_fp) {
+                            die("error: %s ", "incorrect argument");
+                        }
+
+                        if (NULL == (numa_fp = fopen(argv[2], "w"))) {
+                            die("error: cannot open '%s' for writing", argv[2]);
+                        }
+
+                        set_numa_placement(1);
+                        argv++;
+                    } else {
+                        die("unknown option '-%s'", arg);
+                    }
+                    break;
+                }
             case 'h':
                 {
                 usage();
@@ -617,5 +1599,16 @@ int main(int argc, char *argv[])
         argv++;
     }
 
-    return 0;
+    aio_flush();
+
+    if (NULL != numa_fp) {
+        print_topology_report(numa_fp);
+        fclose(numa_fp);
+    }
+
+    if (NULL != stats_fp) {
+        fclose(stats_fp);
+    }
+
+    return status;
 }
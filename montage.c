@@ -0,0 +1,148 @@
+/*
+ * montage.c: contact sheets of many PPM images.
+ *
+ * The sheet is allocated once and every input is shrunk on load and
+ * area-resampled straight into its slot, addressed as a plane with the
+ * sheet's stride. Tiles are handed out one at a time from a shared
+ * counter, so a few large inputs do not leave the other threads idle.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "montage.h"
+#include "resample.h"
+#include "thread.h"
+
+typedef struct montage_job
+{
+    ppm_t *sheet;
+    char **names;
+    int count;
+    int columns;
+    int tile_width;
+    int tile_height;
+    int next;           /* next tile to hand out, under 'lock' */
+    mutex_t lock;
+} montage_job_t;
+
+static void die(char *message)
+{
+    fprintf(stderr, "montage: %s\n", message);
+    exit(1);
+}
+
+/* fit the image into its slot, keeping the aspect ratio; never enlarged */
+static void place_tile(montage_job_t *job, int index)
+{
+    ppm_t *sheet = job->sheet;
+    ppm_source_t *source = open_ppm_source(job->names[index]);
+    int width = source->width, height = source->height;
+    int dst_width, dst_height, factor, chan, x, y;
+    double scale;
+    size_t origin;
+    contrib_t *xcontrib, *ycontrib;
+    ppm_t *src;
+
+    scale = (double) job->tile_width / width < (double) job->tile_height / height ?
+            (double) job->tile_width / width : (double) job->tile_height / height;
+    if (scale > 1.0) { scale = 1.0; }
+
+    dst_width  = (int) (width * scale)  > 0 ? (int) (width * scale)  : 1;
+    dst_height = (int) (height * scale) > 0 ? (int) (height * scale) : 1;
+
+    factor = (int) (1.0 / scale + 1e-6);
+    if (factor > PPM_MAX_REDUCTION) { factor = PPM_MAX_REDUCTION; }
+
+    /* the header is parsed once; the raster is read and reduced in batches */
+    src = read_ppm_region_reduced(source, 0, 0, width, height, factor);
+    close_ppm_source(source);
+
+    xcontrib = area_contrib_reduced(width, factor, dst_width);
+    ycontrib = area_contrib_reduced(height, factor, dst_height);
+
+    /* centered in the slot */
+    origin = (size_t) ((index / job->columns) * job->tile_height + (job->tile_height - dst_height) / 2) * sheet->width
+           + (index % job->columns) * job->tile_width + (job->tile_width - dst_width) / 2;
+
+    for (chan = 0; chan < 3; chan++) {
+        plane_t s = ppm_plane(src, chan);
+        plane_t d = ppm_plane(sheet, chan);
+
+        d.data  += origin;
+        d.width  = dst_width;
+        d.height = dst_height;
+
+        resample_plane(&s, &d, xcontrib, ycontrib, src->maxval);
+
+        if (src->maxval != sheet->maxval) {
+            for (y = 0; y < dst_height; y++) {
+                u_short *row = d.data + (size_t) y * d.stride;
+
+                for (x = 0; x < dst_width; x++) {
+                    row[x] = (u_short) ((row[x] * sheet->maxval + src->maxval / 2) / src->maxval);
+                }
+            }
+        }
+    }
+
+    free_contrib(xcontrib);
+    free_contrib(ycontrib);
+    free_ppm_buffer(src);
+}
+
+static void montage_tiles(void *arg, int begin, int end)
+{
+    montage_job_t *job = (montage_job_t *) arg;
+    int index;
+
+    (void) begin;
+    (void) end;
+
+    for (;;) {
+        mutex_lock(&job->lock);
+        index = job->next++;
+        mutex_unlock(&job->lock);
+
+        if (index >= job->count) { break; }
+
+        place_tile(job, index);
+    }
+}
+
+/*
+ * Lay out 'count' images row by row, 'columns' per row, each scaled down to
+ * fit a tile_width x tile_height slot on a black background.
+ */
+ppm_t* montage_images(char **names, int count, int columns, int tile_width, int tile_height)
+{
+    int rows = (count + columns - 1) / columns;
+    montage_job_t job;
+    ppm_t *sheet;
+
+    if (count < 1 || columns < 1 || tile_width < 1 || tile_height < 1) { die("invalid layout"); }
+
+    if ((long long) columns * tile_width > SHRT_MAX || (long long) rows * tile_height > SHRT_MAX) {
+        die("sheet would exceed the largest image size");
+    }
+
+    sheet = alloc_ppm_buffer(columns * tile_width, rows * tile_height, MONTAGE_MAXVAL);
+    if (!sheet) { die("cannot allocate memory for new image"); }
+
+    clear_ppm_buffer(sheet, 0, 0, 0);
+
+    job.sheet       = sheet;
+    job.names       = names;
+    job.count       = count;
+    job.columns     = columns;
+    job.tile_width  = tile_width;
+    job.tile_height = tile_height;
+    job.next        = 0;
+    mutex_init(&job.lock);
+
+    /* one strip per thread; the strips pull tiles until none are left */
+    parallel_for(get_num_threads() < count ? get_num_threads() : count, 1, montage_tiles, &job);
+
+    mutex_destroy(&job.lock);
+
+    return sheet;
+}
@@ -0,0 +1,19 @@
+#ifndef MONTAGE_H
+#define MONTAGE_H
+
+#include "ppm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* contact sheets are 8 bit; deeper inputs are requantized */
+#define MONTAGE_MAXVAL 255
+
+ppm_t* montage_images(char **names, int count, int columns, int tile_width, int tile_height);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MONTAGE_H */
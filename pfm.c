@@ -0,0 +1,328 @@
+/*
+ * pfm.c: float images and PFM (portable float map) files.
+ *
+ * A pfm_t keeps samples normalized to maxval, so chained float operations
+ * neither requantize nor divide by maxval again. PFM files hold linear
+ * light, so images headed for or coming from one are converted through
+ * the sRGB transfer function of resample.c; in-memory intermediates such
+ * as the -d difference keep the transfer curve of their source. Conversions
+ * to and from u_short planes happen only at the edges of a pipeline and
+ * are vectorized with SSE2; they use exactly the scalar float operations,
+ * so results do not depend on the code path.
+ *
+ * PFM files store rows bottom to top; the sign of the scale field gives
+ * the byte order (negative: little endian). Files are written little
+ * endian and either order is read.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "pfm.h"
+#include "aio.h"
+#include "resample.h"
+#include "topology.h"
+
+#define PFM_CHUNK 4096
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define PFM_SSE2 1
+#include <emmintrin.h>
+#endif
+
+static void die(char *message)
+{
+    fprintf(stderr, "pfm: %s\n", message);
+    exit(1);
+}
+
+pfm_t* alloc_pfm_buffer(int width, int height, int channels)
+{
+    pfm_t *image = (pfm_t *) calloc(1, sizeof(pfm_t));
+    int c;
+
+    if (!image) { die("cannot allocate memory for new image"); }
+
+    image->width    = width;
+    image->height   = height;
+    image->channels = channels;
+
+    for (c = 0; c < channels; c++) {
+        image->ch[c] = (float *) malloc((size_t) width * height * sizeof(float));
+        if (!image->ch[c]) { die("cannot allocate memory for new image"); }
+        place_rows(image->ch[c], (size_t) width * sizeof(float), height);
+    }
+
+    return image;
+}
+
+void free_pfm_buffer(pfm_t *image)
+{
+    int c;
+
+    if (!image) { die("cannot release memory for image"); }
+
+    for (c = 0; c < image->channels; c++) {
+        free(image->ch[c]);
+    }
+    free(image);
+}
+
+int is_pfm_data(u_char *data, size_t size)
+{
+    return size > 2 && 'P' == data[0] && ('F' == data[1] || 'f' == data[1]);
+}
+
+static int host_little_endian(void)
+{
+    const unsigned one = 1;
+
+    return 1 == *(const u_char *) &one;
+}
+
+pfm_t* decode_pfm_image(u_char *data, size_t size)
+{
+    int width = 0, height = 0, channels, swap, len = 0, x, y, c;
+    char header[128];
+    double scale = 0.0;
+    size_t pos;
+    pfm_t *image;
+
+    if (!is_pfm_data(data, size)) { die("file is not in pfm format; cannot read"); }
+
+    memcpy(header, data, size < sizeof(header) - 1 ? size : sizeof(header) - 1);
+    header[size < sizeof(header) - 1 ? size : sizeof(header) - 1] = 0;
+
+    if (3 != sscanf(header + 2, "%d %d %lf%n", &width, &height, &scale, &len) || 0.0 == scale) {
+        die("cannot read header information from pfm file");
+    }
+
+    /* exactly one white space character separates the header from the raster */
+    pos = 2 + len + 1;
+
+    if (width < 1 || height < 1 || width > SHRT_MAX || height > SHRT_MAX) {
+        die("file contained unreasonable width or height");
+    }
+
+    channels = 'F' == data[1] ? 3 : 1;
+    swap     = (scale < 0.0) != host_little_endian();
+
+    if (pos > size || size - pos < (size_t) width * height * channels * sizeof(float)) {
+        die("cannot read image data from file");
+    }
+
+    image = alloc_pfm_buffer(width, height, channels);
+
+    for (y = 0; y < height; y++) {
+        const u_char *src = data + pos + (size_t) (height - 1 - y) * width * channels * sizeof(float);
+
+        for (x = 0; x < width; x++) {
+            for (c = 0; c < channels; c++, src += 4) {
+                u_char b[4];
+                float v;
+
+                if (swap) {
+                    b[0] = src[3]; b[1] = src[2]; b[2] = src[1]; b[3] = src[0];
+                } else {
+                    memcpy(b, src, 4);
+                }
+                memcpy(&v, b, 4);
+
+                image->ch[c][(size_t) y * width + x] = v;
+            }
+        }
+    }
+
+    return image;
+}
+
+pfm_t* read_pfm_image(char *filename)
+{
+    size_t size;
+    u_char *data = aio_read_wait(aio_read_submit(filename), &size);
+    pfm_t *image = decode_pfm_image(data, size);
+
+    free(data);
+
+    return image;
+}
+
+/* interleave into a little endian PFM file image and queue it for writing */
+void write_pfm_image(pfm_t *image, char *filename)
+{
+    int width = image->width, channels = image->channels, swap = !host_little_endian();
+    size_t pitch = (size_t) width * channels * sizeof(float);
+    char header[64];
+    int hsize, x, y, c;
+    u_char *data;
+
+    hsize = sprintf(header, "P%c\n%d %d\n-1.0\n", 3 == channels ? 'F' : 'f', width, image->height);
+
+    data = (u_char *) malloc(hsize + pitch * image->height);
+    if (!data) { die("cannot allocate memory for new image"); }
+
+    memcpy(data, header, hsize);
+
+    for (y = 0; y < image->height; y++) {
+        u_char *dst = data + hsize + (size_t) (image->height - 1 - y) * pitch;
+
+        for (x = 0; x < width; x++) {
+            for (c = 0; c < channels; c++, dst += 4) {
+                u_char b[4];
+
+                memcpy(b, &image->ch[c][(size_t) y * width + x], 4);
+                if (swap) {
+                    dst[0] = b[3]; dst[1] = b[2]; dst[2] = b[1]; dst[3] = b[0];
+                } else {
+                    memcpy(dst, b, 4);
+                }
+            }
+        }
+    }
+
+    aio_write_submit(filename, data, hsize + pitch * image->height);
+}
+
+/* dst = src / maxval */
+void u16_to_float(const u_short *src, float *dst, size_t count, float maxval)
+{
+    size_t i = 0;
+
+#ifdef PFM_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 m = _mm_set1_ps(maxval);
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+
+        _mm_storeu_ps(dst + i,     _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)), m));
+        _mm_storeu_ps(dst + i + 4, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)), m));
+    }
+#endif
+
+    for (; i < count; i++) {
+        dst[i] = (float) src[i] / maxval;
+    }
+}
+
+/* dst = (int) (src * scale + bias), clamped to 0 .. maxval */
+void float_to_u16(const float *src, u_short *dst, size_t count, float scale, float bias, int maxval)
+{
+    size_t i = 0;
+
+#ifdef PFM_SSE2
+    const __m128 s = _mm_set1_ps(scale), b = _mm_set1_ps(bias);
+    const __m128 lo = _mm_setzero_ps(), hi = _mm_set1_ps((float) maxval);
+    const __m128i flip = _mm_set1_epi32(32768);
+    const __m128i sign = _mm_set1_epi16((short) 0x8000);
+
+    for (; i + 8 <= count; i += 8) {
+        __m128 f0 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i), s), b);
+        __m128 f1 = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + i + 4), s), b);
+        __m128i i0, i1;
+
+        /* max/min order also maps NaN to 0 */
+        f0 = _mm_min_ps(_mm_max_ps(f0, lo), hi);
+        f1 = _mm_min_ps(_mm_max_ps(f1, lo), hi);
+        i0 = _mm_sub_epi32(_mm_cvttps_epi32(f0), flip);
+        i1 = _mm_sub_epi32(_mm_cvttps_epi32(f1), flip);
+
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(_mm_packs_epi32(i0, i1), sign));
+    }
+#endif
+
+    for (; i < count; i++) {
+        float v = src[i] * scale + bias;
+
+        dst[i] = (u_short) (v > 0.f ? (v < (float) maxval ? (int) v : maxval) : 0);
+    }
+}
+
+/* sRGB-encoded samples to normalized linear light, through a table of 0 .. maxval */
+static void decode_srgb(const u_short *src, float *dst, size_t count, const float *table, int maxval)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        dst[i] = src[i] <= maxval ? table[src[i]] : (float) srgb_to_linear((double) src[i] / maxval);
+    }
+}
+
+/* normalized linear light to sRGB-encoded samples of maxval, rounded */
+static void encode_srgb(const float *src, u_short *dst, size_t count, int maxval)
+{
+    float chunk[PFM_CHUNK];
+    size_t i, j, n;
+
+    for (i = 0; i < count; i += n) {
+        n = count - i < PFM_CHUNK ? count - i : PFM_CHUNK;
+
+        for (j = 0; j < n; j++) {
+            chunk[j] = (float) linear_to_srgb(src[i + j]);
+        }
+        float_to_u16(chunk, dst + i, n, (float) maxval, 0.5f, maxval);
+    }
+}
+
+/*
+ * Normalize to 0.0 - 1.0. With 'linear' the samples are taken to be sRGB
+ * encoded and are decoded to linear light, as PFM files expect; otherwise
+ * they keep the transfer curve of the source.
+ */
+pfm_t* ppm_to_pfm(ppm_t *src, int linear)
+{
+    size_t count = (size_t) src->width * src->height;
+    pfm_t *dst = alloc_pfm_buffer(src->width, src->height, 3);
+    float *table;
+    int i;
+
+    if (!linear) {
+        u16_to_float(src->ch1, dst->ch[0], count, (float) src->maxval);
+        u16_to_float(src->ch2, dst->ch[1], count, (float) src->maxval);
+        u16_to_float(src->ch3, dst->ch[2], count, (float) src->maxval);
+
+        return dst;
+    }
+
+    if (NULL == (table = (float *) malloc((src->maxval + 1) * sizeof(float)))) {
+        die("cannot allocate memory for transfer table");
+    }
+
+    for (i = 0; i <= src->maxval; i++) {
+        table[i] = (float) srgb_to_linear((double) i / src->maxval);
+    }
+
+    decode_srgb(src->ch1, dst->ch[0], count, table, src->maxval);
+    decode_srgb(src->ch2, dst->ch[1], count, table, src->maxval);
+    decode_srgb(src->ch3, dst->ch[2], count, table, src->maxval);
+
+    free(table);
+
+    return dst;
+}
+
+/*
+ * Quantize to maxval with rounding, sRGB encoding linear samples first when
+ * 'linear' is set; a grey map fills all three channels.
+ */
+ppm_t* pfm_to_ppm(pfm_t *src, int maxval, int linear)
+{
+    size_t count = (size_t) src->width * src->height;
+    ppm_t *dst = alloc_ppm_buffer(src->width, src->height, maxval);
+    int c3 = 3 == src->channels;
+
+    if (!dst) { die("cannot allocate memory for new image"); }
+
+    if (linear) {
+        encode_srgb(src->ch[0], dst->ch1, count, maxval);
+        encode_srgb(src->ch[c3 ? 1 : 0], dst->ch2, count, maxval);
+        encode_srgb(src->ch[c3 ? 2 : 0], dst->ch3, count, maxval);
+    } else {
+        float_to_u16(src->ch[0], dst->ch1, count, (float) maxval, 0.5f, maxval);
+        float_to_u16(src->ch[c3 ? 1 : 0], dst->ch2, count, (float) maxval, 0.5f, maxval);
+        float_to_u16(src->ch[c3 ? 2 : 0], dst->ch3, count, (float) maxval, 0.5f, maxval);
+    }
+
+    return dst;
+}
@@ -0,0 +1,37 @@
+#ifndef PFM_H
+#define PFM_H
+
+#include "ppm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* planar float image; samples are normalized, nominally 0.0 - 1.0 */
+typedef struct pfm
+{
+    int width;
+    int height;
+    int channels;       /* 1 (Pf) or 3 (PF) */
+    float *ch[3];
+} pfm_t;
+
+pfm_t* alloc_pfm_buffer(int width, int height, int channels);
+void   free_pfm_buffer(pfm_t *image);
+
+int    is_pfm_data(u_char *data, size_t size);
+pfm_t* decode_pfm_image(u_char *data, size_t size);
+pfm_t* read_pfm_image(char *filename);
+void   write_pfm_image(pfm_t *image, char *filename);
+
+void u16_to_float(const u_short *src, float *dst, size_t count, float maxval);
+void float_to_u16(const float *src, u_short *dst, size_t count, float scale, float bias, int maxval);
+
+pfm_t* ppm_to_pfm(ppm_t *src, int linear);
+ppm_t* pfm_to_ppm(pfm_t *src, int maxval, int linear);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PFM_H */
@@ -4,8 +4,14 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <ctype.h>
 #include "pgm.h"
+#include "aio.h"
+#include "thread.h"
+#include "topology.h"
+
+static pgm_hook_t read_hook = NULL;
 
 static void die(char *message)
 {
@@ -47,32 +53,50 @@ u_short get_pgm_pixel(pgm_t *image, int x, int y)
     return (u_short) data[offset];
 }
 
-static void read_pgm_header(FILE *fp, int *width, int *height, int *maxval)
+size_t read_pgm_header(u_char *data, size_t size, int *width, int *height, int *maxval)
 {
-    char ch;
-    if (fscanf(fp, "P%c\n", &ch) != 1 || ch != '5') {
-        die("file is not in ppm raw format; cannot read");
-    }
+    int *field[3];
+    size_t pos = 2;
+    int i;
 
-    ch = getc(fp);
-    while (ch == '#') {
-        do {
-            ch = getc(fp);
-        } while (ch != '\n');
-        ch = getc(fp);
-    }
+    field[0] = width;
+    field[1] = height;
+    field[2] = maxval;
 
-    if (!isdigit(ch)) {
-        die("cannot read header information from ppm file");
+    if (size < 2 || data[0] != 'P' || data[1] != '5') {
+        die("file is not in pgm raw format; cannot read");
     }
 
-    ungetc(ch, fp);
+    for (i = 0; i < 3; i++) {
+        while (pos < size && (isspace(data[pos]) || data[pos] == '#')) {
+            if (data[pos] == '#') {
+                while (pos < size && data[pos] != '\n') { pos++; }
+            } else {
+                pos++;
+            }
+        }
 
-    /* read the width, height, and maximum value for a pixel */
-    fscanf(fp, "%d%d%d\n", width, height, maxval);
+        if (pos >= size || !isdigit(data[pos])) {
+            die("cannot read header information from pgm file");
+        }
+
+        *field[i] = 0;
+        while (pos < size && isdigit(data[pos])) {
+            if (*field[i] > (INT_MAX - 9) / 10) { die("cannot read header information from pgm file"); }
+            *field[i] = *field[i] * 10 + (data[pos++] - '0');
+        }
+    }
+
+    pos++;
 
     check_dimension(*width);
     check_dimension(*height);
+
+    if (*maxval < 1 || *maxval > USHRT_MAX) {
+        die("file contained unreasonable maximum value");
+    }
+
+    return pos;
 }
 
 pgm_t* alloc_pgm_buffer(int width, int height, int maxval)
@@ -87,10 +111,12 @@ pgm_t* alloc_pgm_buffer(int width, int height, int maxval)
     image->height = height;
     image->maxval = maxval;
 
-    if (NULL == (image->ch = (u_short *) malloc(width * height * byte))) { return NULL; }
+    if (NULL == (image->ch = (u_short *) malloc((size_t) width * height * byte))) { return NULL; }
 
     if (!image->ch) { die("cannot allocate memory for new image"); }
 
+    place_rows(image->ch, (size_t) width * byte, height);
+
     return image;
 }
 
@@ -117,89 +143,123 @@ void clear_pgm_image(pgm_t *image, u_short grey)
     }
 }
 
-pgm_t* read_pgm_image(char *filename)
+/* raster rows of a file image decoded into the plane */
+typedef struct decode_job
 {
-    int width, height, maxval, num, size, byte, chsize, x, y, channel;
-    u_short *data, *ch = NULL;
-    unsigned char *data0 = 0;
+    pgm_t *image;
+    const u_char *raster;
+    size_t pitch;
+} decode_job_t;
 
-    pgm_t *image = (pgm_t*) malloc(sizeof(pgm_t));
-    FILE  *fp    = fopen(filename, "rb");
-
-    if (!image) { die("cannot allocate memory for new image"); }
-    if (!fp) { die("cannot open file for reading"); }
+static void decode_rows(void *arg, int begin, int end)
+{
+    decode_job_t *job = (decode_job_t *) arg;
+    pgm_t *image = job->image;
+    int width = image->width, x, y;
 
-    read_pgm_header(fp, &width, &height, &maxval);
+    for (y = begin; y < end; y++) {
+        const u_char *src = job->raster + (size_t) y * job->pitch;
+        u_short *ch = image->ch + (size_t) y * width;
 
-    channel = 1;
-    chsize  = width * height * sizeof(u_short);  //for 2 byte pixel
-    byte    = maxval > 255 ? sizeof(u_short) : sizeof(u_char);
-    size    = width * height * byte * channel;  //r,g,b channel
-    data    = (u_short *) malloc(chsize * channel);
-    ch      = (u_short *) malloc(chsize);
+        if (image->maxval > 255) {
+            for (x = 0; x < width; x++, src += 2) {
+                ch[x] = (u_short) ((src[0] << 8) | src[1]);
+            }
+        } else {
+            for (x = 0; x < width; x++) {
+                ch[x] = src[x];
+            }
+        }
+    }
+}
 
-    if (!data) { die("cannot allocate memory for new image"); }
+pgm_t* decode_pgm_image(u_char *data, size_t size)
+{
+    int width, height, maxval;
+    size_t pos, pitch;
+    decode_job_t job;
+    pgm_t *image;
 
-    num = fread((void *) data, 1, (size_t) size, fp);
-    if (num != size) { die("cannot read image data from file"); }
+    pos   = read_pgm_header(data, size, &width, &height, &maxval);
+    pitch = (size_t) width * (maxval > 255 ? 2 : 1);
 
-    fclose(fp);
+    if (pos > size || size - pos < pitch * height) {
+        die("cannot read image data from file");
+    }
 
-    data0 = (unsigned char*) data;
-    for (y = 0; y < height; y++) {
-        for (x = 0; x < width;  x++) {
-            if (maxval > 255) {
-                ch[y * width + x] = (((data[y * (width * channel) + (x * channel) + 0] & 0x00ff) << 8) |
-                                     ((data[y * (width * channel) + (x * channel) + 0] & 0xff00) >> 8));
-            } else {
-                ch[y * width + x] = data0[y * (width * channel) + (x * channel) + 0];
-            }
-        }
+    if (NULL == (image = alloc_pgm_buffer(width, height, maxval))) {
+        die("cannot allocate memory for new image");
     }
 
-    image->width  = width;
-    image->height = height;
-    image->maxval = maxval;
-    image->ch     = ch;
+    job.image  = image;
+    job.raster = data + pos;
+    job.pitch  = pitch;
 
-    if (data) { free(data); data = 0; }
+    parallel_for_bytes(height, 16, pitch + (size_t) width * sizeof(u_short), decode_rows, &job);
 
     return image;
 }
 
+/* collect a read queued with aio_read_submit() and decode it */
+pgm_t* wait_pgm_image(aio_req_t *req, char *filename)
+{
+    size_t size;
+    u_char *data = aio_read_wait(req, &size);
+    pgm_t *image = decode_pgm_image(data, size);
+
+    free(data);
+
+    if (read_hook) { read_hook(image, filename); }
+
+    return image;
+}
+
+pgm_t* read_pgm_image(char *filename)
+{
+    return wait_pgm_image(aio_read_submit(filename), filename);
+}
+
+/* call 'hook' on every image read from a file, e.g. for side statistics */
+void set_pgm_read_hook(pgm_hook_t hook)
+{
+    read_hook = hook;
+}
+
+pgm_hook_t get_pgm_read_hook(void)
+{
+    return read_hook;
+}
+
 void write_pgm_image(pgm_t *image, char *filename)
 {
-    int num, x, y;
-    int channel = 1;
-    int byte = image->maxval > 255 ? sizeof(u_short) : sizeof(u_char);
-    int pitch = image->width * byte;
-    int chsize  = pitch * image->height;
-    FILE *fp = 0;
+    int x, y, hsize;
+    int width = image->width;
+    char header[64];
+    size_t pitch = (size_t) width * (image->maxval > 255 ? 2 : 1);
+    u_char *data;
+
+    hsize = sprintf(header, "P5\n%d %d\n%d\n", image->width, image->height, image->maxval);
 
-    u_char *data0 = 0;
-    u_short *data     = (u_short *) malloc(chsize * channel);
+    data = (u_char *) malloc(hsize + pitch * image->height);
     if (!data) { die("cannot allocate memory for new image"); }
 
-    data0 = (u_char*) data;
+    memcpy(data, header, hsize);
+
     for (y = 0; y < image->height; y++) {
-        for (x = 0; x < image->width;  x++) {
-            if (image->maxval > 255) {
-                data[(y * image->width * channel) + (x * channel) + 0] = (((image->ch[y * image->width + x] & 0x00ff) << 8) |
-                                                                          ((image->ch[y * image->width + x] & 0xff00) >>8 ));
-            } else {
-                data0[(y * image->width * channel) + (x * channel) + 0] = (u_char) image->ch[y * image->width + x];
+        u_char  *dst = data + hsize + (size_t) y * pitch;
+        u_short *ch  = image->ch + (size_t) y * width;
+
+        if (image->maxval > 255) {
+            for (x = 0; x < width; x++, dst += 2) {
+                dst[0] = (u_char) (ch[x] >> 8);
+                dst[1] = (u_char) ch[x];
+            }
+        } else {
+            for (x = 0; x < width; x++) {
+                dst[x] = (u_char) ch[x];
             }
         }
     }
 
-   fp = fopen(filename, "wb");
-   if (!fp) { die("cannot open file for writing"); }
-
-   fprintf(fp, "P5\n%d %d\n%d\n", image->width, image->height, image->maxval);
-   num = fwrite((void *) data, 1, (size_t) (chsize * channel), fp);
-   if (num != (chsize * channel)) { die("cannot write image data to file"); }
-
-   fclose(fp);
-
-   if (data) { free(data); data = 0; }
+    aio_write_submit(filename, data, hsize + pitch * image->height);
 }
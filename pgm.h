@@ -19,11 +19,20 @@ typedef struct pgm
     u_short *ch;
 } pgm_t;
 
+struct aio_req;
+
+typedef void (*pgm_hook_t)(pgm_t *image, char *filename);
+
 pgm_t* alloc_pgm_buffer(int width, int height, int maxval);
 void   free_pgm_buffer(pgm_t *image);
 void   clear_pgm_image(pgm_t *image, u_short grey);
 
+size_t read_pgm_header(u_char *data, size_t size, int *width, int *height, int *maxval);
+pgm_t* decode_pgm_image(u_char *data, size_t size);
+pgm_t* wait_pgm_image(struct aio_req *req, char *filename);
 pgm_t* read_pgm_image(char *filename);
+void   set_pgm_read_hook(pgm_hook_t hook);
+pgm_hook_t get_pgm_read_hook(void);
 void   write_pgm_image(pgm_t *image, char *filename);
 
 #ifdef __cplusplus
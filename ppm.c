@@ -4,8 +4,16 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <ctype.h>
 #include "ppm.h"
+#include "aio.h"
+#include "thread.h"
+#include "topology.h"
+
+#define PPM_HEADER_BYTES 4096   /* a header, comments included, must fit */
+
+static ppm_hook_t read_hook = NULL;
 
 static void die(char *message)
 {
@@ -47,33 +55,53 @@ u_short get_ppm_pixel(ppm_t *image, int x, int y, int chan)
     return (u_short) data[offset];
 }
 
-static void read_ppm_header(FILE *fp, int *width, int *height, int *maxval)
+/* parse the P6 header; returns the offset of the first raster byte */
+size_t read_ppm_header(u_char *data, size_t size, int *width, int *height, int *maxval)
 {
-    char ch;
-    if (fscanf(fp, "P%c\n", &ch) != 1 || ch != '6') {
+    int *field[3];
+    size_t pos = 2;
+    int i;
+
+    field[0] = width;
+    field[1] = height;
+    field[2] = maxval;
+
+    if (size < 2 || data[0] != 'P' || data[1] != '6') {
         die("file is not in ppm raw format; cannot read");
     }
 
-    /* skip comments */
-    ch = getc(fp);
-    while (ch == '#') {
-        do {
-            ch = getc(fp);
-        } while (ch != '\n');	/* read to the end of the line */
-        ch = getc(fp);            /* thanks, Elliot */
-    }
-    
-    if (!isdigit(ch)) {
-        die("cannot read header information from ppm file");
-    }
+    for (i = 0; i < 3; i++) {
+        /* skip white space and comments */
+        while (pos < size && (isspace(data[pos]) || data[pos] == '#')) {
+            if (data[pos] == '#') {
+                while (pos < size && data[pos] != '\n') { pos++; }
+            } else {
+                pos++;
+            }
+        }
 
-    ungetc(ch, fp);		/* put that digit back */
+        if (pos >= size || !isdigit(data[pos])) {
+            die("cannot read header information from ppm file");
+        }
 
-    /* read the width, height, and maximum value for a pixel */
-    fscanf(fp, "%d%d%d\n", width, height, maxval);
+        *field[i] = 0;
+        while (pos < size && isdigit(data[pos])) {
+            if (*field[i] > (INT_MAX - 9) / 10) { die("cannot read header information from ppm file"); }
+            *field[i] = *field[i] * 10 + (data[pos++] - '0');
+        }
+    }
+
+    /* exactly one white space character separates the header from the raster */
+    pos++;
 
     check_dimension(*width);
     check_dimension(*height);
+
+    if (*maxval < 1 || *maxval > USHRT_MAX) {
+        die("file contained unreasonable maximum value");
+    }
+
+    return pos;
 }
 
 ppm_t* alloc_ppm_buffer(int width, int height, int maxval)
@@ -88,14 +116,18 @@ ppm_t* alloc_ppm_buffer(int width, int height, int maxval)
     image->height = height;
     image->maxval = maxval;
     
-    if (NULL == (image->ch1 = (u_short *) malloc(width * height * byte))) { return NULL; }
-    if (NULL == (image->ch2 = (u_short *) malloc(width * height * byte))) { return NULL; }
-    if (NULL == (image->ch3 = (u_short *) malloc(width * height * byte))) { return NULL; }
+    if (NULL == (image->ch1 = (u_short *) malloc((size_t) width * height * byte))) { return NULL; }
+    if (NULL == (image->ch2 = (u_short *) malloc((size_t) width * height * byte))) { return NULL; }
+    if (NULL == (image->ch3 = (u_short *) malloc((size_t) width * height * byte))) { return NULL; }
     
     if (!image->ch1) { die("cannot allocate memory for new image"); }
     if (!image->ch2) { die("cannot allocate memory for new image"); }
     if (!image->ch3) { die("cannot allocate memory for new image"); }
 
+    place_rows(image->ch1, (size_t) width * byte, height);
+    place_rows(image->ch2, (size_t) width * byte, height);
+    place_rows(image->ch3, (size_t) width * byte, height);
+
     return image;
 }
 
@@ -128,106 +160,405 @@ void clear_ppm_buffer(ppm_t *image, u_short red, u_short green, u_short blue)
     }
 }
 
+/* raster rows of a file image decoded into planes */
+typedef struct decode_job
+{
+    ppm_t *image;
+    const u_char *raster;
+    size_t pitch;
+} decode_job_t;
+
+static void decode_rows(void *arg, int begin, int end)
+{
+    decode_job_t *job = (decode_job_t *) arg;
+    ppm_t *image = job->image;
+    int width = image->width, x, y;
+
+    for (y = begin; y < end; y++) {
+        const u_char *src = job->raster + (size_t) y * job->pitch;
+        u_short *ch1 = image->ch1 + (size_t) y * width;
+        u_short *ch2 = image->ch2 + (size_t) y * width;
+        u_short *ch3 = image->ch3 + (size_t) y * width;
+
+        if (image->maxval > 255) {
+            for (x = 0; x < width; x++, src += 6) {
+                ch1[x] = (u_short) ((src[0] << 8) | src[1]);
+                ch2[x] = (u_short) ((src[2] << 8) | src[3]);
+                ch3[x] = (u_short) ((src[4] << 8) | src[5]);
+            }
+        } else {
+            for (x = 0; x < width; x++, src += 3) {
+                ch1[x] = src[0];
+                ch2[x] = src[1];
+                ch3[x] = src[2];
+            }
+        }
+    }
+}
+
+/* decode in row strips, so each plane band is first touched by the strip that will process it */
+ppm_t* decode_ppm_image(u_char *data, size_t size)
+{
+    int width, height, maxval;
+    size_t pos, pitch;
+    decode_job_t job;
+    ppm_t *image;
+
+    pos   = read_ppm_header(data, size, &width, &height, &maxval);
+    pitch = (size_t) width * 3 * (maxval > 255 ? 2 : 1);
+
+    if (pos > size || size - pos < pitch * height) {
+        die("cannot read image data from file");
+    }
+
+    if (NULL == (image = alloc_ppm_buffer(width, height, maxval))) {
+        die("cannot allocate memory for new image");
+    }
+
+    job.image  = image;
+    job.raster = data + pos;
+    job.pitch  = pitch;
+
+    parallel_for_bytes(height, 16, pitch + (size_t) width * 3 * sizeof(u_short), decode_rows, &job);
+
+    return image;
+}
+
+/* collect a read queued with aio_read_submit() and decode it */
+ppm_t* wait_ppm_image(aio_req_t *req, char *filename)
+{
+    size_t size;
+    u_char *data = aio_read_wait(req, &size);
+    ppm_t *image = decode_ppm_image(data, size);
+
+    free(data);
+
+    if (read_hook) { read_hook(image, filename); }
+
+    return image;
+}
+
 ppm_t* read_ppm_image(char *filename)
 {
-    int width, height, maxval, num, size, byte, chsize, x, y, channel;
-    u_short *data, *ch1, *ch2, *ch3;
-	unsigned char *data0 = 0;
-	    
-    ppm_t *image = (ppm_t *) malloc(sizeof(ppm_t));
-    FILE  *fp    = fopen(filename, "rb");
-    
+    return wait_ppm_image(aio_read_submit(filename), filename);
+}
+
+/* a batch of region rows, box-reduced into output rows first, first + 1, ... */
+typedef struct reduce_job
+{
+    ppm_t *image;
+    const u_char *raster;   /* first row of the batch, at the region's first column */
+    size_t pitch;           /* bytes between rows of 'raster' */
+    int width;              /* region dimensions */
+    int height;
+    int factor;
+    int first;              /* output row of the first batch row */
+} reduce_job_t;
+
+/* the reads of one batch of region rows, in flight */
+typedef struct raster_batch
+{
+    int first;              /* output row of the first batch row */
+    int rows;               /* output rows */
+    int in_rows;            /* region rows read */
+    aio_req_t **req;        /* one per region row when narrow, else req[0] only */
+} raster_batch_t;
+
+static void reduce_rows(void *arg, int begin, int end)
+{
+    reduce_job_t *job = (reduce_job_t *) arg;
+    ppm_t *image = job->image;
+    int f = job->factor, w = job->width, rw = image->width;
+    int wide = image->maxval > 255;
+    unsigned *acc = (unsigned *) malloc((size_t) rw * 3 * sizeof(unsigned));
+    int u, v, x, k;
+
+    if (!acc) { die("cannot allocate memory for scratch row"); }
+
+    for (v = begin; v < end; v++) {
+        int y    = job->first + v;
+        int rows = job->height - y * f < f ? job->height - y * f : f;
+        const u_char *src = job->raster + (size_t) v * f * job->pitch;
+        size_t offset = (size_t) y * rw;
+
+        memset(acc, 0, (size_t) rw * 3 * sizeof(unsigned));
+
+        for (k = 0; k < rows; k++, src += job->pitch) {
+            const u_char *s = src;
+            unsigned *a = acc;
+
+            for (u = 0, x = 0; u < rw; u++, a += 3) {
+                int stop = x + f < w ? x + f : w;
+                unsigned r = 0, g = 0, b = 0;
+
+                if (wide) {
+                    for (; x < stop; x++, s += 6) {
+                        r += (s[0] << 8) | s[1];
+                        g += (s[2] << 8) | s[3];
+                        b += (s[4] << 8) | s[5];
+                    }
+                } else {
+                    for (; x < stop; x++, s += 3) {
+                        r += s[0];
+                        g += s[1];
+                        b += s[2];
+                    }
+                }
+
+                a[0] += r;
+                a[1] += g;
+                a[2] += b;
+            }
+        }
+
+        for (u = 0; u < rw; u++) {
+            unsigned n = (unsigned) rows * (w - u * f < f ? w - u * f : f);
+            const unsigned *a = acc + 3 * u;
+
+            image->ch1[offset + u] = (u_short) ((a[0] + n / 2) / n);
+            image->ch2[offset + u] = (u_short) ((a[1] + n / 2) / n);
+            image->ch3[offset + u] = (u_short) ((a[2] + n / 2) / n);
+        }
+    }
+
+    free(acc);
+}
+
+/* parse the header of a P6 file, read through aio, for later raster reads */
+ppm_source_t* open_ppm_source(char *filename)
+{
+    ppm_source_t *source = (ppm_source_t *) calloc(1, sizeof(ppm_source_t));
+    size_t size;
+    u_char *header;
+
+    if (!source) { die("cannot allocate memory for image source"); }
+
+    if (NULL == (source->filename = (char *) malloc(strlen(filename) + 1))) {
+        die("cannot allocate memory for image source");
+    }
+    strcpy(source->filename, filename);
+
+    header = aio_read_wait(aio_read_range_submit(filename, 0, PPM_HEADER_BYTES), &size);
+
+    source->raster = read_ppm_header(header, size, &source->width, &source->height, &source->maxval);
+    source->pitch  = (size_t) source->width * 3 * (source->maxval > 255 ? 2 : 1);
+
+    if (source->raster > size) { die("cannot read image data from file"); }
+
+    free(header);
+
+    return source;
+}
+
+void close_ppm_source(ppm_source_t *source)
+{
+    if (!source) { die("cannot release image source"); }
+
+    free(source->filename);
+    free(source);
+}
+
+/* output rows [first, first + limit) of 'out_height', from region rows of 'height' */
+static void plan_batch(raster_batch_t *batch, int first, int limit, int out_height, int factor, int height)
+{
+    batch->first   = first;
+    batch->rows    = out_height - first < limit ? out_height - first : limit;
+    batch->in_rows = (first + batch->rows) * factor < height ? batch->rows * factor : height - first * factor;
+}
+
+/*
+ * Queue the reads of region rows [y, y + in_rows): one read spanning them
+ * all, or, when the region is less than half a file row wide, one read per
+ * row so the columns outside it are not read at all.
+ */
+static void submit_batch(ppm_source_t *source, int x, int y, size_t span, int narrow, raster_batch_t *batch)
+{
+    size_t start = source->raster + (size_t) y * source->pitch + (size_t) x * (source->pitch / source->width);
+    int k;
+
+    if (narrow) {
+        for (k = 0; k < batch->in_rows; k++) {
+            batch->req[k] = aio_read_range_submit(source->filename, start + (size_t) k * source->pitch, span);
+        }
+    } else {
+        batch->req[0] = aio_read_range_submit(source->filename, start,
+                                              (size_t) (batch->in_rows - 1) * source->pitch + span);
+    }
+}
+
+/* wait for a batch; returns its rows 'span' bytes apart when narrow, else a file pitch apart */
+static u_char* wait_batch(ppm_source_t *source, size_t span, int narrow, raster_batch_t *batch)
+{
+    u_char *raster, *data;
+    size_t size;
+    int k;
+
+    if (!narrow) {
+        raster = aio_read_wait(batch->req[0], &size);
+        if (size < (size_t) (batch->in_rows - 1) * source->pitch + span) { die("cannot read image data from file"); }
+
+        return raster;
+    }
+
+    if (NULL == (raster = (u_char *) malloc((size_t) batch->in_rows * span))) {
+        die("cannot allocate memory for raster rows");
+    }
+
+    for (k = 0; k < batch->in_rows; k++) {
+        data = aio_read_wait(batch->req[k], &size);
+        if (size < span) { die("cannot read image data from file"); }
+
+        memcpy(raster + (size_t) k * span, data, span);
+        free(data);
+    }
+
+    return raster;
+}
+
+/*
+ * Shrink-on-load: box-average factor x factor blocks of the width x height
+ * region at (x, y) as its rows arrive, so only the reduced region is ever
+ * held in memory. The result is ceil(width / factor) x ceil(height / factor);
+ * boxes at the region's right and bottom edges average the samples they
+ * cover. Rows are read through aio in batches of about 4 MB, the next batch
+ * in flight while the current one is reduced. The read hook is not called,
+ * the full image never exists.
+ */
+ppm_t* read_ppm_region_reduced(ppm_source_t *source, int x, int y, int width, int height, int factor)
+{
+    size_t span = (size_t) width * (source->pitch / source->width);
+    int narrow = 2 * span < source->pitch;
+    raster_batch_t batch[2], *cur;
+    size_t limit;
+    reduce_job_t job;
+    ppm_t *image;
+    int i;
+
+    if (factor < 1 || factor > PPM_MAX_REDUCTION) { die("unreasonable reduction factor"); }
+
+    if (x < 0 || y < 0 || width < 1 || height < 1 || x + width > source->width || y + height > source->height) {
+        die("region outside of the image");
+    }
+
+    image = alloc_ppm_buffer((width + factor - 1) / factor, (height + factor - 1) / factor, source->maxval);
     if (!image) { die("cannot allocate memory for new image"); }
-    if (!fp) { die("cannot open file for reading"); }
-    
-    read_ppm_header(fp, &width, &height, &maxval);
-    
-	channel       = 3;
-    chsize        = width * height * sizeof(u_short);  //for 2 byte pixel
-    byte          = maxval > 255 ? sizeof(u_short) : sizeof(u_char);
-    size          = width * height * byte * channel;  //r,g,b channel
-    data          = (u_short *) malloc(chsize * channel);
-    
-    ch1           = (u_short *) malloc(chsize);
-    ch2           = (u_short *) malloc(chsize);
-    ch3           = (u_short *) malloc(chsize);
-    
-    if (!data) { die("cannot allocate memory for new image"); }
-    
-    num = fread((void *) data, 1, (size_t) size, fp);
-    if (num != size) { die("cannot read image data from file"); }
-    
-    fclose(fp);
-    
-	data0 = (unsigned char*) data;
-    for (y = 0; y < height; y++) {
-        for (x = 0; x < width;  x++) {
-			if (maxval > 255) {
-				ch1[y * width + x] = (((data[y * (width * channel) + (x * channel) + 0] & 0x00ff) << 8) | 
-                                      ((data[y * (width * channel) + (x * channel) + 0] & 0xff00) >> 8));
-				ch2[y * width + x] = (((data[y * (width * channel) + (x * channel) + 1] & 0x00ff) << 8) | 
-                                      ((data[y * (width * channel) + (x * channel) + 1] & 0xff00) >> 8));
-				ch3[y * width + x] = (((data[y * (width * channel) + (x * channel) + 2] & 0x00ff) << 8) | 
-                                      ((data[y * (width * channel) + (x * channel) + 2] & 0xff00) >> 8));
-			} else {
-				ch1[y * width + x] = data0[y * (width * channel) + (x * channel) + 0];
-				ch2[y * width + x] = data0[y * (width * channel) + (x * channel) + 1];
-				ch3[y * width + x] = data0[y * (width * channel) + (x * channel) + 2];
-			}
+
+    /* whole output rows per batch, about 4 MB of raster at a time */
+    limit = ((size_t) 4 << 20) / ((narrow ? span : source->pitch) * factor);
+    if (limit < 1) { limit = 1; }
+    if (limit > (size_t) image->height) { limit = image->height; }
+
+    for (i = 0; i < 2; i++) {
+        batch[i].req = (aio_req_t **) malloc((narrow ? limit * factor : 1) * sizeof(aio_req_t *));
+        if (!batch[i].req) { die("cannot allocate memory for read requests"); }
+    }
+
+    job.image  = image;
+    job.pitch  = narrow ? span : source->pitch;
+    job.width  = width;
+    job.height = height;
+    job.factor = factor;
+
+    /* the next batch is queued before the current one is reduced */
+    cur = &batch[0];
+    plan_batch(cur, 0, (int) limit, image->height, factor, height);
+    submit_batch(source, x, y, span, narrow, cur);
+
+    for (;;) {
+        raster_batch_t *next = cur == &batch[0] ? &batch[1] : &batch[0];
+        int done = cur->first + cur->rows >= image->height;
+        u_char *raster;
+
+        if (!done) {
+            plan_batch(next, cur->first + cur->rows, (int) limit, image->height, factor, height);
+            submit_batch(source, x, y + next->first * factor, span, narrow, next);
         }
+
+        raster = wait_batch(source, span, narrow, cur);
+
+        job.raster = raster;
+        job.first  = cur->first;
+        parallel_for_bytes(cur->rows, 1, factor * job.pitch + (size_t) image->width * 3 * sizeof(u_short),
+                           reduce_rows, &job);
+        free(raster);
+
+        if (done) { break; }
+        cur = next;
     }
-    
-    image->width  = width;
-    image->height = height;
-    image->maxval = maxval;
-    image->ch1    = ch1;
-    image->ch2    = ch2;
-    image->ch3    = ch3;
-    
-    if (data) { free(data); data = 0; }
-    
+
+    free(batch[0].req);
+    free(batch[1].req);
+
     return image;
 }
 
+/* shrink-on-load of a whole file; its full-size dimensions go to 'width' and 'height' */
+ppm_t* read_ppm_image_reduced(char *filename, int factor, int *width, int *height)
+{
+    ppm_source_t *source = open_ppm_source(filename);
+    ppm_t *image = read_ppm_region_reduced(source, 0, 0, source->width, source->height, factor);
+
+    *width  = source->width;
+    *height = source->height;
+    close_ppm_source(source);
+
+    return image;
+}
+
+/* call 'hook' on every image read from a file, e.g. for side statistics */
+void set_ppm_read_hook(ppm_hook_t hook)
+{
+    read_hook = hook;
+}
+
+ppm_hook_t get_ppm_read_hook(void)
+{
+    return read_hook;
+}
+
+/*
+ * Interleave the planes into a P6 file image and hand it to the async
+ * writer; the function returns before the data reaches the disk, use
+ * aio_flush() to wait for it.
+ */
 void write_ppm_image(ppm_t *image, char *filename)
 {
-    int num, x, y;
-    int channel = 3;
-	int byte = image->maxval > 255 ? sizeof(u_short) : sizeof(u_char);
-	int pitch = image->width * byte;
-    int chsize  = pitch * image->height;
-    FILE *fp = 0;
-    
-	u_char *data0 = 0;
-    u_short *data     = (u_short *) malloc(chsize * channel);
+    int x, y, hsize;
+    int width = image->width;
+    char header[64];
+    size_t pitch = (size_t) width * 3 * (image->maxval > 255 ? 2 : 1);
+    u_char *data;
+
+    hsize = sprintf(header, "P6\n%d %d\n%d\n", image->width, image->height, image->maxval);
+
+    data = (u_char *) malloc(hsize + pitch * image->height);
     if (!data) { die("cannot allocate memory for new image"); }
-    
-	data0 = (u_char*) data;
+
+    memcpy(data, header, hsize);
+
     for (y = 0; y < image->height; y++) {
-        for (x = 0; x < image->width;  x++) {
-			if (image->maxval > 255) {
-				data[(y * image->width * channel) + (x * channel) + 0] = (((image->ch1[y * image->width + x] & 0x00ff) << 8) | 
-                                                                          ((image->ch1[y * image->width + x] & 0xff00) >> 8));
-				data[(y * image->width * channel) + (x * channel) + 1] = (((image->ch2[y * image->width + x] & 0x00ff) << 8) | 
-                                                                          ((image->ch2[y * image->width + x] & 0xff00) >> 8));
-				data[(y * image->width * channel) + (x * channel) + 2] = (((image->ch3[y * image->width + x] & 0x00ff) << 8) | 
-                                                                          ((image->ch3[y * image->width + x] & 0xff00) >> 8));
-			} else {
-				data0[(y * image->width * channel) + (x * channel) + 0] = (u_char)image->ch1[y * image->width + x];
-				data0[(y * image->width * channel) + (x * channel) + 1] = (u_char)image->ch2[y * image->width + x];
-				data0[(y * image->width * channel) + (x * channel) + 2] = (u_char)image->ch3[y * image->width + x];
-			}
+        u_char  *dst = data + hsize + (size_t) y * pitch;
+        u_short *ch1 = image->ch1 + (size_t) y * width;
+        u_short *ch2 = image->ch2 + (size_t) y * width;
+        u_short *ch3 = image->ch3 + (size_t) y * width;
+
+        if (image->maxval > 255) {
+            for (x = 0; x < width; x++, dst += 6) {
+                dst[0] = (u_char) (ch1[x] >> 8);
+                dst[1] = (u_char) ch1[x];
+                dst[2] = (u_char) (ch2[x] >> 8);
+                dst[3] = (u_char) ch2[x];
+                dst[4] = (u_char) (ch3[x] >> 8);
+                dst[5] = (u_char) ch3[x];
+            }
+        } else {
+            for (x = 0; x < width; x++, dst += 3) {
+                dst[0] = (u_char) ch1[x];
+                dst[1] = (u_char) ch2[x];
+                dst[2] = (u_char) ch3[x];
+            }
         }
     }
-  
-   fp = fopen(filename, "wb");
-   if (!fp) { die("cannot open file for writing"); }
-   
-   fprintf(fp, "P6\n%d %d\n%d\n", image->width, image->height, image->maxval);
-   num = fwrite((void *) data, 1, (size_t) (chsize * channel), fp);
-   if (num != (chsize * channel)) { die("cannot write image data to file"); }
-   
-   fclose(fp);
-   
-   if (data) { free(data); data = 0; }
+
+    aio_write_submit(filename, data, hsize + pitch * image->height);
 }
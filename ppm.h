@@ -21,11 +21,38 @@ typedef struct ppm
     u_short *ch3;
 } ppm_t;
 
+/* largest shrink-on-load factor; keeps the box sums within 32 bits */
+#define PPM_MAX_REDUCTION 256
+
+/* a P6 file whose header has been parsed, for reading parts of its raster */
+typedef struct ppm_source
+{
+    char *filename;
+    int width;
+    int height;
+    int maxval;
+    size_t raster;      /* file offset of row 0 */
+    size_t pitch;       /* bytes per row; row y is at raster + y * pitch */
+} ppm_source_t;
+
+struct aio_req;
+
+typedef void (*ppm_hook_t)(ppm_t *image, char *filename);
+
 ppm_t* alloc_ppm_buffer(int width, int height, int maxval);
 void   free_ppm_buffer(ppm_t *image);
 void   clear_ppm_buffer(ppm_t *image, u_short red, u_short green, u_short blue);
 
+size_t read_ppm_header(u_char *data, size_t size, int *width, int *height, int *maxval);
+ppm_t* decode_ppm_image(u_char *data, size_t size);
+ppm_t* wait_ppm_image(struct aio_req *req, char *filename);
 ppm_t* read_ppm_image(char *filename);
+ppm_source_t* open_ppm_source(char *filename);
+void          close_ppm_source(ppm_source_t *source);
+ppm_t* read_ppm_region_reduced(ppm_source_t *source, int x, int y, int width, int height, int factor);
+ppm_t* read_ppm_image_reduced(char *filename, int factor, int *width, int *height);
+void   set_ppm_read_hook(ppm_hook_t hook);
+ppm_hook_t get_ppm_read_hook(void);
 void   write_ppm_image(ppm_t *image, char *filename);
 
 #ifdef __cplusplus
@@ -0,0 +1,200 @@
+/*
+ * raw.c: read sensor dumps in MIPI CSI-2 RAW10/RAW12 packing or as plain
+ * 16 bit little endian samples into a single-plane pgm_t.
+ *
+ * RAW10 stores the high 8 bits of 4 samples in 4 bytes followed by one byte
+ * holding their low 2 bits (first sample in bits 1:0); RAW12 stores the
+ * high 8 bits of 2 samples followed by one byte of low nibbles (first sample
+ * in bits 3:0). Rows may be padded to 'stride' bytes. Rows are unpacked in
+ * parallel; on x86 an SSSE3 byte shuffle spreads 8 samples at a time into
+ * 16 bit lanes, with a scalar loop for the tail and for other CPUs.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "raw.h"
+#include "aio.h"
+#include "thread.h"
+
+#if defined(__SSSE3__) || defined(__AVX__)
+#define RAW_SSSE3 1
+#define RAW_SSSE3_TARGET
+#define raw_have_ssse3() 1
+#include <tmmintrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RAW_SSSE3 1
+#define RAW_SSSE3_TARGET __attribute__((target("ssse3")))
+#define raw_have_ssse3() __builtin_cpu_supports("ssse3")
+#include <tmmintrin.h>
+#endif
+
+typedef struct raw_job
+{
+    const u_char *data;
+    size_t size;
+    int stride;
+    raw_format_t format;
+    int simd;
+    u_short mask;       /* RAW16 bits kept, (1 << depth) - 1 */
+    pgm_t *image;
+} raw_job_t;
+
+static void die(char *message)
+{
+    fprintf(stderr, "raw: %s\n", message);
+    exit(1);
+}
+
+/* bytes of one packed row without padding */
+int raw_row_bytes(int width, raw_format_t format)
+{
+    switch (format) {
+    case RAW_RAW10:
+        return (width + 3) / 4 * 5;
+    case RAW_RAW12:
+        return (width + 1) / 2 * 3;
+    default:
+        return width * 2;
+    }
+}
+
+#ifdef RAW_SSSE3
+/*
+ * 8 samples per step from 10 (RAW10) or 12 (RAW12) bytes; each step loads
+ * 16, so the caller keeps the last steps 16 bytes away from the row end.
+ * One shuffle puts the high bytes in place, a second copies the byte with
+ * the low bits into every lane, where a per-lane multiply lines the
+ * sample's bits up under a common shift.
+ */
+RAW_SSSE3_TARGET
+static int unpack_row_ssse3(const u_char *src, u_short *dst, int count, int avail, raw_format_t format)
+{
+    int step = RAW_RAW10 == format ? 10 : 12;
+    int shift = RAW_RAW10 == format ? 2 : 4;
+    __m128i hi_shuf, lo_shuf, scale, mask;
+    int x = 0;
+
+    if (RAW_RAW10 == format) {
+        hi_shuf = _mm_setr_epi8(0, -1, 1, -1, 2, -1, 3, -1, 5, -1, 6, -1, 7, -1, 8, -1);
+        lo_shuf = _mm_setr_epi8(4, -1, 4, -1, 4, -1, 4, -1, 9, -1, 9, -1, 9, -1, 9, -1);
+        scale   = _mm_setr_epi16(256, 64, 16, 4, 256, 64, 16, 4);
+        mask    = _mm_set1_epi16(3);
+    } else {
+        hi_shuf = _mm_setr_epi8(0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1);
+        lo_shuf = _mm_setr_epi8(2, -1, 2, -1, 5, -1, 5, -1, 8, -1, 8, -1, 11, -1, 11, -1);
+        scale   = _mm_setr_epi16(256, 16, 256, 16, 256, 16, 256, 16);
+        mask    = _mm_set1_epi16(15);
+    }
+
+    for (; x + 8 <= count && (x / 8) * step + 16 <= avail; x += 8) {
+        __m128i in = _mm_loadu_si128((const __m128i *) (src + (x / 8) * step));
+        __m128i hi = _mm_slli_epi16(_mm_shuffle_epi8(in, hi_shuf), shift);
+        __m128i lo = _mm_mullo_epi16(_mm_shuffle_epi8(in, lo_shuf), scale);
+
+        lo = _mm_and_si128(_mm_srli_epi16(lo, 8), mask);
+        _mm_storeu_si128((__m128i *) (dst + x), _mm_or_si128(hi, lo));
+    }
+
+    return x;
+}
+#endif
+
+static void unpack_row(const u_char *src, u_short *dst, int width, int avail, raw_format_t format, int simd,
+                       u_short mask)
+{
+    int x = 0;
+
+    switch (format) {
+    case RAW_RAW10:
+#ifdef RAW_SSSE3
+        if (simd) { x = unpack_row_ssse3(src, dst, width, avail, format); }
+#endif
+        for (; x < width; x++) {
+            const u_char *p = src + (x / 4) * 5;
+            int k = x & 3;
+
+            dst[x] = (u_short) ((p[k] << 2) | ((p[4] >> (2 * k)) & 3));
+        }
+        break;
+    case RAW_RAW12:
+#ifdef RAW_SSSE3
+        if (simd) { x = unpack_row_ssse3(src, dst, width, avail, format); }
+#endif
+        for (; x < width; x++) {
+            const u_char *p = src + (x / 2) * 3;
+            int k = x & 1;
+
+            dst[x] = (u_short) ((p[k] << 4) | ((p[2] >> (4 * k)) & 15));
+        }
+        break;
+    default:
+        for (x = 0; x < width; x++) {
+            dst[x] = (u_short) ((src[2 * x] | (src[2 * x + 1] << 8)) & mask);
+        }
+        break;
+    }
+}
+
+static void unpack_rows(void *arg, int begin, int end)
+{
+    raw_job_t *job = (raw_job_t *) arg;
+    pgm_t *image = job->image;
+    int y;
+
+    for (y = begin; y < end; y++) {
+        size_t offset = (size_t) y * job->stride;
+
+        unpack_row(job->data + offset, image->ch + (size_t) y * image->width, image->width,
+                   (int) (job->size - offset < (size_t) job->stride ? job->size - offset : (size_t) job->stride),
+                   job->format, job->simd, job->mask);
+    }
+}
+
+/*
+ * Read a raw sensor dump of width x height samples; stride is the distance
+ * between rows in bytes (0 for tightly packed rows). The image maxval is
+ * (1 << depth) - 1; depth defaults to the packing (10, 12 or 16 bits) and
+ * may only be given for RAW16 data, whose bits above it are masked off so
+ * that no sample exceeds maxval.
+ */
+pgm_t* read_raw_image(char *filename, int width, int height, int stride, raw_format_t format, int depth)
+{
+    int row = raw_row_bytes(width, format);
+    size_t size = 0;
+    u_char *data = NULL;
+    raw_job_t job;
+
+    if (width < 1 || height < 1 || width > SHRT_MAX || height > SHRT_MAX) { die("unreasonable width or height"); }
+
+    if (0 == stride) { stride = row; }
+    if (stride < row) { die("stride is shorter than a row"); }
+
+    if (depth && RAW_RAW16 != format) { die("bit depth only applies to raw16"); }
+    if (0 == depth) { depth = RAW_RAW10 == format ? 10 : (RAW_RAW12 == format ? 12 : 16); }
+    if (depth < 1 || depth > 16) { die("unreasonable bit depth"); }
+
+    data = aio_read_wait(aio_read_submit(filename), &size);
+
+    if (size < (size_t) stride * (height - 1) + row) { die("file is shorter than the image"); }
+
+    job.data   = data;
+    job.size   = size;
+    job.stride = stride;
+    job.format = format;
+    job.simd   = 0;
+    job.mask   = (u_short) ((1 << depth) - 1);
+    job.image  = alloc_pgm_buffer(width, height, (1 << depth) - 1);
+
+    if (!job.image) { die("cannot allocate memory for new image"); }
+
+#ifdef RAW_SSSE3
+    job.simd = raw_have_ssse3();
+#endif
+
+    parallel_for_bytes(height, 16, stride + (size_t) width * sizeof(u_short), unpack_rows, &job);
+
+    free(data);
+
+    return job.image;
+}
@@ -0,0 +1,33 @@
+#ifndef RAW_H
+#define RAW_H
+
+#include "pgm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum raw_format
+{
+    RAW_RAW10 = 0,      /* MIPI CSI-2: 4 samples in 5 bytes */
+    RAW_RAW12,          /* MIPI CSI-2: 2 samples in 3 bytes */
+    RAW_RAW16           /* 16 bit little endian */
+} raw_format_t;
+
+/* colour of the top left 2x2 cell of a bayer mosaic, in raster order */
+typedef enum cfa
+{
+    CFA_RGGB = 0,
+    CFA_GRBG,
+    CFA_GBRG,
+    CFA_BGGR
+} cfa_t;
+
+int    raw_row_bytes(int width, raw_format_t format);
+pgm_t* read_raw_image(char *filename, int width, int height, int stride, raw_format_t format, int depth);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RAW_H */
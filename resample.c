@@ -0,0 +1,764 @@
+/*
+ * resample.c: separable fixed-point resampling core.
+ *
+ * A resize is described by one contrib_t per axis: for every output sample
+ * the first source sample and a row of Q14 weights. Taps that would fall
+ * outside the source are folded onto the edge samples when the table is
+ * built, so the inner loops never clamp coordinates. Each output row is
+ * produced by a vertical pass over full source rows (contiguous, vectorizes)
+ * followed by a horizontal pass over that single row, and rows are spread
+ * over threads with parallel_for().
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "resample.h"
+#include "thread.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define RESAMPLE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+typedef struct resample_job
+{
+    plane_t *src;
+    plane_t *dst;
+    contrib_t *xcontrib;
+    contrib_t *ycontrib;
+    int maxval;
+    const linear_lut_t *lut;    /* decode on load, encode on store, or NULL */
+} resample_job_t;
+
+typedef struct exact_job
+{
+    plane_t *src;
+    plane_t *dst;
+    int factor;
+    int maxval;
+} exact_job_t;
+
+/*
+ * Catmull-Rom taps in 1/128 units for the phases of an exact 2x and 4x
+ * enlargement. Output sample x maps to source position x / factor - 0.5,
+ * like bicubic() in main.c, so phase m of factor f starts at source sample
+ * x / f + offset.
+ */
+typedef struct phase
+{
+    int offset;
+    int w[4];
+} phase_t;
+
+static const phase_t enlarge2_phase[2] = {
+    { -2, {  -8,  72,  72,  -8 } },     /* t = 0.5  */
+    { -1, {   0, 128,   0,   0 } }      /* t = 0    */
+};
+
+static const phase_t enlarge4_phase[4] = {
+    { -2, {  -8,  72,  72,  -8 } },     /* t = 0.5  */
+    { -2, {  -3,  29, 111,  -9 } },     /* t = 0.75 */
+    { -1, {   0, 128,   0,   0 } },     /* t = 0    */
+    { -1, {  -9, 111,  29,  -3 } }      /* t = 0.25 */
+};
+
+static void die(char *message)
+{
+    fprintf(stderr, "resample: %s\n", message);
+    exit(1);
+}
+
+plane_t ppm_plane(ppm_t *image, int chan)
+{
+    plane_t plane;
+
+    plane.data   = (chan == 0 ? image->ch1 : (chan == 1 ? image->ch2 : image->ch3));
+    plane.width  = image->width;
+    plane.height = image->height;
+    plane.stride = image->width;
+
+    return plane;
+}
+
+contrib_t* alloc_contrib(int size, int taps)
+{
+    contrib_t *contrib = (contrib_t *) malloc(sizeof(contrib_t));
+
+    if (!contrib) { die("cannot allocate memory for filter table"); }
+
+    contrib->size  = size;
+    contrib->taps  = taps;
+    contrib->start = (int *) calloc(size, sizeof(int));
+    contrib->coef  = (short *) calloc((size_t) size * taps, sizeof(short));
+
+    if (!contrib->start || !contrib->coef) { die("cannot allocate memory for filter table"); }
+
+    return contrib;
+}
+
+void free_contrib(contrib_t *contrib)
+{
+    if (!contrib) { return; }
+
+    free(contrib->start);
+    free(contrib->coef);
+    free(contrib);
+}
+
+/*
+ * Store the n weights of output sample i, which apply to source samples
+ * first .. first + n - 1. Out-of-range samples are folded onto the edges and
+ * the row is renormalized to exactly RESAMPLE_ONE.
+ */
+static void set_contrib(contrib_t *contrib, int i, int first, const int *weight, int n, int src_size)
+{
+    short *row = contrib->coef + (size_t) i * contrib->taps;
+    int lo = first < 0 ? 0 : (first > src_size - 1 ? src_size - 1 : first);
+    int start = lo, k, idx, sum = 0, big = 0;
+
+    if (start + contrib->taps > src_size) { start = src_size - contrib->taps; }
+    if (start < 0) { start = 0; }
+
+    memset(row, 0, contrib->taps * sizeof(short));
+
+    for (k = 0; k < n; k++) {
+        idx = first + k;
+        idx = idx < 0 ? 0 : (idx > src_size - 1 ? src_size - 1 : idx);
+        row[idx - start] += (short) weight[k];
+    }
+
+    for (k = 0; k < contrib->taps; k++) {
+        sum += row[k];
+        if (row[k] > row[big]) { big = k; }
+    }
+    row[big] += (short) (RESAMPLE_ONE - sum);
+
+    contrib->start[i] = start;
+}
+
+/*
+ * Box/area weights for a reduction from src_size to dst_size samples: each
+ * output sample averages the source interval it covers, with partially
+ * covered samples weighted by their overlap. The support grows with the
+ * reduction factor and the weights are exact rationals rounded once to Q14.
+ */
+contrib_t* area_contrib(int src_size, int dst_size)
+{
+    return area_contrib_reduced(src_size, 1, dst_size);
+}
+
+/*
+ * Area weights over a source already box-reduced by 'factor' from full_size
+ * samples, as produced by shrink-on-load: sample j stands for the full-size
+ * interval [j * factor, min((j + 1) * factor, full_size)), so a partial box
+ * at the edge gets only the weight of the samples it covers.
+ */
+contrib_t* area_contrib_reduced(int full_size, int factor, int dst_size)
+{
+    int src_size = (full_size + factor - 1) / factor;
+    contrib_t *contrib;
+    int *weight;
+    int taps, i, j;
+
+    taps = (full_size + dst_size - 1) / dst_size / factor + 2;
+    if (taps > src_size) { taps = src_size; }
+
+    contrib = alloc_contrib(dst_size, taps);
+    weight  = (int *) malloc((taps + 1) * sizeof(int));
+    if (!weight) { die("cannot allocate memory for filter table"); }
+
+    for (i = 0; i < dst_size; i++) {
+        /* work in units of 1 / dst_size full-size samples */
+        long long lo = (long long) i * full_size;
+        long long hi = (long long) (i + 1) * full_size;
+        int first = (int) (lo / dst_size / factor);
+        int last  = (int) ((hi - 1) / dst_size / factor);
+
+        for (j = first; j <= last; j++) {
+            long long a = (long long) j * factor * dst_size;
+            long long b = (long long) (j + 1) * factor * dst_size;
+
+            if (a < lo) { a = lo; }
+            if (b > hi) { b = hi; }
+
+            weight[j - first] = (int) (((b - a) * RESAMPLE_ONE + full_size / 2) / full_size);
+        }
+
+        set_contrib(contrib, i, first, weight, last - first + 1, src_size);
+    }
+
+    free(weight);
+
+    return contrib;
+}
+
+static void resample_rows(void *arg, int begin, int end)
+{
+    resample_job_t *job = (resample_job_t *) arg;
+    plane_t *src = job->src, *dst = job->dst;
+    contrib_t *xc = job->xcontrib, *yc = job->ycontrib;
+    const u_short *decode = job->lut ? job->lut->to_linear : NULL;
+    const u_short *encode = job->lut ? job->lut->to_encoded : NULL;
+    int sw = src->width, maxval = encode ? USHRT_MAX : job->maxval;
+    int *acc = (int *) malloc(sw * sizeof(int));
+    int u, v, x, k;
+
+    if (!acc) { die("cannot allocate memory for scratch row"); }
+
+    for (v = begin; v < end; v++) {
+        const short *wy = yc->coef + (size_t) v * yc->taps;
+        const u_short *s = src->data + (size_t) yc->start[v] * src->stride;
+        u_short *d = dst->data + (size_t) v * dst->stride;
+
+        /* vertical pass: one row of source width, linearized as it is loaded */
+        if (decode) {
+            for (x = 0; x < sw; x++) {
+                acc[x] = wy[0] * decode[s[x]];
+            }
+        } else {
+            for (x = 0; x < sw; x++) {
+                acc[x] = wy[0] * s[x];
+            }
+        }
+        for (k = 1; k < yc->taps; k++) {
+            int w = wy[k];
+
+            s += src->stride;
+            if (0 == w) { continue; }
+
+            if (decode) {
+                for (x = 0; x < sw; x++) {
+                    acc[x] += w * decode[s[x]];
+                }
+            } else {
+                for (x = 0; x < sw; x++) {
+                    acc[x] += w * s[x];
+                }
+            }
+        }
+        for (x = 0; x < sw; x++) {
+            acc[x] = (acc[x] + RESAMPLE_ONE / 2) >> RESAMPLE_BITS;
+        }
+
+        /* horizontal pass */
+        for (u = 0; u < dst->width; u++) {
+            const short *wx = xc->coef + (size_t) u * xc->taps;
+            const int *a = acc + xc->start[u];
+            int sum = RESAMPLE_ONE / 2;
+
+            for (k = 0; k < xc->taps; k++) {
+                sum += wx[k] * a[k];
+            }
+            sum >>= RESAMPLE_BITS;
+            sum = sum < 0 ? 0 : (sum > maxval ? maxval : sum);
+
+            d[u] = encode ? encode[sum] : (u_short) sum;
+        }
+    }
+
+    free(acc);
+}
+
+static void run_resample(plane_t *src, plane_t *dst, contrib_t *xcontrib, contrib_t *ycontrib, int maxval,
+                         const linear_lut_t *lut)
+{
+    resample_job_t job;
+
+    job.src      = src;
+    job.dst      = dst;
+    job.xcontrib = xcontrib;
+    job.ycontrib = ycontrib;
+    job.maxval   = maxval;
+    job.lut      = lut;
+
+    /* each output row's share of the source plane, plus the row itself */
+    parallel_for_bytes(dst->height, 8, ((size_t) src->width * src->height / dst->height + dst->width) * sizeof(u_short),
+                       resample_rows, &job);
+}
+
+/* resample src into dst using the given per-axis tables */
+void resample_plane(plane_t *src, plane_t *dst, contrib_t *xcontrib, contrib_t *ycontrib, int maxval)
+{
+    run_resample(src, dst, xcontrib, ycontrib, maxval, NULL);
+}
+
+/*
+ * As resample_plane(), but in linear light: samples are decoded through
+ * lut->to_linear as they are loaded, filtered as 16 bit linear values and
+ * encoded through lut->to_encoded as they are stored.
+ */
+void resample_plane_linear(plane_t *src, plane_t *dst, contrib_t *xcontrib, contrib_t *ycontrib,
+                           const linear_lut_t *lut)
+{
+    run_resample(src, dst, xcontrib, ycontrib, lut->maxval, lut);
+}
+
+/* sRGB transfer function on samples normalized to 0.0 - 1.0 */
+double srgb_to_linear(double v)
+{
+    return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+double linear_to_srgb(double v)
+{
+    return v <= 0.0031308 ? 12.92 * v : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+}
+
+/* sRGB transfer tables for samples of 0 .. maxval */
+linear_lut_t* alloc_linear_lut(int maxval)
+{
+    linear_lut_t *lut = (linear_lut_t *) malloc(sizeof(linear_lut_t));
+    int i;
+
+    if (!lut) { die("cannot allocate memory for transfer table"); }
+
+    lut->maxval     = maxval;
+    lut->to_linear  = (u_short *) malloc((USHRT_MAX + 1) * sizeof(u_short));
+    lut->to_encoded = (u_short *) malloc((USHRT_MAX + 1) * sizeof(u_short));
+
+    if (!lut->to_linear || !lut->to_encoded) { die("cannot allocate memory for transfer table"); }
+
+    /* samples above maxval, legal in 16 bit files, saturate */
+    for (i = 0; i <= USHRT_MAX; i++) {
+        lut->to_linear[i] = i < maxval ? (u_short) floor(srgb_to_linear((double) i / maxval) * USHRT_MAX + 0.5)
+                                       : USHRT_MAX;
+    }
+
+    for (i = 0; i <= USHRT_MAX; i++) {
+        lut->to_encoded[i] = (u_short) floor(linear_to_srgb((double) i / USHRT_MAX) * maxval + 0.5);
+    }
+
+    return lut;
+}
+
+void free_linear_lut(linear_lut_t *lut)
+{
+    if (!lut) { return; }
+
+    free(lut->to_linear);
+    free(lut->to_encoded);
+    free(lut);
+}
+
+/* anti-aliased reduction of src to the size of dst by area averaging */
+void area_downscale_image(ppm_t *src, ppm_t *dst)
+{
+    area_downscale_reduced(src, dst, src->width, src->height, 1);
+}
+
+/*
+ * Area reduction of a shrink-on-load image, src being the width x height
+ * original box-reduced by 'factor'.
+ */
+void area_downscale_reduced(ppm_t *src, ppm_t *dst, int width, int height, int factor)
+{
+    contrib_t *xcontrib = area_contrib_reduced(width, factor, dst->width);
+    contrib_t *ycontrib = area_contrib_reduced(height, factor, dst->height);
+    int chan;
+
+    for (chan = 0; chan < 3; chan++) {
+        plane_t s = ppm_plane(src, chan);
+        plane_t d = ppm_plane(dst, chan);
+
+        resample_plane(&s, &d, xcontrib, ycontrib, src->maxval);
+    }
+
+    free_contrib(xcontrib);
+    free_contrib(ycontrib);
+}
+
+/* round num / den to the nearest integer, halves away from zero */
+static int div_round(long long num, long long den)
+{
+    return (int) (num >= 0 ? (num + den / 2) / den : -((-num + den / 2) / den));
+}
+
+/*
+ * Q14 taps of one filter phase t = phase / RESAMPLE_PHASES. The Catmull-Rom
+ * polynomials are evaluated on the integer phase with a common denominator,
+ * so the table is identical on every host and compiler.
+ */
+static int kernel_taps(resample_filter_t filter, int phase, int *w)
+{
+    long long p = phase, n = RESAMPLE_PHASES, den = 2 * n * n * n;
+
+    if (FILTER_BILINEAR == filter) {
+        w[0] = (RESAMPLE_PHASES - phase) << (RESAMPLE_BITS - RESAMPLE_PHASE_BITS);
+        w[1] = phase << (RESAMPLE_BITS - RESAMPLE_PHASE_BITS);
+        return 2;
+    }
+
+    w[0] = div_round((-p * p * p + 2 * n * p * p - n * n * p) * RESAMPLE_ONE, den);
+    w[1] = div_round((3 * p * p * p - 5 * n * p * p + 2 * n * n * n) * RESAMPLE_ONE, den);
+    w[2] = div_round((-3 * p * p * p + 4 * n * p * p + n * n * p) * RESAMPLE_ONE, den);
+    w[3] = div_round((p * p * p - n * p * p) * RESAMPLE_ONE, den);
+
+    return 4;
+}
+
+/* Mitchell-Netravali cubic, B = C = 1/3 */
+static double mitchell(double x)
+{
+    x = fabs(x);
+
+    if (x < 1.0) { return (7.0 * x * x * x - 12.0 * x * x + 16.0 / 3.0) / 6.0; }
+    if (x < 2.0) { return (-7.0 / 3.0 * x * x * x + 12.0 * x * x - 20.0 * x + 32.0 / 3.0) / 6.0; }
+
+    return 0.0;
+}
+
+static double lanczos3(double x)
+{
+    const double pi = 3.14159265358979323846;
+
+    x = fabs(x);
+
+    if (x < 1e-9) { return 1.0; }
+    if (x >= 3.0) { return 0.0; }
+
+    return 3.0 * sin(pi * x) * sin(pi * x / 3.0) / (pi * pi * x * x);
+}
+
+/*
+ * Q14 taps of one phase t (0 <= t < 1) of a windowed filter stretched by
+ * fscale. Tap k sits at distance k - (taps / 2 - 1) - t from the sample
+ * position; the taps are normalized so they sum to RESAMPLE_ONE.
+ */
+static void window_taps(resample_filter_t filter, double t, double fscale, int taps, int *w)
+{
+    double *f = (double *) malloc(taps * sizeof(double));
+    double sum = 0.0;
+    int k;
+
+    if (!f) { die("cannot allocate memory for filter table"); }
+
+    for (k = 0; k < taps; k++) {
+        double d = (k - (taps / 2 - 1) - t) / fscale;
+
+        f[k] = FILTER_LANCZOS3 == filter ? lanczos3(d) : mitchell(d);
+        sum += f[k];
+    }
+
+    for (k = 0; k < taps; k++) {
+        w[k] = (int) floor(f[k] / sum * RESAMPLE_ONE + 0.5);
+    }
+
+    free(f);
+}
+
+/*
+ * Taps of a kernel resize, from a bank of RESAMPLE_PHASES precomputed phases
+ * built once per scale factor. Bilinear and bicubic read source position
+ * x / scale - 0.5, like bicubic() in main.c, with a fixed 2 or 4 tap support.
+ * Lanczos-3 and Mitchell read the pixel-center aligned position
+ * (x + 0.5) / scale - 0.5 and widen their support by 1 / scale when
+ * reducing, so they also band-limit. Positions are computed in 16.16 fixed
+ * point and rounded to the nearest phase.
+ */
+contrib_t* kernel_contrib(int src_size, int dst_size, float scale, resample_filter_t filter)
+{
+    long long step = (long long) (65536.0 / scale + 0.5);
+    long long offset = -32768;
+    double fscale = scale < 1.f ? 1.0 / scale : 1.0;
+    contrib_t *contrib;
+    int *bank;
+    int taps, i;
+
+    if (FILTER_BICUBIC == filter || FILTER_BILINEAR == filter) {
+        taps = FILTER_BILINEAR == filter ? 2 : 4;
+    } else {
+        double radius = FILTER_LANCZOS3 == filter ? 3.0 : 2.0;
+
+        taps    = 2 * (int) ceil(radius * fscale - 1e-6);
+        offset += step / 2;
+    }
+
+    bank = (int *) malloc((size_t) RESAMPLE_PHASES * taps * sizeof(int));
+    if (!bank) { die("cannot allocate memory for filter table"); }
+
+    for (i = 0; i < RESAMPLE_PHASES; i++) {
+        if (FILTER_BICUBIC == filter || FILTER_BILINEAR == filter) {
+            kernel_taps(filter, i, bank + i * taps);
+        } else {
+            window_taps(filter, (double) i / RESAMPLE_PHASES, fscale, taps, bank + i * taps);
+        }
+    }
+
+    contrib = alloc_contrib(dst_size, taps < src_size ? taps : src_size);
+
+    for (i = 0; i < dst_size; i++) {
+        long long pos = i * step + offset;
+        int base  = (int) ((pos + 65536) >> 16) - 1;
+        int phase = (int) (((pos - (long long) base * 65536) + (1 << (15 - RESAMPLE_PHASE_BITS)))
+                           >> (16 - RESAMPLE_PHASE_BITS));
+
+        if (RESAMPLE_PHASES == phase) {
+            base++;
+            phase = 0;
+        }
+
+        set_contrib(contrib, i, base - (taps / 2 - 1), bank + phase * taps, taps, src_size);
+    }
+
+    free(bank);
+
+    return contrib;
+}
+
+/* fixed-point polyphase resize of src to the size of dst */
+void kernel_scale_image(ppm_t *src, ppm_t *dst, float scale, resample_filter_t filter)
+{
+    contrib_t *xcontrib = kernel_contrib(src->width, dst->width, scale, filter);
+    contrib_t *ycontrib = kernel_contrib(src->height, dst->height, scale, filter);
+    int chan;
+
+    for (chan = 0; chan < 3; chan++) {
+        plane_t s = ppm_plane(src, chan);
+        plane_t d = ppm_plane(dst, chan);
+
+        resample_plane(&s, &d, xcontrib, ycontrib, src->maxval);
+    }
+
+    free_contrib(xcontrib);
+    free_contrib(ycontrib);
+}
+
+/*
+ * Resize in linear light: area averaging below 1.0 and bicubic above, or
+ * the given polyphase filter, on sRGB samples linearized through a table.
+ */
+void linear_scale_image(ppm_t *src, ppm_t *dst, float scale, resample_filter_t filter)
+{
+    linear_lut_t *lut = alloc_linear_lut(src->maxval);
+    contrib_t *xcontrib, *ycontrib;
+    int chan;
+
+    if (FILTER_AUTO == filter || FILTER_FLOAT == filter) {
+        if (scale < 1.f) {
+            xcontrib = area_contrib(src->width, dst->width);
+            ycontrib = area_contrib(src->height, dst->height);
+        } else {
+            xcontrib = kernel_contrib(src->width, dst->width, scale, FILTER_BICUBIC);
+            ycontrib = kernel_contrib(src->height, dst->height, scale, FILTER_BICUBIC);
+        }
+    } else {
+        xcontrib = kernel_contrib(src->width, dst->width, scale, filter);
+        ycontrib = kernel_contrib(src->height, dst->height, scale, filter);
+    }
+
+    for (chan = 0; chan < 3; chan++) {
+        plane_t s = ppm_plane(src, chan);
+        plane_t d = ppm_plane(dst, chan);
+
+        resample_plane_linear(&s, &d, xcontrib, ycontrib, lut);
+    }
+
+    free_contrib(xcontrib);
+    free_contrib(ycontrib);
+    free_linear_lut(lut);
+}
+
+/* 2:1 box average of the row pair a, b into dw samples; an odd last column pairs with itself */
+static void reduce2_row(const u_short *a, const u_short *b, u_short *d, int sw, int dw)
+{
+    int x = 0;
+
+#ifdef RESAMPLE_SSE2
+    /*
+     * Bias the samples to signed range so _mm_madd_epi16 can add the
+     * horizontal pairs into 32 bits; the bias cancels after the shift and the
+     * result is packed with signed saturation and biased back.
+     */
+    const __m128i bias = _mm_set1_epi16((short) 0x8000);
+    const __m128i one  = _mm_set1_epi16(1);
+    const __m128i two  = _mm_set1_epi32(2);
+
+    for (; x + 8 <= sw / 2; x += 8) {
+        __m128i a0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (a + 2 * x)), bias);
+        __m128i a1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (a + 2 * x + 8)), bias);
+        __m128i b0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (b + 2 * x)), bias);
+        __m128i b1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (b + 2 * x + 8)), bias);
+        __m128i s0 = _mm_add_epi32(_mm_madd_epi16(a0, one), _mm_madd_epi16(b0, one));
+        __m128i s1 = _mm_add_epi32(_mm_madd_epi16(a1, one), _mm_madd_epi16(b1, one));
+
+        s0 = _mm_srai_epi32(_mm_add_epi32(s0, two), 2);
+        s1 = _mm_srai_epi32(_mm_add_epi32(s1, two), 2);
+
+        _mm_storeu_si128((__m128i *) (d + x), _mm_xor_si128(_mm_packs_epi32(s0, s1), bias));
+    }
+#endif
+
+    for (; x < sw / 2; x++) {
+        d[x] = (u_short) ((a[2 * x] + a[2 * x + 1] + b[2 * x] + b[2 * x + 1] + 2) >> 2);
+    }
+
+    if (dw > sw / 2) {
+        d[dw - 1] = (u_short) ((a[sw - 1] + b[sw - 1] + 1) >> 1);
+    }
+}
+
+static void reduce2_rows(void *arg, int begin, int end)
+{
+    exact_job_t *job = (exact_job_t *) arg;
+    plane_t *src = job->src, *dst = job->dst;
+    int v;
+
+    for (v = begin; v < end; v++) {
+        const u_short *a = src->data + (size_t) (2 * v) * src->stride;
+        const u_short *b = 2 * v + 1 < src->height ? a + src->stride : a;
+
+        reduce2_row(a, b, dst->data + (size_t) v * dst->stride, src->width, dst->width);
+    }
+}
+
+/* 2:1 reduction; dst must be ((width + 1) / 2, (height + 1) / 2) */
+void reduce2_plane(plane_t *src, plane_t *dst)
+{
+    exact_job_t job;
+
+    job.src = src;
+    job.dst = dst;
+
+    parallel_for_bytes(dst->height, 16, (size_t) (2 * src->width + dst->width) * sizeof(u_short), reduce2_rows, &job);
+}
+
+static void reduce4_rows(void *arg, int begin, int end)
+{
+    exact_job_t *job = (exact_job_t *) arg;
+    plane_t *src = job->src, *dst = job->dst;
+    int sw = src->width;
+    unsigned *acc = (unsigned *) malloc(sw * sizeof(unsigned));
+    int u, v, x, k;
+
+    if (!acc) { die("cannot allocate memory for scratch row"); }
+
+    for (v = begin; v < end; v++) {
+        const u_short *s = src->data + (size_t) (4 * v) * src->stride;
+        u_short *d = dst->data + (size_t) v * dst->stride;
+
+        for (x = 0; x < sw; x++) {
+            acc[x] = s[x];
+        }
+        for (k = 1; k < 4; k++) {
+            s += src->stride;
+            for (x = 0; x < sw; x++) {
+                acc[x] += s[x];
+            }
+        }
+
+        for (u = 0; u < dst->width; u++) {
+            const unsigned *a = acc + 4 * u;
+            d[u] = (u_short) ((a[0] + a[1] + a[2] + a[3] + 8) >> 4);
+        }
+    }
+
+    free(acc);
+}
+
+/* 4:1 box reduction; src dimensions must be exactly four times dst */
+void reduce4_plane(plane_t *src, plane_t *dst)
+{
+    exact_job_t job;
+
+    job.src = src;
+    job.dst = dst;
+
+    parallel_for_bytes(dst->height, 8, (size_t) (4 * src->width + dst->width) * sizeof(u_short), reduce4_rows, &job);
+}
+
+static void enlarge_rows(void *arg, int begin, int end)
+{
+    exact_job_t *job = (exact_job_t *) arg;
+    plane_t *src = job->src, *dst = job->dst;
+    const phase_t *phase = 2 == job->factor ? enlarge2_phase : enlarge4_phase;
+    int f = job->factor, sw = src->width, sh = src->height, maxval = job->maxval;
+    int *buf = (int *) malloc((sw + 4) * sizeof(int));
+    int *acc = buf + 2;         /* two samples of padding left, two right */
+    int v, x, k, m, row;
+
+    if (!buf) { die("cannot allocate memory for scratch row"); }
+
+    for (v = begin; v < end; v++) {
+        const phase_t *pv = &phase[v % f];
+        u_short *d = dst->data + (size_t) v * dst->stride;
+
+        /* vertical pass, rows clamped to the image */
+        for (x = 0; x < sw; x++) {
+            acc[x] = 0;
+        }
+        for (k = 0; k < 4; k++) {
+            int w = pv->w[k];
+            const u_short *s;
+
+            if (0 == w) { continue; }
+
+            row = v / f + pv->offset + k;
+            row = row < 0 ? 0 : (row > sh - 1 ? sh - 1 : row);
+            s = src->data + (size_t) row * src->stride;
+
+            for (x = 0; x < sw; x++) {
+                acc[x] += w * s[x];
+            }
+        }
+
+        acc[-2] = acc[-1] = acc[0];
+        acc[sw] = acc[sw + 1] = acc[sw - 1];
+
+        /* horizontal pass, one source sample produces f outputs */
+        for (x = 0; x < sw; x++) {
+            for (m = 0; m < f; m++) {
+                const phase_t *ph = &phase[m];
+                const int *a = acc + x + ph->offset;
+                int sum = ph->w[0] * a[0] + ph->w[1] * a[1] + ph->w[2] * a[2] + ph->w[3] * a[3];
+
+                sum = (sum + RESAMPLE_ONE / 2) >> RESAMPLE_BITS;
+                d[x * f + m] = (u_short) (sum < 0 ? 0 : (sum > maxval ? maxval : sum));
+            }
+        }
+    }
+
+    free(buf);
+}
+
+/* exact 2x or 4x Catmull-Rom enlargement with fixed integer taps */
+void enlarge_plane(plane_t *src, plane_t *dst, int factor, int maxval)
+{
+    exact_job_t job;
+
+    job.src    = src;
+    job.dst    = dst;
+    job.factor = factor;
+    job.maxval = maxval;
+
+    parallel_for_bytes(dst->height, 8, ((size_t) src->width * src->height / dst->height + dst->width) * sizeof(u_short),
+                       enlarge_rows, &job);
+}
+
+/*
+ * Resample with a fixed-ratio kernel when scale is exactly 2, 4, 0.5 or 0.25
+ * and the sizes match the ratio; returns 0 when no fast path applies.
+ */
+int exact_scale_image(ppm_t *src, ppm_t *dst, float scale)
+{
+    int chan;
+
+    for (chan = 0; chan < 3; chan++) {
+        plane_t s = ppm_plane(src, chan);
+        plane_t d = ppm_plane(dst, chan);
+
+        if ((2.f == scale || 4.f == scale) &&
+            d.width == s.width * (int) scale && d.height == s.height * (int) scale) {
+            enlarge_plane(&s, &d, (int) scale, src->maxval);
+        } else if (0.5f == scale && s.width == 2 * d.width && s.height == 2 * d.height) {
+            reduce2_plane(&s, &d);
+        } else if (0.25f == scale && s.width == 4 * d.width && s.height == 4 * d.height) {
+            reduce4_plane(&s, &d);
+        } else {
+            return 0;
+        }
+    }
+
+    return 1;
+}
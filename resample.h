@@ -0,0 +1,82 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include "ppm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RESAMPLE_BITS   14
+#define RESAMPLE_ONE    (1 << RESAMPLE_BITS)
+
+#define RESAMPLE_PHASE_BITS 8
+#define RESAMPLE_PHASES     (1 << RESAMPLE_PHASE_BITS)
+
+typedef enum resample_filter
+{
+    FILTER_AUTO = 0,        /* exact-ratio kernels, area reduction, float bicubic */
+    FILTER_FLOAT,           /* float Catmull-Rom, bicubic() in main.c */
+    FILTER_BICUBIC,         /* fixed-point Catmull-Rom */
+    FILTER_BILINEAR,        /* fixed-point bilinear */
+    FILTER_LANCZOS3,        /* Lanczos-3, widened when reducing */
+    FILTER_MITCHELL         /* Mitchell-Netravali, widened when reducing */
+} resample_filter_t;
+
+/* one channel of an image; stride is in samples */
+typedef struct plane
+{
+    u_short *data;
+    int width;
+    int height;
+    int stride;
+} plane_t;
+
+/* per-output-sample filter taps along one axis, Q14 fixed point */
+typedef struct contrib
+{
+    int size;           /* number of output samples */
+    int taps;           /* coefficients per output sample */
+    int *start;         /* first source sample of each output sample */
+    short *coef;        /* size * taps weights, each row sums to RESAMPLE_ONE */
+} contrib_t;
+
+/* sRGB <-> 16 bit linear light transfer tables */
+typedef struct linear_lut
+{
+    int maxval;
+    u_short *to_linear;     /* sample (0 .. maxval) to linear 0 .. 65535 */
+    u_short *to_encoded;    /* linear 0 .. 65535 to sample */
+} linear_lut_t;
+
+plane_t ppm_plane(ppm_t *image, int chan);
+
+contrib_t* alloc_contrib(int size, int taps);
+void       free_contrib(contrib_t *contrib);
+contrib_t* area_contrib(int src_size, int dst_size);
+contrib_t* area_contrib_reduced(int full_size, int factor, int dst_size);
+contrib_t* kernel_contrib(int src_size, int dst_size, float scale, resample_filter_t filter);
+
+double        srgb_to_linear(double v);
+double        linear_to_srgb(double v);
+linear_lut_t* alloc_linear_lut(int maxval);
+void          free_linear_lut(linear_lut_t *lut);
+
+void resample_plane(plane_t *src, plane_t *dst, contrib_t *xcontrib, contrib_t *ycontrib, int maxval);
+void resample_plane_linear(plane_t *src, plane_t *dst, contrib_t *xcontrib, contrib_t *ycontrib,
+                           const linear_lut_t *lut);
+void area_downscale_image(ppm_t *src, ppm_t *dst);
+void area_downscale_reduced(ppm_t *src, ppm_t *dst, int width, int height, int factor);
+void kernel_scale_image(ppm_t *src, ppm_t *dst, float scale, resample_filter_t filter);
+void linear_scale_image(ppm_t *src, ppm_t *dst, float scale, resample_filter_t filter);
+
+void reduce2_plane(plane_t *src, plane_t *dst);
+void reduce4_plane(plane_t *src, plane_t *dst);
+void enlarge_plane(plane_t *src, plane_t *dst, int factor, int maxval);
+int  exact_scale_image(ppm_t *src, ppm_t *dst, float scale);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RESAMPLE_H */
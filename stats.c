@@ -0,0 +1,212 @@
+/*
+ * stats.c: per-channel histogram, min/max/mean/stddev and saturation count.
+ *
+ * The planes are swept once: every strip of rows fills private histograms
+ * that are merged under a lock at the end of the strip, so the hot loop has
+ * no shared writes. All other figures are derived exactly from the merged
+ * histogram, which costs one pass over the bins instead of the pixels.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+#include "stats.h"
+#include "thread.h"
+
+typedef struct stats_job
+{
+    u_short **planes;
+    int width;
+    image_stats_t *stats;
+    mutex_t lock;
+} stats_job_t;
+
+static FILE *side_fp = NULL;
+
+static void die(char *message)
+{
+    fprintf(stderr, "stats: %s\n", message);
+    exit(1);
+}
+
+static void stats_rows(void *arg, int begin, int end)
+{
+    stats_job_t *job = (stats_job_t *) arg;
+    image_stats_t *stats = job->stats;
+    int bins = stats->bins, width = job->width;
+    unsigned *hist = (unsigned *) calloc((size_t) stats->channels * bins, sizeof(unsigned));
+    int c, i, x, y;
+
+    if (!hist) { die("cannot allocate memory for histogram"); }
+
+    for (c = 0; c < stats->channels; c++) {
+        unsigned *h = hist + (size_t) c * bins;
+
+        for (y = begin; y < end; y++) {
+            const u_short *row = job->planes[c] + (size_t) y * width;
+
+            for (x = 0; x < width; x++) {
+                h[row[x]]++;
+            }
+        }
+    }
+
+    mutex_lock(&job->lock);
+    for (c = 0; c < stats->channels; c++) {
+        unsigned long long *total = stats->chan[c].hist;
+        unsigned *h = hist + (size_t) c * bins;
+
+        for (i = 0; i < bins; i++) {
+            total[i] += h[i];
+        }
+    }
+    mutex_unlock(&job->lock);
+
+    free(hist);
+}
+
+image_stats_t* compute_stats(u_short **planes, int channels, int width, int height, int maxval)
+{
+    image_stats_t *stats = (image_stats_t *) calloc(1, sizeof(image_stats_t));
+    unsigned long long count = (unsigned long long) width * height;
+    stats_job_t job;
+    int c, i;
+
+    if (!stats) { die("cannot allocate memory for statistics"); }
+
+    stats->width    = width;
+    stats->height   = height;
+    stats->maxval   = maxval;
+    stats->channels = channels;
+    /* 16 bit files may hold samples above maxval, keep a bin for each */
+    stats->bins     = maxval > 255 ? USHRT_MAX + 1 : 256;
+
+    for (c = 0; c < channels; c++) {
+        stats->chan[c].hist = (unsigned long long *) calloc(stats->bins, sizeof(unsigned long long));
+        if (!stats->chan[c].hist) { die("cannot allocate memory for histogram"); }
+    }
+
+    job.planes = planes;
+    job.width  = width;
+    job.stats  = stats;
+    mutex_init(&job.lock);
+
+    parallel_for_bytes(height, 16, (size_t) width * channels * sizeof(u_short), stats_rows, &job);
+
+    mutex_destroy(&job.lock);
+
+    for (c = 0; c < channels; c++) {
+        chan_stats_t *ch = &stats->chan[c];
+        unsigned long long sum = 0, sumsq = 0;
+        double var;
+
+        ch->min = -1;
+        for (i = 0; i < stats->bins; i++) {
+            unsigned long long n = ch->hist[i];
+
+            if (0 == n) { continue; }
+            if (ch->min < 0) { ch->min = i; }
+            ch->max = i;
+
+            sum   += n * i;
+            sumsq += n * i * i;
+            if (i >= maxval) { ch->saturated += n; }
+        }
+
+        ch->mean   = (double) sum / (double) count;
+        var        = ((double) sumsq - (double) sum * ch->mean) / (double) count;
+        ch->stddev = var > 0.0 ? sqrt(var) : 0.0;
+    }
+
+    return stats;
+}
+
+image_stats_t* ppm_stats(ppm_t *image)
+{
+    u_short *planes[3];
+
+    planes[0] = image->ch1;
+    planes[1] = image->ch2;
+    planes[2] = image->ch3;
+
+    return compute_stats(planes, 3, image->width, image->height, image->maxval);
+}
+
+image_stats_t* pgm_stats(pgm_t *image)
+{
+    return compute_stats(&image->ch, 1, image->width, image->height, image->maxval);
+}
+
+void free_stats(image_stats_t *stats)
+{
+    int c;
+
+    if (!stats) { return; }
+
+    for (c = 0; c < stats->channels; c++) {
+        free(stats->chan[c].hist);
+    }
+
+    free(stats);
+}
+
+void print_stats(FILE *fp, char *name, image_stats_t *stats)
+{
+    int c;
+
+    fprintf(fp, "image '%s' %dx%d maxval %d\n", name, stats->width, stats->height, stats->maxval);
+
+    for (c = 0; c < stats->channels; c++) {
+        chan_stats_t *ch = &stats->chan[c];
+
+        fprintf(fp, "  channel %d: min %d max %d mean %.4f stddev %.4f saturated %llu\n",
+                c, ch->min, ch->max, ch->mean, ch->stddev, ch->saturated);
+    }
+}
+
+/* one line per non-empty bin: value count [count count] */
+void print_histogram(FILE *fp, image_stats_t *stats)
+{
+    int c, i;
+
+    for (i = 0; i < stats->bins; i++) {
+        unsigned long long n = 0;
+
+        for (c = 0; c < stats->channels; c++) {
+            n |= stats->chan[c].hist[i];
+        }
+        if (0 == n) { continue; }
+
+        fprintf(fp, "%d", i);
+        for (c = 0; c < stats->channels; c++) {
+            fprintf(fp, " %llu", stats->chan[c].hist[i]);
+        }
+        fprintf(fp, "\n");
+    }
+}
+
+static void ppm_side_stats(ppm_t *image, char *filename)
+{
+    image_stats_t *stats = ppm_stats(image);
+
+    print_stats(side_fp, filename, stats);
+    print_histogram(side_fp, stats);
+    free_stats(stats);
+}
+
+static void pgm_side_stats(pgm_t *image, char *filename)
+{
+    image_stats_t *stats = pgm_stats(image);
+
+    print_stats(side_fp, filename, stats);
+    print_histogram(side_fp, stats);
+    free_stats(stats);
+}
+
+/* report statistics and histogram of every image read from now on to fp */
+void stats_side_output(FILE *fp)
+{
+    side_fp = fp;
+
+    set_ppm_read_hook(fp ? ppm_side_stats : NULL);
+    set_pgm_read_hook(fp ? pgm_side_stats : NULL);
+}
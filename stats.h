@@ -0,0 +1,46 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include "ppm.h"
+#include "pgm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct chan_stats
+{
+    int min;
+    int max;
+    double mean;
+    double stddev;
+    unsigned long long saturated;   /* samples at or above maxval */
+    unsigned long long *hist;       /* 'bins' counts */
+} chan_stats_t;
+
+typedef struct image_stats
+{
+    int width;
+    int height;
+    int maxval;
+    int channels;
+    int bins;
+    chan_stats_t chan[3];
+} image_stats_t;
+
+image_stats_t* compute_stats(u_short **planes, int channels, int width, int height, int maxval);
+image_stats_t* ppm_stats(ppm_t *image);
+image_stats_t* pgm_stats(pgm_t *image);
+void           free_stats(image_stats_t *stats);
+
+void print_stats(FILE *fp, char *name, image_stats_t *stats);
+void print_histogram(FILE *fp, image_stats_t *stats);
+
+void stats_side_output(FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STATS_H */
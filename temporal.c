@@ -0,0 +1,263 @@
+/*
+ * temporal.c: per-pixel reduction over a sequence of frames.
+ *
+ * Every frame is folded into integer accumulators straight from the file
+ * image: a 32 bit sum, a 64 bit sum of squares and the running minimum and
+ * maximum. Rows are decoded into a per-strip scratch row and accumulated
+ * with SSE2, strips in parallel. The integer sums make the mean exact
+ * whatever the frame order, and variance is formed as n * sumsq - sum * sum
+ * in 64 bit integers, so nothing cancels; it is only rounded when it is
+ * scaled to float at the end.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "temporal.h"
+#include "pgm.h"
+#include "thread.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define TEMPORAL_SSE2 1
+#include <emmintrin.h>
+#endif
+
+typedef struct accumulate_job
+{
+    temporal_t *acc;
+    const u_char *raster;
+    size_t pitch;
+    int wide;           /* two bytes per sample */
+} accumulate_job_t;
+
+static void die(char *message)
+{
+    fprintf(stderr, "temporal: %s\n", message);
+    exit(1);
+}
+
+temporal_t* alloc_temporal_buffer(int width, int height, int channels, int maxval)
+{
+    temporal_t *acc = (temporal_t *) calloc(1, sizeof(temporal_t));
+    size_t pix = (size_t) width * height;
+    int c;
+
+    if (!acc) { die("cannot allocate memory for accumulators"); }
+
+    acc->width    = width;
+    acc->height   = height;
+    acc->channels = channels;
+    acc->maxval   = maxval;
+
+    for (c = 0; c < channels; c++) {
+        acc->sum[c]   = (unsigned *) calloc(pix, sizeof(unsigned));
+        acc->sumsq[c] = (unsigned long long *) calloc(pix, sizeof(unsigned long long));
+        acc->min[c]   = (u_short *) malloc(pix * sizeof(u_short));
+        acc->max[c]   = (u_short *) calloc(pix, sizeof(u_short));
+
+        if (!acc->sum[c] || !acc->sumsq[c] || !acc->min[c] || !acc->max[c]) {
+            die("cannot allocate memory for accumulators");
+        }
+
+        memset(acc->min[c], 0xff, pix * sizeof(u_short));
+    }
+
+    return acc;
+}
+
+void free_temporal_buffer(temporal_t *acc)
+{
+    int c;
+
+    if (!acc) { die("cannot release memory for accumulators"); }
+
+    for (c = 0; c < acc->channels; c++) {
+        free(acc->sum[c]);
+        free(acc->sumsq[c]);
+        free(acc->min[c]);
+        free(acc->max[c]);
+    }
+
+    free(acc);
+}
+
+/* parse a P5 or P6 header; returns the offset of the first raster byte */
+size_t read_frame_header(u_char *data, size_t size, int *width, int *height, int *channels, int *maxval)
+{
+    if (size >= 2 && 'P' == data[0] && '6' == data[1]) {
+        *channels = 3;
+        return read_ppm_header(data, size, width, height, maxval);
+    }
+
+    *channels = 1;
+    return read_pgm_header(data, size, width, height, maxval);
+}
+
+/* fold n samples of one channel into its accumulators */
+static void accumulate_row(const u_short *s, unsigned *sum, unsigned long long *sumsq,
+                           u_short *lo, u_short *hi, int n)
+{
+    int x = 0;
+
+#ifdef TEMPORAL_SSE2
+    /*
+     * Unsigned 16 bit min/max through the signed SSE2 instructions on
+     * samples biased by 0x8000; squares are 32 bit products assembled from
+     * the low and high halves of the 16 bit multiplies, widened to 64 bits.
+     */
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16((short) 0x8000);
+
+    for (; x + 8 <= n; x += 8) {
+        __m128i v  = _mm_loadu_si128((const __m128i *) (s + x));
+        __m128i vb = _mm_xor_si128(v, bias);
+        __m128i l  = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (lo + x)), bias);
+        __m128i h  = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (hi + x)), bias);
+        __m128i pl = _mm_mullo_epi16(v, v);
+        __m128i ph = _mm_mulhi_epu16(v, v);
+        __m128i q0 = _mm_unpacklo_epi16(pl, ph);
+        __m128i q1 = _mm_unpackhi_epi16(pl, ph);
+        __m128i *sq = (__m128i *) (sumsq + x);
+        __m128i *sm = (__m128i *) (sum + x);
+
+        _mm_storeu_si128((__m128i *) (lo + x), _mm_xor_si128(_mm_min_epi16(l, vb), bias));
+        _mm_storeu_si128((__m128i *) (hi + x), _mm_xor_si128(_mm_max_epi16(h, vb), bias));
+
+        _mm_storeu_si128(sm,     _mm_add_epi32(_mm_loadu_si128(sm),     _mm_unpacklo_epi16(v, zero)));
+        _mm_storeu_si128(sm + 1, _mm_add_epi32(_mm_loadu_si128(sm + 1), _mm_unpackhi_epi16(v, zero)));
+
+        _mm_storeu_si128(sq,     _mm_add_epi64(_mm_loadu_si128(sq),     _mm_unpacklo_epi32(q0, zero)));
+        _mm_storeu_si128(sq + 1, _mm_add_epi64(_mm_loadu_si128(sq + 1), _mm_unpackhi_epi32(q0, zero)));
+        _mm_storeu_si128(sq + 2, _mm_add_epi64(_mm_loadu_si128(sq + 2), _mm_unpacklo_epi32(q1, zero)));
+        _mm_storeu_si128(sq + 3, _mm_add_epi64(_mm_loadu_si128(sq + 3), _mm_unpackhi_epi32(q1, zero)));
+    }
+#endif
+
+    for (; x < n; x++) {
+        unsigned v = s[x];
+
+        sum[x]   += v;
+        sumsq[x] += v * v;
+        if (v < lo[x]) { lo[x] = (u_short) v; }
+        if (v > hi[x]) { hi[x] = (u_short) v; }
+    }
+}
+
+static void accumulate_rows(void *arg, int begin, int end)
+{
+    accumulate_job_t *job = (accumulate_job_t *) arg;
+    temporal_t *acc = job->acc;
+    int w = acc->width, nc = acc->channels;
+    u_short *row = (u_short *) malloc((size_t) w * nc * sizeof(u_short));
+    int x, y, c;
+
+    if (!row) { die("cannot allocate memory for scratch row"); }
+
+    for (y = begin; y < end; y++) {
+        const u_char *src = job->raster + (size_t) y * job->pitch;
+        size_t offset = (size_t) y * w;
+
+        /* de-interleave into one scratch row per channel */
+        for (c = 0; c < nc; c++) {
+            const u_char *s = src + c * (job->wide ? 2 : 1);
+            u_short *d = row + (size_t) c * w;
+
+            if (job->wide) {
+                for (x = 0; x < w; x++, s += 2 * nc) {
+                    d[x] = (u_short) ((s[0] << 8) | s[1]);
+                }
+            } else {
+                for (x = 0; x < w; x++, s += nc) {
+                    d[x] = *s;
+                }
+            }
+        }
+
+        for (c = 0; c < nc; c++) {
+            accumulate_row(row + (size_t) c * w, acc->sum[c] + offset, acc->sumsq[c] + offset,
+                           acc->min[c] + offset, acc->max[c] + offset, w);
+        }
+    }
+
+    free(row);
+}
+
+/* fold one P5/P6 file image into the accumulators; it must match their format */
+void temporal_add_frame(temporal_t *acc, u_char *data, size_t size)
+{
+    int width, height, channels, maxval;
+    accumulate_job_t job;
+    size_t pos;
+
+    pos = read_frame_header(data, size, &width, &height, &channels, &maxval);
+
+    if (width != acc->width || height != acc->height || channels != acc->channels || maxval != acc->maxval) {
+        die("frame size or format differs from the first frame");
+    }
+
+    if (acc->frames >= TEMPORAL_MAX_FRAMES) { die("too many frames"); }
+
+    job.acc    = acc;
+    job.wide   = maxval > 255;
+    job.pitch  = (size_t) width * channels * (job.wide ? 2 : 1);
+    job.raster = data + pos;
+
+    if (pos > size || size - pos < job.pitch * height) {
+        die("cannot read image data from frame");
+    }
+
+    /* the raster row, and each accumulator read and written */
+    parallel_for_bytes(height, 16, job.pitch + (size_t) width * channels * 2 * (sizeof(unsigned) +
+                       sizeof(unsigned long long) + 2 * sizeof(u_short)), accumulate_rows, &job);
+
+    acc->frames++;
+}
+
+/* rounded mean, minimum or maximum into 'channels' planes of width x height */
+void temporal_planes(temporal_t *acc, temporal_stat_t stat, u_short **dst)
+{
+    size_t i, pix = (size_t) acc->width * acc->height;
+    unsigned n = (unsigned) acc->frames;
+    int c;
+
+    if (!n) { die("no frames accumulated"); }
+
+    for (c = 0; c < acc->channels; c++) {
+        if (TEMPORAL_MIN == stat) {
+            memcpy(dst[c], acc->min[c], pix * sizeof(u_short));
+        } else if (TEMPORAL_MAX == stat) {
+            memcpy(dst[c], acc->max[c], pix * sizeof(u_short));
+        } else {
+            for (i = 0; i < pix; i++) {
+                dst[c][i] = (u_short) ((acc->sum[c][i] + (unsigned long long) n / 2) / n);
+            }
+        }
+    }
+}
+
+/*
+ * Population variance of the samples normalized to maxval, as a float image.
+ * With at most TEMPORAL_MAX_FRAMES frames of 16 bit samples, n * sumsq and
+ * sum * sum both fit in 64 bits, and their difference (n^2 times the
+ * variance) is exact and never negative.
+ */
+pfm_t* temporal_variance(temporal_t *acc)
+{
+    pfm_t *var = alloc_pfm_buffer(acc->width, acc->height, acc->channels);
+    size_t i, pix = (size_t) acc->width * acc->height;
+    unsigned long long n = (unsigned long long) acc->frames;
+    double norm = (double) n * n * acc->maxval * acc->maxval;
+    int c;
+
+    if (!acc->frames) { die("no frames accumulated"); }
+
+    for (c = 0; c < acc->channels; c++) {
+        for (i = 0; i < pix; i++) {
+            unsigned long long sum = acc->sum[c][i];
+
+            var->ch[c][i] = (float) ((double) (n * acc->sumsq[c][i] - sum * sum) / norm);
+        }
+    }
+
+    return var;
+}
@@ -0,0 +1,48 @@
+#ifndef TEMPORAL_H
+#define TEMPORAL_H
+
+#include "ppm.h"
+#include "pfm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the 32 bit sums hold at least this many 16 bit frames */
+#define TEMPORAL_MAX_FRAMES 65536
+
+typedef enum temporal_stat
+{
+    TEMPORAL_MEAN = 0,
+    TEMPORAL_MIN,
+    TEMPORAL_MAX
+} temporal_stat_t;
+
+/* per-pixel running statistics over a sequence of P5 or P6 frames */
+typedef struct temporal
+{
+    int width;
+    int height;
+    int channels;                   /* 1 (P5) or 3 (P6) */
+    int maxval;
+    int frames;
+    unsigned *sum[3];
+    unsigned long long *sumsq[3];
+    u_short *min[3];
+    u_short *max[3];
+} temporal_t;
+
+temporal_t* alloc_temporal_buffer(int width, int height, int channels, int maxval);
+void        free_temporal_buffer(temporal_t *acc);
+
+size_t read_frame_header(u_char *data, size_t size, int *width, int *height, int *channels, int *maxval);
+void   temporal_add_frame(temporal_t *acc, u_char *data, size_t size);
+
+void   temporal_planes(temporal_t *acc, temporal_stat_t stat, u_short **dst);
+pfm_t* temporal_variance(temporal_t *acc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TEMPORAL_H */
@@ -0,0 +1,305 @@
+/*
+ * thread.c: portable threads, locks and strip-parallel loops.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "thread.h"
+#include "topology.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+#define MAX_THREADS 256
+
+typedef struct strip_job
+{
+    strip_fn_t fn;
+    void *arg;
+    int begin;
+    int end;
+    int cpu;            /* pinned CPU, -1 for none */
+    strip_record_t *record;
+} strip_job_t;
+
+/* persistent strip workers; one parallel_for() at a time hands them its strips */
+static struct strip_pool
+{
+    mutex_t lock;
+    cond_t work;            /* broadcast when a loop posts its strips */
+    cond_t done;            /* signalled when the last strip of a loop finishes */
+    int busy;               /* a parallel_for() owns jobs */
+    strip_job_t *jobs;
+    int strips;
+    int next;               /* next strip to hand out */
+    int remaining;          /* strips not finished yet */
+    int workers;
+    thread_t thread[MAX_THREADS];
+} pool = { MUTEX_INITIALIZER, COND_INITIALIZER, COND_INITIALIZER };
+
+static int num_threads = 0;
+
+/* set while a thread executes a parallel_for() strip; nested loops run serially */
+static THREAD_LOCAL int in_parallel = 0;
+
+static void die(char *message)
+{
+    fprintf(stderr, "thread: %s\n", message);
+    exit(1);
+}
+
+#ifdef _WIN32
+
+typedef struct win_start
+{
+    thread_fn_t fn;
+    void *arg;
+} win_start_t;
+
+static DWORD WINAPI win_thread_main(LPVOID param)
+{
+    win_start_t start = *(win_start_t *) param;
+
+    free(param);
+    start.fn(start.arg);
+
+    return 0;
+}
+
+void thread_create(thread_t *thread, thread_fn_t fn, void *arg)
+{
+    win_start_t *start = (win_start_t *) malloc(sizeof(win_start_t));
+
+    if (!start) { die("cannot allocate memory for new thread"); }
+
+    start->fn  = fn;
+    start->arg = arg;
+
+    *thread = CreateThread(NULL, 0, win_thread_main, start, 0, NULL);
+    if (!*thread) { die("cannot create thread"); }
+}
+
+void thread_join(thread_t thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+void mutex_init(mutex_t *mutex)    { InitializeSRWLock(mutex); }
+void mutex_destroy(mutex_t *mutex) { (void) mutex; }
+void mutex_lock(mutex_t *mutex)    { AcquireSRWLockExclusive(mutex); }
+void mutex_unlock(mutex_t *mutex)  { ReleaseSRWLockExclusive(mutex); }
+
+void cond_init(cond_t *cond)                   { InitializeConditionVariable(cond); }
+void cond_destroy(cond_t *cond)                { (void) cond; }
+void cond_wait(cond_t *cond, mutex_t *mutex)   { SleepConditionVariableSRW(cond, mutex, INFINITE, 0); }
+void cond_signal(cond_t *cond)                 { WakeConditionVariable(cond); }
+void cond_broadcast(cond_t *cond)              { WakeAllConditionVariable(cond); }
+
+int get_cpu_count(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    return (int) info.dwNumberOfProcessors;
+}
+
+#else
+
+void thread_create(thread_t *thread, thread_fn_t fn, void *arg)
+{
+    if (0 != pthread_create(thread, NULL, fn, arg)) { die("cannot create thread"); }
+}
+
+void thread_join(thread_t thread)
+{
+    pthread_join(thread, NULL);
+}
+
+void mutex_init(mutex_t *mutex)    { pthread_mutex_init(mutex, NULL); }
+void mutex_destroy(mutex_t *mutex) { pthread_mutex_destroy(mutex); }
+void mutex_lock(mutex_t *mutex)    { pthread_mutex_lock(mutex); }
+void mutex_unlock(mutex_t *mutex)  { pthread_mutex_unlock(mutex); }
+
+void cond_init(cond_t *cond)                   { pthread_cond_init(cond, NULL); }
+void cond_destroy(cond_t *cond)                { pthread_cond_destroy(cond); }
+void cond_wait(cond_t *cond, mutex_t *mutex)   { pthread_cond_wait(cond, mutex); }
+void cond_signal(cond_t *cond)                 { pthread_cond_signal(cond); }
+void cond_broadcast(cond_t *cond)              { pthread_cond_broadcast(cond); }
+
+int get_cpu_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count < 1 ? 1 : (int) count;
+}
+
+#endif
+
+int get_num_threads(void)
+{
+    if (0 == num_threads) {
+        char *env = getenv("PPMTOOLS_THREADS");
+        int count = env ? atoi(env) : 0;
+
+        set_num_threads(count > 0 ? count : get_cpu_count());
+    }
+
+    return num_threads;
+}
+
+void set_num_threads(int count)
+{
+    num_threads = count < 1 ? 1 : (count > MAX_THREADS ? MAX_THREADS : count);
+}
+
+static void* strip_main(void *param)
+{
+    strip_job_t *job = (strip_job_t *) param;
+
+    in_parallel = 1;
+
+    if (job->cpu >= 0) {
+        pin_thread(job->cpu);
+        job->record->start = topology_time();
+        job->fn(job->arg, job->begin, job->end);
+        job->record->end = topology_time();
+    } else {
+        job->fn(job->arg, job->begin, job->end);
+    }
+
+    in_parallel = 0;
+
+    return NULL;
+}
+
+static void* worker_main(void *param)
+{
+    (void) param;
+
+    mutex_lock(&pool.lock);
+
+    for (;;) {
+        strip_job_t *job;
+
+        while (pool.next >= pool.strips) {
+            cond_wait(&pool.work, &pool.lock);
+        }
+        job = &pool.jobs[pool.next++];
+        mutex_unlock(&pool.lock);
+
+        strip_main(job);
+
+        mutex_lock(&pool.lock);
+        if (0 == --pool.remaining) { cond_signal(&pool.done); }
+    }
+
+    return NULL;
+}
+
+/*
+ * Split [0, count) into contiguous strips of at least 'grain' items and run
+ * them on the worker pool, the calling thread taking strips as well. The
+ * split is static, so a given strip index maps to the same rows on every
+ * call for images of the same size. Workers are started on first use and
+ * then wait for the next loop. A loop issued while another thread's loop
+ * owns the pool, or from inside a strip, runs serially. 'item_bytes' is the
+ * image data one item reads and writes, for the NUMA report; 0 if unknown.
+ */
+void parallel_for_bytes(int count, int grain, size_t item_bytes, strip_fn_t fn, void *arg)
+{
+    strip_job_t job[MAX_THREADS];
+    strip_record_t record[MAX_THREADS];
+    int strips, pinned, i;
+
+    if (count <= 0) { return; }
+    if (grain < 1) { grain = 1; }
+
+    strips = get_num_threads();
+    if (strips > (count + grain - 1) / grain) { strips = (count + grain - 1) / grain; }
+
+    if (strips > 1 && !in_parallel) {
+        mutex_lock(&pool.lock);
+        if (pool.busy) { strips = 1; } else { pool.busy = 1; }
+        mutex_unlock(&pool.lock);
+    }
+
+    if (strips <= 1 || in_parallel) {
+        double start = topology_time();
+
+        fn(arg, 0, count);
+
+        if (get_numa_placement() && !in_parallel) {
+            record[0].node  = get_strip_node(0, 1);
+            record[0].items = count;
+            record[0].bytes = (size_t) count * item_bytes;
+            record[0].start = start;
+            record[0].end   = topology_time();
+            account_strips(record, 1);
+        }
+        return;
+    }
+
+    /* with NUMA placement every strip runs on a worker pinned by topology */
+    pinned = get_numa_placement();
+
+    for (i = 0; i < strips; i++) {
+        job[i].fn    = fn;
+        job[i].arg   = arg;
+        job[i].begin = (int) ((long long) count * i / strips);
+        job[i].end   = (int) ((long long) count * (i + 1) / strips);
+        job[i].cpu    = pinned ? get_strip_cpu(i, strips) : -1;
+        job[i].record = &record[i];
+
+        record[i].node  = pinned ? get_strip_node(i, strips) : 0;
+        record[i].items = job[i].end - job[i].begin;
+        record[i].bytes = (size_t) record[i].items * item_bytes;
+    }
+
+    mutex_lock(&pool.lock);
+
+    while (pool.workers < (pinned ? strips : strips - 1)) {
+        thread_create(&pool.thread[pool.workers++], worker_main, NULL);
+    }
+
+    pool.jobs      = job;
+    pool.strips    = strips;
+    pool.next      = 0;
+    pool.remaining = strips;
+    cond_broadcast(&pool.work);
+
+    while (!pinned && pool.next < pool.strips) {
+        strip_job_t *mine = &pool.jobs[pool.next++];
+
+        mutex_unlock(&pool.lock);
+        strip_main(mine);
+        mutex_lock(&pool.lock);
+        pool.remaining--;
+    }
+
+    while (pool.remaining > 0) {
+        cond_wait(&pool.done, &pool.lock);
+    }
+
+    pool.jobs   = NULL;
+    pool.strips = 0;
+    pool.next   = 0;
+    pool.busy   = 0;
+    mutex_unlock(&pool.lock);
+
+    if (pinned) { account_strips(record, strips); }
+}
+
+void parallel_for(int count, int grain, strip_fn_t fn, void *arg)
+{
+    parallel_for_bytes(count, grain, 0, fn, arg);
+}
@@ -0,0 +1,62 @@
+#ifndef THREAD_H
+#define THREAD_H
+
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef _WIN32
+typedef HANDLE             thread_t;
+typedef SRWLOCK            mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+
+#define MUTEX_INITIALIZER  SRWLOCK_INIT
+#define COND_INITIALIZER   CONDITION_VARIABLE_INIT
+#else
+typedef pthread_t          thread_t;
+typedef pthread_mutex_t    mutex_t;
+typedef pthread_cond_t     cond_t;
+
+#define MUTEX_INITIALIZER  PTHREAD_MUTEX_INITIALIZER
+#define COND_INITIALIZER   PTHREAD_COND_INITIALIZER
+#endif
+
+typedef void* (*thread_fn_t)(void *arg);
+
+/* strip worker: process items [begin, end) of a parallel_for() range */
+typedef void  (*strip_fn_t)(void *arg, int begin, int end);
+
+void thread_create(thread_t *thread, thread_fn_t fn, void *arg);
+void thread_join(thread_t thread);
+
+void mutex_init(mutex_t *mutex);
+void mutex_destroy(mutex_t *mutex);
+void mutex_lock(mutex_t *mutex);
+void mutex_unlock(mutex_t *mutex);
+
+void cond_init(cond_t *cond);
+void cond_destroy(cond_t *cond);
+void cond_wait(cond_t *cond, mutex_t *mutex);
+void cond_signal(cond_t *cond);
+void cond_broadcast(cond_t *cond);
+
+int  get_cpu_count(void);
+int  get_num_threads(void);
+void set_num_threads(int count);
+
+void parallel_for(int count, int grain, strip_fn_t fn, void *arg);
+void parallel_for_bytes(int count, int grain, size_t item_bytes, strip_fn_t fn, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* THREAD_H */
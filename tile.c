@@ -0,0 +1,390 @@
+/*
+ * tile.c: random access to TILE_SIZE tiles of large P6 files at any zoom.
+ *
+ * Every tile is decoded straight from the source rectangle under it with
+ * the shrink-on-load box reducer of ppm.c, which reads only those file rows
+ * and columns through aio. A tile of level n is a block of the source
+ * box-reduced by 2^n. A tile of any other zoom is resampled with the area
+ * filter from the blocks reduced by the integer part of 1 / zoom, like -z
+ * does for a whole image, so neighbouring tiles and nearby zooms share the
+ * decoded blocks.
+ *
+ * Blocks and zoomed tiles live in one LRU cache per image, bounded in bytes
+ * and shared by every thread. A miss enters a placeholder before the tile
+ * is made, so other threads missing the same tile wait for it instead of
+ * decoding it again. Tiles handed out by get_tile() are pinned until
+ * release_tile().
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "tile.h"
+#include "resample.h"
+
+static void die(char *message)
+{
+    fprintf(stderr, "tile: %s\n", message);
+    exit(1);
+}
+
+tiled_image_t* open_tiled_image(char *filename, size_t cache_limit)
+{
+    tiled_image_t *image = (tiled_image_t *) calloc(1, sizeof(tiled_image_t));
+    int level, w, h;
+
+    if (!image) { die("cannot allocate memory for tiled image"); }
+
+    mutex_init(&image->lock);
+    cond_init(&image->made);
+
+    image->source      = open_ppm_source(filename);
+    image->width       = image->source->width;
+    image->height      = image->source->height;
+    image->maxval      = image->source->maxval;
+    image->cache_limit = cache_limit;
+
+    /* levels halve like reduce2_plane(), until the whole image fits one tile */
+    for (w = image->width, h = image->height, image->levels = 1; w > TILE_SIZE || h > TILE_SIZE; image->levels++) {
+        w = (w + 1) / 2;
+        h = (h + 1) / 2;
+    }
+
+    image->level_width  = (int *) malloc(image->levels * sizeof(int));
+    image->level_height = (int *) malloc(image->levels * sizeof(int));
+    if (!image->level_width || !image->level_height) { die("cannot allocate memory for tiled image"); }
+
+    image->level_width[0]  = image->width;
+    image->level_height[0] = image->height;
+
+    for (level = 1; level < image->levels; level++) {
+        image->level_width[level]  = (image->level_width[level - 1] + 1) / 2;
+        image->level_height[level] = (image->level_height[level - 1] + 1) / 2;
+    }
+
+    return image;
+}
+
+static void free_tile(tile_t *tile)
+{
+    if (tile->image) { free_ppm_buffer(tile->image); }
+    free(tile);
+}
+
+void close_tiled_image(tiled_image_t *image)
+{
+    tile_t *tile, *next;
+
+    if (!image) { die("cannot release tiled image"); }
+
+    for (tile = image->head; tile; tile = next) {
+        next = tile->next;
+        free_tile(tile);
+    }
+
+    close_ppm_source(image->source);
+    mutex_destroy(&image->lock);
+    cond_destroy(&image->made);
+    free(image->level_width);
+    free(image->level_height);
+    free(image);
+}
+
+int get_tile_columns(tiled_image_t *image, int level)
+{
+    return (image->level_width[level] + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+int get_tile_rows(tiled_image_t *image, int level)
+{
+    return (image->level_height[level] + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+static unsigned tile_hash(int kind, unsigned key, int x, int y)
+{
+    unsigned h = ((unsigned) kind + key * 2u) * 0x9e3779b1u ^ (unsigned) x * 0x85ebca77u ^ (unsigned) y * 0xc2b2ae3du;
+
+    return (h ^ (h >> 15)) % TILE_CACHE_BUCKETS;
+}
+
+/* cache lookup; the caller holds the lock */
+static tile_t* find_tile(tiled_image_t *image, int kind, unsigned key, int x, int y)
+{
+    tile_t *tile = image->bucket[tile_hash(kind, key, x, y)];
+
+    while (tile && (tile->kind != kind || tile->key != key || tile->x != x || tile->y != y)) {
+        tile = tile->chain;
+    }
+
+    return tile;
+}
+
+static void unlink_lru(tiled_image_t *image, tile_t *tile)
+{
+    if (tile->prev) { tile->prev->next = tile->next; } else { image->head = tile->next; }
+    if (tile->next) { tile->next->prev = tile->prev; } else { image->tail = tile->prev; }
+}
+
+static void push_lru(tiled_image_t *image, tile_t *tile)
+{
+    tile->prev = NULL;
+    tile->next = image->head;
+
+    if (image->head) { image->head->prev = tile; } else { image->tail = tile; }
+    image->head = tile;
+}
+
+/* drop least recently used, unreferenced tiles until the cache fits its limit */
+static void evict_tiles(tiled_image_t *image)
+{
+    tile_t *tile = image->tail;
+
+    while (tile && image->cache_bytes > image->cache_limit) {
+        tile_t *prev = tile->prev;
+
+        if (0 == tile->refs) {
+            tile_t **link = &image->bucket[tile_hash(tile->kind, tile->key, tile->x, tile->y)];
+
+            while (*link != tile) { link = &(*link)->chain; }
+            *link = tile->chain;
+
+            unlink_lru(image, tile);
+            image->cache_bytes -= tile->bytes;
+            free_tile(tile);
+        }
+
+        tile = prev;
+    }
+}
+
+/*
+ * Take a reference to a cached tile, waiting while another thread makes it.
+ * On a miss an empty placeholder is entered and returned with *make set;
+ * the caller makes the image and passes it to publish_tile().
+ */
+static tile_t* take_tile(tiled_image_t *image, int kind, unsigned key, int x, int y, int *make)
+{
+    tile_t *tile;
+
+    mutex_lock(&image->lock);
+
+    while (NULL != (tile = find_tile(image, kind, key, x, y)) && !tile->image) {
+        cond_wait(&image->made, &image->lock);
+    }
+
+    if (tile) {
+        tile->refs++;
+        image->hits++;
+        unlink_lru(image, tile);
+        push_lru(image, tile);
+        *make = 0;
+    } else {
+        if (NULL == (tile = (tile_t *) calloc(1, sizeof(tile_t)))) { die("cannot allocate memory for tile"); }
+
+        tile->kind  = kind;
+        tile->key   = key;
+        tile->x     = x;
+        tile->y     = y;
+        tile->refs  = 1;
+        tile->chain = image->bucket[tile_hash(kind, key, x, y)];
+        image->bucket[tile_hash(kind, key, x, y)] = tile;
+        push_lru(image, tile);
+        image->misses++;
+        *make = 1;
+    }
+
+    mutex_unlock(&image->lock);
+
+    return tile;
+}
+
+/* fill a placeholder and wake the threads waiting for it */
+static void publish_tile(tiled_image_t *image, tile_t *tile, ppm_t *made)
+{
+    mutex_lock(&image->lock);
+    tile->image = made;
+    tile->bytes = (size_t) made->width * made->height * 3 * sizeof(u_short);
+    image->cache_bytes += tile->bytes;
+    cond_broadcast(&image->made);
+    evict_tiles(image);
+    mutex_unlock(&image->lock);
+}
+
+/* block (x, y) of the source box-reduced by 'factor', decoded from its rectangle */
+static tile_t* get_block(tiled_image_t *image, int factor, int x, int y)
+{
+    int make, span = TILE_SIZE * factor;
+    tile_t *tile = take_tile(image, TILE_BLOCK, (unsigned) factor, x, y, &make);
+
+    if (make) {
+        int x0 = x * span, y0 = y * span;
+        int width  = image->width  - x0 < span ? image->width  - x0 : span;
+        int height = image->height - y0 < span ? image->height - y0 : span;
+
+        publish_tile(image, tile, read_ppm_region_reduced(image->source, x0, y0, width, height, factor));
+    }
+
+    return tile;
+}
+
+/*
+ * Tile (x, y) of 'level', from the cache or decoded on demand. The tile
+ * stays valid until it is passed to release_tile().
+ */
+tile_t* get_tile(tiled_image_t *image, int level, int x, int y)
+{
+    if (level < 0 || level >= image->levels ||
+        x < 0 || x >= get_tile_columns(image, level) || y < 0 || y >= get_tile_rows(image, level)) {
+        die("tile outside of the image");
+    }
+
+    return get_block(image, 1 << level, x, y);
+}
+
+/* size of the whole image at 'zoom', rounded down like -z */
+void get_zoom_size(tiled_image_t *image, float zoom, int *width, int *height)
+{
+    if (!(zoom > 0.f && zoom <= 1.f)) { die("zoom must be in (0, 1]"); }
+
+    *width  = (int) ((float) image->width * zoom);
+    *height = (int) ((float) image->height * zoom);
+
+    if (*width < 1 || *height < 1) { die("zoom leaves no pixels"); }
+}
+
+/* the weights of outputs [first, first + count), relative to source sample 'origin' */
+static contrib_t* sub_contrib(contrib_t *contrib, int first, int count, int origin)
+{
+    contrib_t *sub = alloc_contrib(count, contrib->taps);
+    int i;
+
+    memcpy(sub->coef, contrib->coef + (size_t) first * contrib->taps, (size_t) count * contrib->taps * sizeof(short));
+
+    for (i = 0; i < count; i++) {
+        sub->start[i] = contrib->start[first + i] - origin;
+    }
+
+    return sub;
+}
+
+/* reduced samples [*lo, *hi) the outputs [first, first + count) read */
+static void contrib_window(contrib_t *contrib, int first, int count, int *lo, int *hi)
+{
+    int i;
+
+    *lo = contrib->start[first];
+    *hi = *lo;
+
+    for (i = first; i < first + count; i++) {
+        if (contrib->start[i] < *lo) { *lo = contrib->start[i]; }
+        if (contrib->start[i] + contrib->taps > *hi) { *hi = contrib->start[i] + contrib->taps; }
+    }
+}
+
+/* copy the parts of the cached blocks that overlap 'window' at reduced (x0, y0) */
+static void gather_blocks(tiled_image_t *image, int factor, ppm_t *window, int x0, int y0)
+{
+    int bx, by, chan, y;
+
+    for (by = y0 / TILE_SIZE; by <= (y0 + window->height - 1) / TILE_SIZE; by++) {
+        for (bx = x0 / TILE_SIZE; bx <= (x0 + window->width - 1) / TILE_SIZE; bx++) {
+            tile_t *block = get_block(image, factor, bx, by);
+            int left   = bx * TILE_SIZE > x0 ? bx * TILE_SIZE : x0;
+            int top    = by * TILE_SIZE > y0 ? by * TILE_SIZE : y0;
+            int right  = bx * TILE_SIZE + block->image->width;
+            int bottom = by * TILE_SIZE + block->image->height;
+
+            if (right > x0 + window->width)   { right = x0 + window->width; }
+            if (bottom > y0 + window->height) { bottom = y0 + window->height; }
+
+            for (chan = 0; chan < 3; chan++) {
+                plane_t s = ppm_plane(block->image, chan);
+                plane_t d = ppm_plane(window, chan);
+
+                for (y = top; y < bottom; y++) {
+                    memcpy(d.data + (size_t) (y - y0) * d.stride + (left - x0),
+                           s.data + (size_t) (y - by * TILE_SIZE) * s.stride + (left - bx * TILE_SIZE),
+                           (size_t) (right - left) * sizeof(u_short));
+                }
+            }
+
+            release_tile(image, block);
+        }
+    }
+}
+
+/*
+ * Tile (x, y) of the image zoomed by 'zoom' in (0, 1], from the cache or
+ * made on demand: the blocks reduced by the integer part of 1 / zoom that
+ * the tile's area weights reach are gathered into a window and resampled.
+ * Tiles are crops of what -z gives for the whole image with the default
+ * filter below 0.5, and area-filtered from full size above it.
+ */
+tile_t* get_zoom_tile(tiled_image_t *image, float zoom, int x, int y)
+{
+    int width, height, factor, make;
+    unsigned key;
+    tile_t *tile;
+
+    get_zoom_size(image, zoom, &width, &height);
+
+    if (x < 0 || x >= (width + TILE_SIZE - 1) / TILE_SIZE || y < 0 || y >= (height + TILE_SIZE - 1) / TILE_SIZE) {
+        die("tile outside of the image");
+    }
+
+    memcpy(&key, &zoom, sizeof(key));
+    tile = take_tile(image, TILE_ZOOM, key, x, y, &make);
+
+    if (make) {
+        int ox = x * TILE_SIZE, oy = y * TILE_SIZE;
+        int ow = width  - ox < TILE_SIZE ? width  - ox : TILE_SIZE;
+        int oh = height - oy < TILE_SIZE ? height - oy : TILE_SIZE;
+        int x0, x1, y0, y1, chan;
+        contrib_t *xcontrib, *ycontrib, *xsub, *ysub;
+        ppm_t *window, *made;
+
+        factor = (int) (1.f / zoom + 1e-4f);
+        if (factor > PPM_MAX_REDUCTION) { factor = PPM_MAX_REDUCTION; }
+
+        xcontrib = area_contrib_reduced(image->width, factor, width);
+        ycontrib = area_contrib_reduced(image->height, factor, height);
+
+        contrib_window(xcontrib, ox, ow, &x0, &x1);
+        contrib_window(ycontrib, oy, oh, &y0, &y1);
+
+        xsub = sub_contrib(xcontrib, ox, ow, x0);
+        ysub = sub_contrib(ycontrib, oy, oh, y0);
+
+        window = alloc_ppm_buffer(x1 - x0, y1 - y0, image->maxval);
+        made   = alloc_ppm_buffer(ow, oh, image->maxval);
+        if (!window || !made) { die("cannot allocate memory for tile"); }
+
+        gather_blocks(image, factor, window, x0, y0);
+
+        for (chan = 0; chan < 3; chan++) {
+            plane_t s = ppm_plane(window, chan);
+            plane_t d = ppm_plane(made, chan);
+
+            resample_plane(&s, &d, xsub, ysub, image->maxval);
+        }
+
+        free_contrib(xcontrib);
+        free_contrib(ycontrib);
+        free_contrib(xsub);
+        free_contrib(ysub);
+        free_ppm_buffer(window);
+
+        publish_tile(image, tile, made);
+    }
+
+    return tile;
+}
+
+void release_tile(tiled_image_t *image, tile_t *tile)
+{
+    mutex_lock(&image->lock);
+    if (tile->refs < 1) { die("tile released more often than taken"); }
+    tile->refs--;
+    evict_tiles(image);
+    mutex_unlock(&image->lock);
+}
@@ -0,0 +1,71 @@
+#ifndef TILE_H
+#define TILE_H
+
+#include "ppm.h"
+#include "thread.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TILE_SIZE           256
+#define TILE_CACHE_BUCKETS  4096
+#define TILE_CACHE_DEFAULT  ((size_t) 256 << 20)
+
+#define TILE_BLOCK          0       /* source box-reduced by 'key'; level n is factor 2^n */
+#define TILE_ZOOM           1       /* tile of a view zoomed by the float whose bits are 'key' */
+
+/* one cached tile */
+typedef struct tile
+{
+    int kind;               /* TILE_BLOCK or TILE_ZOOM */
+    unsigned key;
+    int x;                  /* tile column and row */
+    int y;
+    ppm_t *image;           /* up to TILE_SIZE x TILE_SIZE samples; NULL while being made */
+    size_t bytes;
+    int refs;               /* get_tile() references not yet released */
+    struct tile *prev;      /* LRU list, most recent first */
+    struct tile *next;
+    struct tile *chain;     /* hash bucket */
+} tile_t;
+
+/* a P6 file opened for random tile access, with its tile cache */
+typedef struct tiled_image
+{
+    int width;
+    int height;
+    int maxval;
+    int levels;             /* level 'levels - 1' fits in one tile */
+    int *level_width;
+    int *level_height;
+    ppm_source_t *source;
+
+    mutex_t lock;           /* cache */
+    cond_t made;            /* broadcast when a tile being made is ready */
+    tile_t *bucket[TILE_CACHE_BUCKETS];
+    tile_t *head;
+    tile_t *tail;
+    size_t cache_bytes;
+    size_t cache_limit;
+    unsigned long long hits;
+    unsigned long long misses;
+} tiled_image_t;
+
+tiled_image_t* open_tiled_image(char *filename, size_t cache_limit);
+void           close_tiled_image(tiled_image_t *image);
+
+int    get_tile_columns(tiled_image_t *image, int level);
+int    get_tile_rows(tiled_image_t *image, int level);
+tile_t* get_tile(tiled_image_t *image, int level, int x, int y);
+
+void   get_zoom_size(tiled_image_t *image, float zoom, int *width, int *height);
+tile_t* get_zoom_tile(tiled_image_t *image, float zoom, int x, int y);
+
+void   release_tile(tiled_image_t *image, tile_t *tile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TILE_H */
@@ -0,0 +1,452 @@
+/*
+ * topology.c: NUMA topology, thread pinning and image memory placement.
+ *
+ * The usable CPUs are ordered by NUMA node, and strip i of an n-way
+ * parallel_for() runs on CPU order[i * cpus / n], so contiguous row bands
+ * stay on one node. Image planes are placed with the same split: with
+ * HAVE_LIBNUMA each band is bound to its node with mbind(), otherwise the
+ * pages go wherever the strip that decodes or first writes them runs.
+ * All of this is off until set_numa_placement() turns it on.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "topology.h"
+#include "thread.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#if defined(HAVE_LIBNUMA) && defined(__linux__)
+#define TOPOLOGY_MBIND 1
+#include <numa.h>
+#include <numaif.h>
+#endif
+
+#define PROBE_BYTES ((size_t) 64 << 20)
+
+typedef struct node_stats
+{
+    int strips;
+    long long items;
+    double bytes;           /* image data read and written by its strips */
+    double seconds;         /* summed strip time */
+    double wall;            /* time the node had a strip running, per loop */
+    size_t placed;          /* image bytes bound to the node */
+} node_stats_t;
+
+/* one bandwidth probe thread: fill or read 'size' bytes pinned to 'cpu' */
+typedef struct probe
+{
+    unsigned long long *buf;
+    size_t size;
+    int cpu;
+    int fill;
+    double seconds;
+    unsigned long long sum;
+} probe_t;
+
+static int initialized = 0;
+static int placement = 0;
+static int cpu_count = 1;
+static int node_count = 1;
+static int cpu_order[TOPOLOGY_MAX_CPUS];
+static int cpu_node[TOPOLOGY_MAX_CPUS];    /* node of cpu_order[i] */
+static node_stats_t node_stats[TOPOLOGY_MAX_NODES];
+static double total_bytes = 0.0;
+static double total_wall = 0.0;
+static mutex_t stats_lock;
+
+static void die(char *message)
+{
+    fprintf(stderr, "topology: %s\n", message);
+    exit(1);
+}
+
+#ifdef __linux__
+/* mark the CPUs of a sysfs list such as "0-3,8-11" in 'set' */
+static void parse_cpu_list(const char *list, char *set)
+{
+    const char *p = list;
+
+    while (*p) {
+        char *end;
+        long lo = strtol(p, &end, 10), hi;
+
+        if (end == p) { break; }
+        hi = lo;
+        p = end;
+
+        if ('-' == *p) {
+            hi = strtol(p + 1, &end, 10);
+            p = end;
+        }
+
+        for (; lo <= hi && lo < TOPOLOGY_MAX_CPUS; lo++) {
+            if (lo >= 0) { set[lo] = 1; }
+        }
+
+        if (',' == *p) { p++; } else { break; }
+    }
+}
+#endif
+
+/* discover the usable CPUs and their nodes; without sysfs there is one node */
+void topology_init(void)
+{
+#ifdef __linux__
+    signed char node_of[TOPOLOGY_MAX_CPUS];
+    cpu_set_t allowed;
+    int cpu, node;
+#endif
+
+    if (initialized) { return; }
+    initialized = 1;
+
+    mutex_init(&stats_lock);
+
+#ifdef __linux__
+    memset(node_of, -1, sizeof(node_of));
+
+    for (node = 0; node < TOPOLOGY_MAX_NODES; node++) {
+        char name[64], list[4096], set[TOPOLOGY_MAX_CPUS];
+        FILE *fp;
+
+        sprintf(name, "/sys/devices/system/node/node%d/cpulist", node);
+        if (NULL == (fp = fopen(name, "r"))) { continue; }
+
+        memset(set, 0, sizeof(set));
+        if (fgets(list, sizeof(list), fp)) { parse_cpu_list(list, set); }
+        fclose(fp);
+
+        for (cpu = 0; cpu < TOPOLOGY_MAX_CPUS; cpu++) {
+            if (set[cpu]) { node_of[cpu] = (signed char) node; }
+        }
+    }
+
+    CPU_ZERO(&allowed);
+    if (0 != sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        for (cpu = 0; cpu < get_cpu_count() && cpu < CPU_SETSIZE; cpu++) { CPU_SET(cpu, &allowed); }
+    }
+
+    /* allowed CPUs in node order; CPUs of no known node count as node 0 */
+    cpu_count  = 0;
+    node_count = 0;
+
+    for (node = -1; node < TOPOLOGY_MAX_NODES; node++) {
+        int found = 0;
+
+        for (cpu = 0; cpu < TOPOLOGY_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+            if (node_of[cpu] != node || !CPU_ISSET(cpu, &allowed)) { continue; }
+
+            cpu_order[cpu_count]  = cpu;
+            cpu_node[cpu_count++] = node < 0 ? 0 : node;
+            found = 1;
+        }
+
+        if (found && node >= 0) { node_count = node + 1; }
+    }
+
+    if (0 == cpu_count) {
+        cpu_order[0] = 0;
+        cpu_node[0]  = 0;
+        cpu_count    = 1;
+    }
+
+    if (node_count < 1) { node_count = 1; }
+#else
+    {
+        int cpu;
+
+        cpu_count = get_cpu_count() < TOPOLOGY_MAX_CPUS ? get_cpu_count() : TOPOLOGY_MAX_CPUS;
+        for (cpu = 0; cpu < cpu_count; cpu++) {
+            cpu_order[cpu] = cpu;
+            cpu_node[cpu]  = 0;
+        }
+    }
+#endif
+}
+
+int get_node_count(void)
+{
+    topology_init();
+
+    return node_count;
+}
+
+/* CPU for strip 'strip' of 'strips'; strips are spread evenly in node order */
+int get_strip_cpu(int strip, int strips)
+{
+    topology_init();
+
+    return cpu_order[(long long) strip * cpu_count / strips];
+}
+
+int get_strip_node(int strip, int strips)
+{
+    topology_init();
+
+    return cpu_node[(long long) strip * cpu_count / strips];
+}
+
+/* restrict the calling thread to one CPU */
+void pin_thread(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+#elif defined(_WIN32)
+    if (cpu < 64) { SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << cpu); }
+#else
+    (void) cpu;
+#endif
+}
+
+/* pin parallel_for() strips, place image planes by node and keep per-node statistics */
+void set_numa_placement(int enable)
+{
+    topology_init();
+
+    placement = enable;
+}
+
+int get_numa_placement(void)
+{
+    return placement;
+}
+
+#ifdef TOPOLOGY_MBIND
+/* bind the whole pages of [data, data + size) to 'node' */
+static size_t bind_range(char *data, size_t size, int node)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t begin = ((size_t) data + page - 1) / page * page;
+    size_t end = ((size_t) data + size) / page * page;
+    unsigned long mask = 1UL << node;
+
+    if (end <= begin || node >= (int) (8 * sizeof(mask))) { return 0; }
+
+    if (0 != mbind((void *) begin, end - begin, MPOL_BIND, &mask, 8 * sizeof(mask), MPOL_MF_MOVE)) {
+        return 0;
+    }
+
+    return end - begin;
+}
+#endif
+
+/*
+ * Place the rows of a freshly allocated plane on the nodes of the strips
+ * that will process them, using the split of an n-thread parallel_for().
+ * Without libnuma this is left to first touch.
+ */
+void place_rows(void *data, size_t row_bytes, int rows)
+{
+#ifdef TOPOLOGY_MBIND
+    int strips = get_num_threads(), i;
+
+    if (!placement || node_count < 2 || numa_available() < 0) { return; }
+
+    if (strips > rows) { strips = rows; }
+
+    for (i = 0; i < strips; i++) {
+        int begin = (int) ((long long) rows * i / strips);
+        int end   = (int) ((long long) rows * (i + 1) / strips);
+        int node  = get_strip_node(i, strips);
+        size_t bound = bind_range((char *) data + (size_t) begin * row_bytes, (size_t) (end - begin) * row_bytes, node);
+
+        mutex_lock(&stats_lock);
+        node_stats[node].placed += bound;
+        mutex_unlock(&stats_lock);
+    }
+#else
+    (void) data;
+    (void) row_bytes;
+    (void) rows;
+#endif
+}
+
+/* monotonic seconds */
+double topology_time(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+
+    return (double) count.QuadPart / (double) freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+/*
+ * Add the strips of one finished loop to their nodes' totals. A node's wall
+ * time grows by the span from its first strip's start to its last strip's
+ * end, so bytes / wall is the bandwidth the node sustained for the loop.
+ */
+void account_strips(const strip_record_t *record, int strips)
+{
+    double first[TOPOLOGY_MAX_NODES], last[TOPOLOGY_MAX_NODES], start = 0.0, end = 0.0;
+    int seen[TOPOLOGY_MAX_NODES], i;
+
+    for (i = 0; i < node_count; i++) {
+        first[i] = last[i] = 0.0;
+        seen[i]  = 0;
+    }
+
+    mutex_lock(&stats_lock);
+
+    for (i = 0; i < strips; i++) {
+        const strip_record_t *r = &record[i];
+        node_stats_t *s = &node_stats[r->node];
+
+        s->strips++;
+        s->items   += r->items;
+        s->bytes   += (double) r->bytes;
+        s->seconds += r->end - r->start;
+        total_bytes += (double) r->bytes;
+
+        if (!seen[r->node] || r->start < first[r->node]) { first[r->node] = r->start; }
+        if (!seen[r->node] || r->end > last[r->node])    { last[r->node]  = r->end; }
+        seen[r->node] = 1;
+        if (0 == i || r->start < start) { start = r->start; }
+        if (r->end > end) { end = r->end; }
+    }
+
+    for (i = 0; i < node_count; i++) {
+        node_stats[i].wall += last[i] - first[i];
+    }
+    total_wall += end - start;
+
+    mutex_unlock(&stats_lock);
+}
+
+static void* probe_main(void *arg)
+{
+    probe_t *probe = (probe_t *) arg;
+    size_t i, n = probe->size / sizeof(unsigned long long);
+    unsigned long long sum = 0;
+    double start;
+
+    pin_thread(probe->cpu);
+
+    if (probe->fill) {
+        memset(probe->buf, 1, probe->size);
+        return NULL;
+    }
+
+    start = topology_time();
+    for (i = 0; i < n; i++) {
+        sum += probe->buf[i];
+    }
+    probe->seconds = topology_time() - start;
+    probe->sum = sum;
+
+    return NULL;
+}
+
+/* run one probe on its own thread */
+static void run_probe(probe_t *probe)
+{
+    thread_t thread;
+
+    thread_create(&thread, probe_main, probe);
+    thread_join(thread);
+}
+
+/* first CPU of 'node' in the usable set */
+static int node_cpu(int node)
+{
+    int i;
+
+    for (i = 0; i < cpu_count; i++) {
+        if (cpu_node[i] == node) { return cpu_order[i]; }
+    }
+
+    return -1;
+}
+
+/*
+ * Per-node work of the run so far: strips, items, image bytes read and
+ * written, busy and wall time, and the bandwidth that gives; then the
+ * whole run. Loops whose callers gave no byte count add time but no bytes.
+ * A single-thread read bandwidth matrix of the machine follows for
+ * reference: CPUs of each node reading memory placed on each node.
+ */
+void print_topology_report(FILE *fp)
+{
+    int i, j;
+
+    topology_init();
+
+    fprintf(fp, "nodes %d, cpus %d, threads %d, placement %s\n", node_count, cpu_count, get_num_threads(),
+#ifdef TOPOLOGY_MBIND
+            "mbind"
+#else
+            "first touch"
+#endif
+            );
+
+    for (i = 0; i < node_count; i++) {
+        node_stats_t *s = &node_stats[i];
+
+        fprintf(fp, "node %d: strips %d, items %lld, data %.1f MB, busy %.3f s, wall %.3f s, %.2f GB/s, bound %.1f MB\n",
+                i, s->strips, s->items, s->bytes / 1048576.0, s->seconds, s->wall,
+                s->wall > 0.0 ? s->bytes / s->wall / 1e9 : 0.0, s->placed / 1048576.0);
+    }
+
+    fprintf(fp, "total: data %.1f MB, wall %.3f s, %.2f GB/s\n", total_bytes / 1048576.0, total_wall,
+            total_wall > 0.0 ? total_bytes / total_wall / 1e9 : 0.0);
+
+    fprintf(fp, "probe: single-thread read bandwidth GB/s (cpu node -> memory node)\n");
+
+    for (j = 0; j < node_count; j++) {
+        probe_t probe;
+
+        if (node_cpu(j) < 0) { continue; }
+
+        memset(&probe, 0, sizeof(probe));
+        probe.size = PROBE_BYTES;
+        probe.buf  = (unsigned long long *) malloc(probe.size);
+        if (!probe.buf) { die("cannot allocate memory for bandwidth probe"); }
+
+        /* the fill runs on node j, so first touch places the buffer there */
+#ifdef TOPOLOGY_MBIND
+        if (node_count > 1 && numa_available() >= 0) { bind_range((char *) probe.buf, probe.size, j); }
+#endif
+        probe.cpu  = node_cpu(j);
+        probe.fill = 1;
+        run_probe(&probe);
+
+        for (i = 0; i < node_count; i++) {
+            if (node_cpu(i) < 0) { continue; }
+
+            probe.cpu  = node_cpu(i);
+            probe.fill = 0;
+            run_probe(&probe);
+
+            fprintf(fp, "  %d -> %d: %.2f\n", i, j, probe.seconds > 0.0 ? probe.size / probe.seconds / 1e9 : 0.0);
+        }
+
+        free(probe.buf);
+    }
+}
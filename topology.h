@@ -0,0 +1,43 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TOPOLOGY_MAX_CPUS   1024
+#define TOPOLOGY_MAX_NODES  64
+
+/* one finished parallel_for() strip, for the per-node report */
+typedef struct strip_record
+{
+    int node;
+    int items;
+    size_t bytes;           /* image data read and written */
+    double start;           /* topology_time() */
+    double end;
+} strip_record_t;
+
+void topology_init(void);
+int  get_node_count(void);
+int  get_strip_cpu(int strip, int strips);
+int  get_strip_node(int strip, int strips);
+void pin_thread(int cpu);
+
+void set_numa_placement(int enable);
+int  get_numa_placement(void);
+
+void place_rows(void *data, size_t row_bytes, int rows);
+
+double topology_time(void);
+void   account_strips(const strip_record_t *record, int strips);
+void   print_topology_report(FILE *fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TOPOLOGY_H */
@@ -0,0 +1,424 @@
+/*
+ * transform.c: rotate, flip and transpose of planes and images.
+ *
+ * Source rows are processed in strips of TRANSFORM_STRIP rows spread over
+ * threads. Transforms that keep the row direction copy (or reverse) whole
+ * rows. Transforms that swap the axes walk each strip in 32-column blocks
+ * of 8x8 tiles; a tile is transposed in SSE2 registers, so both the reads
+ * and the writes touch 8 cache lines per tile instead of one line per
+ * sample on the strided side.
+ *
+ * The same strip routine serves the file readers: a strip is de-interleaved
+ * from the raster into a per-thread scratch buffer and transformed straight
+ * into the destination, so the untransformed image never exists in memory.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "transform.h"
+#include "aio.h"
+#include "thread.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define TRANSFORM_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#define TRANSFORM_STRIP 32
+#define TRANSFORM_BLOCK 32
+
+typedef struct transform_job
+{
+    const u_short *src[3];      /* source planes, or NULL when decoding */
+    int sstride;
+    const u_char *raster;       /* interleaved file data when decoding */
+    int maxval;
+    int channels;
+    int width;                  /* source size */
+    int height;
+    u_short *dst[3];
+    int dstride;
+    transform_t op;
+} transform_job_t;
+
+static void die(char *message)
+{
+    fprintf(stderr, "transform: %s\n", message);
+    exit(1);
+}
+
+static void reverse_row(const u_short *s, u_short *d, int width)
+{
+    int x = 0;
+
+#ifdef TRANSFORM_SSE2
+    for (; x + 8 <= width; x += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (s + x));
+
+        v = _mm_shufflelo_epi16(v, 0x1b);
+        v = _mm_shufflehi_epi16(v, 0x1b);
+        v = _mm_shuffle_epi32(v, 0x4e);
+        _mm_storeu_si128((__m128i *) (d + width - 8 - x), v);
+    }
+#endif
+
+    for (; x < width; x++) {
+        d[width - 1 - x] = s[x];
+    }
+}
+
+/*
+ * Move an nx by ny tile at (x, y) of the source into the destination of an
+ * axis-swapping transform: column x + i becomes row v, and row y + j lands
+ * at column u, each counted from the far edge when reversed.
+ */
+static void transpose_tile(const u_short *s, int sstride, int x, int y, int nx, int ny,
+                           transform_job_t *job, u_short *d, int rev_u, int rev_v)
+{
+    int i, j;
+
+#ifdef TRANSFORM_SSE2
+    if (8 == nx && 8 == ny) {
+        __m128i r[8], t[8];
+        int u = rev_u ? job->height - 8 - y : y;
+
+        for (j = 0; j < 8; j++) {
+            r[j] = _mm_loadu_si128((const __m128i *) (s + (size_t) j * sstride + x));
+        }
+
+        t[0] = _mm_unpacklo_epi16(r[0], r[1]);
+        t[1] = _mm_unpackhi_epi16(r[0], r[1]);
+        t[2] = _mm_unpacklo_epi16(r[2], r[3]);
+        t[3] = _mm_unpackhi_epi16(r[2], r[3]);
+        t[4] = _mm_unpacklo_epi16(r[4], r[5]);
+        t[5] = _mm_unpackhi_epi16(r[4], r[5]);
+        t[6] = _mm_unpacklo_epi16(r[6], r[7]);
+        t[7] = _mm_unpackhi_epi16(r[6], r[7]);
+
+        r[0] = _mm_unpacklo_epi32(t[0], t[2]);
+        r[1] = _mm_unpackhi_epi32(t[0], t[2]);
+        r[2] = _mm_unpacklo_epi32(t[1], t[3]);
+        r[3] = _mm_unpackhi_epi32(t[1], t[3]);
+        r[4] = _mm_unpacklo_epi32(t[4], t[6]);
+        r[5] = _mm_unpackhi_epi32(t[4], t[6]);
+        r[6] = _mm_unpacklo_epi32(t[5], t[7]);
+        r[7] = _mm_unpackhi_epi32(t[5], t[7]);
+
+        t[0] = _mm_unpacklo_epi64(r[0], r[4]);
+        t[1] = _mm_unpackhi_epi64(r[0], r[4]);
+        t[2] = _mm_unpacklo_epi64(r[1], r[5]);
+        t[3] = _mm_unpackhi_epi64(r[1], r[5]);
+        t[4] = _mm_unpacklo_epi64(r[2], r[6]);
+        t[5] = _mm_unpackhi_epi64(r[2], r[6]);
+        t[6] = _mm_unpacklo_epi64(r[3], r[7]);
+        t[7] = _mm_unpackhi_epi64(r[3], r[7]);
+
+        for (i = 0; i < 8; i++) {
+            int v = rev_v ? job->width - 1 - (x + i) : x + i;
+            __m128i c = t[i];
+
+            if (rev_u) {
+                c = _mm_shufflelo_epi16(c, 0x1b);
+                c = _mm_shufflehi_epi16(c, 0x1b);
+                c = _mm_shuffle_epi32(c, 0x4e);
+            }
+
+            _mm_storeu_si128((__m128i *) (d + (size_t) v * job->dstride + u), c);
+        }
+        return;
+    }
+#endif
+
+    for (i = 0; i < nx; i++) {
+        int v = rev_v ? job->width - 1 - (x + i) : x + i;
+        u_short *row = d + (size_t) v * job->dstride;
+
+        for (j = 0; j < ny; j++) {
+            row[rev_u ? job->height - 1 - (y + j) : y + j] = s[(size_t) j * sstride + x + i];
+        }
+    }
+}
+
+/* transform source rows y0 .. y0 + rows - 1, held at s, into the plane d */
+static void transform_strip(transform_job_t *job, const u_short *s, int sstride, int y0, int rows, u_short *d)
+{
+    transform_t op = job->op;
+    int width = job->width;
+    int x, y, xb;
+
+    if (!TRANSFORM_SWAPS(op)) {
+        int flip_x = TRANSFORM_ROT180 == op || TRANSFORM_FLIP_H == op;
+        int flip_y = TRANSFORM_ROT180 == op || TRANSFORM_FLIP_V == op;
+
+        for (y = 0; y < rows; y++) {
+            const u_short *sr = s + (size_t) y * sstride;
+            u_short *dr = d + (size_t) (flip_y ? job->height - 1 - (y0 + y) : y0 + y) * job->dstride;
+
+            if (flip_x) {
+                reverse_row(sr, dr, width);
+            } else {
+                memcpy(dr, sr, width * sizeof(u_short));
+            }
+        }
+        return;
+    }
+
+    for (xb = 0; xb < width; xb += TRANSFORM_BLOCK) {
+        int xe = xb + TRANSFORM_BLOCK < width ? xb + TRANSFORM_BLOCK : width;
+
+        for (y = 0; y < rows; y += 8) {
+            int ny = rows - y < 8 ? rows - y : 8;
+
+            for (x = xb; x < xe; x += 8) {
+                int nx = xe - x < 8 ? xe - x : 8;
+
+                transpose_tile(s + (size_t) y * sstride, sstride, x, y0 + y, nx, ny, job, d,
+                               TRANSFORM_ROT90 == op || TRANSFORM_TRANSVERSE == op,
+                               TRANSFORM_ROT270 == op || TRANSFORM_TRANSVERSE == op);
+            }
+        }
+    }
+}
+
+static void transform_strips(void *arg, int begin, int end)
+{
+    transform_job_t *job = (transform_job_t *) arg;
+    int strip, c;
+
+    for (strip = begin; strip < end; strip++) {
+        int y0 = strip * TRANSFORM_STRIP;
+        int rows = job->height - y0 < TRANSFORM_STRIP ? job->height - y0 : TRANSFORM_STRIP;
+
+        for (c = 0; c < job->channels; c++) {
+            transform_strip(job, job->src[c] + (size_t) y0 * job->sstride, job->sstride, y0, rows, job->dst[c]);
+        }
+    }
+}
+
+/* de-interleave each strip of the raster into scratch, then transform it */
+static void decode_strips(void *arg, int begin, int end)
+{
+    transform_job_t *job = (transform_job_t *) arg;
+    int width = job->width, channels = job->channels;
+    size_t pitch = (size_t) width * channels * (job->maxval > 255 ? 2 : 1);
+    u_short *scratch = (u_short *) malloc((size_t) channels * TRANSFORM_STRIP * width * sizeof(u_short));
+    int strip, c, x, y;
+
+    if (!scratch) { die("cannot allocate memory for scratch strip"); }
+
+    for (strip = begin; strip < end; strip++) {
+        int y0 = strip * TRANSFORM_STRIP;
+        int rows = job->height - y0 < TRANSFORM_STRIP ? job->height - y0 : TRANSFORM_STRIP;
+
+        for (y = 0; y < rows; y++) {
+            const u_char *src = job->raster + (size_t) (y0 + y) * pitch;
+
+            for (c = 0; c < channels; c++) {
+                u_short *ch = scratch + ((size_t) c * TRANSFORM_STRIP + y) * width;
+
+                if (job->maxval > 255) {
+                    const u_char *p = src + 2 * c;
+
+                    for (x = 0; x < width; x++, p += 2 * channels) {
+                        ch[x] = (u_short) ((p[0] << 8) | p[1]);
+                    }
+                } else {
+                    const u_char *p = src + c;
+
+                    for (x = 0; x < width; x++, p += channels) {
+                        ch[x] = *p;
+                    }
+                }
+            }
+        }
+
+        for (c = 0; c < channels; c++) {
+            transform_strip(job, scratch + (size_t) c * TRANSFORM_STRIP * width, width, y0, rows, job->dst[c]);
+        }
+    }
+
+    free(scratch);
+}
+
+static void run_job(transform_job_t *job, strip_fn_t fn)
+{
+    parallel_for_bytes((job->height + TRANSFORM_STRIP - 1) / TRANSFORM_STRIP, 1,
+                       (size_t) TRANSFORM_STRIP * job->width * job->channels * 2 * sizeof(u_short), fn, job);
+}
+
+/* transform src into dst, which must have the transformed size */
+void transform_plane(plane_t *src, plane_t *dst, transform_t op)
+{
+    transform_job_t job;
+
+    memset(&job, 0, sizeof(job));
+    job.src[0]   = src->data;
+    job.sstride  = src->stride;
+    job.channels = 1;
+    job.width    = src->width;
+    job.height   = src->height;
+    job.dst[0]   = dst->data;
+    job.dstride  = dst->stride;
+    job.op       = op;
+
+    run_job(&job, transform_strips);
+}
+
+static ppm_t* alloc_transformed_ppm(int width, int height, int maxval, transform_t op)
+{
+    ppm_t *image = TRANSFORM_SWAPS(op) ? alloc_ppm_buffer(height, width, maxval)
+                                       : alloc_ppm_buffer(width, height, maxval);
+
+    if (!image) { die("cannot allocate memory for new image"); }
+
+    return image;
+}
+
+static pgm_t* alloc_transformed_pgm(int width, int height, int maxval, transform_t op)
+{
+    pgm_t *image = TRANSFORM_SWAPS(op) ? alloc_pgm_buffer(height, width, maxval)
+                                       : alloc_pgm_buffer(width, height, maxval);
+
+    if (!image) { die("cannot allocate memory for new image"); }
+
+    return image;
+}
+
+ppm_t* transform_ppm_image(ppm_t *src, transform_t op)
+{
+    ppm_t *dst = alloc_transformed_ppm(src->width, src->height, src->maxval, op);
+    transform_job_t job;
+
+    memset(&job, 0, sizeof(job));
+    job.src[0]   = src->ch1;
+    job.src[1]   = src->ch2;
+    job.src[2]   = src->ch3;
+    job.sstride  = src->width;
+    job.channels = 3;
+    job.width    = src->width;
+    job.height   = src->height;
+    job.dst[0]   = dst->ch1;
+    job.dst[1]   = dst->ch2;
+    job.dst[2]   = dst->ch3;
+    job.dstride  = dst->width;
+    job.op       = op;
+
+    run_job(&job, transform_strips);
+
+    return dst;
+}
+
+pgm_t* transform_pgm_image(pgm_t *src, transform_t op)
+{
+    pgm_t *dst = alloc_transformed_pgm(src->width, src->height, src->maxval, op);
+    plane_t s, d;
+
+    s.data   = src->ch;
+    s.width  = src->width;
+    s.height = src->height;
+    s.stride = src->width;
+
+    d.data   = dst->ch;
+    d.width  = dst->width;
+    d.height = dst->height;
+    d.stride = dst->width;
+
+    transform_plane(&s, &d, op);
+
+    return dst;
+}
+
+/* decode a P6 file image and apply op while de-interleaving it */
+ppm_t* decode_ppm_transformed(u_char *data, size_t size, transform_t op)
+{
+    size_t pos;
+    int width, height, maxval;
+    transform_job_t job;
+    ppm_t *image;
+
+    pos = read_ppm_header(data, size, &width, &height, &maxval);
+
+    if (pos > size || size - pos < (size_t) width * 3 * (maxval > 255 ? 2 : 1) * height) {
+        die("cannot read image data from file");
+    }
+
+    image = alloc_transformed_ppm(width, height, maxval, op);
+
+    memset(&job, 0, sizeof(job));
+    job.raster   = data + pos;
+    job.maxval   = maxval;
+    job.channels = 3;
+    job.width    = width;
+    job.height   = height;
+    job.dst[0]   = image->ch1;
+    job.dst[1]   = image->ch2;
+    job.dst[2]   = image->ch3;
+    job.dstride  = image->width;
+    job.op       = op;
+
+    run_job(&job, decode_strips);
+
+    return image;
+}
+
+/* read a P6 file and apply op while decoding it */
+ppm_t* read_ppm_transformed(char *filename, transform_t op)
+{
+    size_t size = 0;
+    u_char *data = aio_read_wait(aio_read_submit(filename), &size);
+    ppm_t *image = decode_ppm_transformed(data, size, op);
+    ppm_hook_t hook = get_ppm_read_hook();
+
+    free(data);
+
+    if (hook) { hook(image, filename); }
+
+    return image;
+}
+
+/* decode a P5 file image and apply op while converting it */
+pgm_t* decode_pgm_transformed(u_char *data, size_t size, transform_t op)
+{
+    size_t pos;
+    int width, height, maxval;
+    transform_job_t job;
+    pgm_t *image;
+
+    pos = read_pgm_header(data, size, &width, &height, &maxval);
+
+    if (pos > size || size - pos < (size_t) width * (maxval > 255 ? 2 : 1) * height) {
+        die("cannot read image data from file");
+    }
+
+    image = alloc_transformed_pgm(width, height, maxval, op);
+
+    memset(&job, 0, sizeof(job));
+    job.raster   = data + pos;
+    job.maxval   = maxval;
+    job.channels = 1;
+    job.width    = width;
+    job.height   = height;
+    job.dst[0]   = image->ch;
+    job.dstride  = image->width;
+    job.op       = op;
+
+    run_job(&job, decode_strips);
+
+    return image;
+}
+
+/* read a P5 file and apply op while decoding it */
+pgm_t* read_pgm_transformed(char *filename, transform_t op)
+{
+    size_t size = 0;
+    u_char *data = aio_read_wait(aio_read_submit(filename), &size);
+    pgm_t *image = decode_pgm_transformed(data, size, op);
+    pgm_hook_t hook = get_pgm_read_hook();
+
+    free(data);
+
+    if (hook) { hook(image, filename); }
+
+    return image;
+}
@@ -0,0 +1,42 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "ppm.h"
+#include "pgm.h"
+#include "resample.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum transform
+{
+    TRANSFORM_NONE = 0,
+    TRANSFORM_ROT90,        /* clockwise */
+    TRANSFORM_ROT180,
+    TRANSFORM_ROT270,
+    TRANSFORM_FLIP_H,       /* mirror left to right */
+    TRANSFORM_FLIP_V,       /* mirror top to bottom */
+    TRANSFORM_TRANSPOSE,    /* mirror along the main diagonal */
+    TRANSFORM_TRANSVERSE    /* mirror along the anti-diagonal */
+} transform_t;
+
+/* non-zero when the transform swaps width and height */
+#define TRANSFORM_SWAPS(op) \
+    ((op) == TRANSFORM_ROT90 || (op) == TRANSFORM_ROT270 || \
+     (op) == TRANSFORM_TRANSPOSE || (op) == TRANSFORM_TRANSVERSE)
+
+void   transform_plane(plane_t *src, plane_t *dst, transform_t op);
+ppm_t* transform_ppm_image(ppm_t *src, transform_t op);
+pgm_t* transform_pgm_image(pgm_t *src, transform_t op);
+
+ppm_t* decode_ppm_transformed(u_char *data, size_t size, transform_t op);
+pgm_t* decode_pgm_transformed(u_char *data, size_t size, transform_t op);
+ppm_t* read_ppm_transformed(char *filename, transform_t op);
+pgm_t* read_pgm_transformed(char *filename, transform_t op);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TRANSFORM_H */
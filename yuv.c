@@ -0,0 +1,378 @@
+/*
+ * yuv.c: raw planar YCbCr (I420, NV12, 4:2:2, 4:4:4) read/write and
+ * conversion from/to ppm with BT.601, BT.709 and BT.2020 matrices in
+ * limited or full range.
+ *
+ * Conversions run in Q16 fixed point. Chroma decimation (box average of the
+ * 2x2 or 2x1 block) is folded into the colour matrix by applying it to the
+ * block sums, and chroma upsampling (3:1 linear taps, matching the box
+ * siting) is applied to the chroma rows right before the inverse matrix, so
+ * neither direction needs a separate full-resolution chroma pass.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "yuv.h"
+#include "aio.h"
+#include "thread.h"
+
+typedef struct yuv_coef
+{
+    double kr;
+    double kb;
+} yuv_coef_t;
+
+typedef struct encode_job
+{
+    ppm_t *src;
+    yuv_t *dst;
+    long long ry, gy, by, yoff;     /* Q16, offset includes rounding */
+    long long ru, gu, bu;
+    long long rv, gv, bv;
+    long long coff;                 /* chroma offset in output units */
+    int sx, sy;                     /* chroma subsampling shifts */
+} encode_job_t;
+
+typedef struct decode_job
+{
+    yuv_t *src;
+    ppm_t *dst;
+    long long ay, yoff;             /* Q16, offsets in 1/16 input units */
+    long long rv, gu, gv, bu;
+    long long coff;
+    int sx, sy;
+} decode_job_t;
+
+static const yuv_coef_t yuv_coef[3] = {
+    { 0.299,  0.114  },     /* BT.601  */
+    { 0.2126, 0.0722 },     /* BT.709  */
+    { 0.2627, 0.0593 }      /* BT.2020 */
+};
+
+static void die(char *message)
+{
+    fprintf(stderr, "yuv: %s\n", message);
+    exit(1);
+}
+
+static long long q16(double val)
+{
+    return (long long) floor(val * 65536.0 + 0.5);
+}
+
+/* luma scale/offset and chroma scale/offset for a depth and range */
+static void get_range(int depth, int full_range, double *ys, double *yo, double *cs, double *co)
+{
+    double unit = (double) (1 << (depth - 8));
+    double top  = (double) ((1 << depth) - 1);
+
+    *ys = full_range ? top : 219.0 * unit;
+    *yo = full_range ? 0.0 : 16.0 * unit;
+    *cs = full_range ? top : 224.0 * unit;
+    *co = (double) (1 << (depth - 1));
+}
+
+static int get_depth(int maxval)
+{
+    int depth = 8;
+
+    while ((1 << depth) - 1 < maxval) { depth++; }
+
+    return depth;
+}
+
+yuv_t* alloc_yuv_buffer(int width, int height, int depth, yuv_format_t format)
+{
+    yuv_t *image = (yuv_t *) malloc(sizeof(yuv_t));
+    size_t luma, chroma;
+
+    if (!image) { die("cannot allocate memory for new image"); }
+
+    image->width   = width;
+    image->height  = height;
+    image->depth   = depth;
+    image->format  = format;
+    image->cwidth  = YUV_444P == format ? width : (width + 1) / 2;
+    image->cheight = (YUV_I420 == format || YUV_NV12 == format) ? (height + 1) / 2 : height;
+
+    luma   = (size_t) width * height;
+    chroma = (size_t) image->cwidth * image->cheight;
+
+    image->y = (u_short *) malloc(luma * sizeof(u_short));
+    image->u = (u_short *) malloc(chroma * sizeof(u_short));
+    image->v = (u_short *) malloc(chroma * sizeof(u_short));
+
+    if (!image->y || !image->u || !image->v) { die("cannot allocate memory for new image"); }
+
+    return image;
+}
+
+void free_yuv_buffer(yuv_t *image)
+{
+    if (!image) { die("cannot release memory for image"); }
+
+    free(image->y);
+    free(image->u);
+    free(image->v);
+    free(image);
+}
+
+static u_short get_sample(u_char *data, size_t index, int wide)
+{
+    return wide ? (u_short) (data[2 * index] | (data[2 * index + 1] << 8)) : data[index];
+}
+
+static void put_sample(u_char *data, size_t index, int wide, u_short val)
+{
+    if (wide) {
+        data[2 * index]     = (u_char) val;
+        data[2 * index + 1] = (u_char) (val >> 8);
+    } else {
+        data[index] = (u_char) val;
+    }
+}
+
+/* raw planar file; samples above 8 bits are 16 bit little endian */
+yuv_t* read_yuv_image(char *filename, int width, int height, int depth, yuv_format_t format)
+{
+    yuv_t *image = alloc_yuv_buffer(width, height, depth, format);
+    int wide = depth > 8;
+    size_t luma = (size_t) width * height;
+    size_t chroma = (size_t) image->cwidth * image->cheight;
+    size_t size, i;
+    u_char *data = aio_read_wait(aio_read_submit(filename), &size);
+
+    if (size < (luma + 2 * chroma) * (wide ? 2 : 1)) { die("cannot read image data from file"); }
+
+    for (i = 0; i < luma; i++) {
+        image->y[i] = get_sample(data, i, wide);
+    }
+
+    for (i = 0; i < chroma; i++) {
+        if (YUV_NV12 == format) {
+            image->u[i] = get_sample(data, luma + 2 * i, wide);
+            image->v[i] = get_sample(data, luma + 2 * i + 1, wide);
+        } else {
+            image->u[i] = get_sample(data, luma + i, wide);
+            image->v[i] = get_sample(data, luma + chroma + i, wide);
+        }
+    }
+
+    free(data);
+
+    return image;
+}
+
+void write_yuv_image(yuv_t *image, char *filename)
+{
+    int wide = image->depth > 8;
+    size_t luma = (size_t) image->width * image->height;
+    size_t chroma = (size_t) image->cwidth * image->cheight;
+    size_t size = (luma + 2 * chroma) * (wide ? 2 : 1), i;
+    u_char *data = (u_char *) malloc(size);
+
+    if (!data) { die("cannot allocate memory for new image"); }
+
+    for (i = 0; i < luma; i++) {
+        put_sample(data, i, wide, image->y[i]);
+    }
+
+    for (i = 0; i < chroma; i++) {
+        if (YUV_NV12 == image->format) {
+            put_sample(data, luma + 2 * i, wide, image->u[i]);
+            put_sample(data, luma + 2 * i + 1, wide, image->v[i]);
+        } else {
+            put_sample(data, luma + i, wide, image->u[i]);
+            put_sample(data, luma + chroma + i, wide, image->v[i]);
+        }
+    }
+
+    aio_write_submit(filename, data, size);
+}
+
+static u_short clamp_sample(long long val, int top)
+{
+    return (u_short) (val < 0 ? 0 : (val > top ? top : val));
+}
+
+/* one strip of chroma rows: the luma rows they cover and the decimated chroma */
+static void encode_rows(void *arg, int begin, int end)
+{
+    encode_job_t *job = (encode_job_t *) arg;
+    ppm_t *src = job->src;
+    yuv_t *dst = job->dst;
+    int w = src->width, h = src->height, top = (1 << dst->depth) - 1;
+    int shift = 16 + job->sx + job->sy;
+    long long round = job->coff * (1LL << shift) + (1LL << (shift - 1));
+    int cx, cy, x, y;
+
+    for (cy = begin; cy < end; cy++) {
+        int y0 = cy << job->sy;
+        int y1 = (job->sy && y0 + 1 < h) ? y0 + 1 : y0;
+
+        for (y = y0; y < y0 + (1 << job->sy) && y < h; y++) {
+            const u_short *r = src->ch1 + (size_t) y * w;
+            const u_short *g = src->ch2 + (size_t) y * w;
+            const u_short *b = src->ch3 + (size_t) y * w;
+            u_short *out = dst->y + (size_t) y * w;
+
+            for (x = 0; x < w; x++) {
+                out[x] = clamp_sample((job->ry * r[x] + job->gy * g[x] + job->by * b[x] + job->yoff) >> 16, top);
+            }
+        }
+
+        for (cx = 0; cx < dst->cwidth; cx++) {
+            int x0 = cx << job->sx;
+            int x1 = (job->sx && x0 + 1 < w) ? x0 + 1 : x0;
+            size_t i00 = (size_t) y0 * w + x0, i01 = (size_t) y0 * w + x1;
+            size_t i10 = (size_t) y1 * w + x0, i11 = (size_t) y1 * w + x1;
+            long long rs = src->ch1[i00], gs = src->ch2[i00], bs = src->ch3[i00];
+            size_t c = (size_t) cy * dst->cwidth + cx;
+
+            if (job->sx) {
+                rs += src->ch1[i01]; gs += src->ch2[i01]; bs += src->ch3[i01];
+            }
+            if (job->sy) {
+                rs += src->ch1[i10]; gs += src->ch2[i10]; bs += src->ch3[i10];
+                if (job->sx) {
+                    rs += src->ch1[i11]; gs += src->ch2[i11]; bs += src->ch3[i11];
+                }
+            }
+
+            dst->u[c] = clamp_sample((job->ru * rs + job->gu * gs + job->bu * bs + round) >> shift, top);
+            dst->v[c] = clamp_sample((job->rv * rs + job->gv * gs + job->bv * bs + round) >> shift, top);
+        }
+    }
+}
+
+/*
+ * Convert RGB to planar YCbCr at the bit depth of src (8 bits minimum),
+ * decimating chroma for the 4:2:0 and 4:2:2 formats in the same pass.
+ */
+yuv_t* ppm_to_yuv(ppm_t *src, yuv_format_t format, yuv_matrix_t matrix, int full_range)
+{
+    int depth = get_depth(src->maxval);
+    yuv_t *dst = alloc_yuv_buffer(src->width, src->height, depth, format);
+    double kr = yuv_coef[matrix].kr, kb = yuv_coef[matrix].kb, kg = 1.0 - kr - kb;
+    double ys, yo, cs, co, m = (double) src->maxval;
+    encode_job_t job;
+
+    get_range(depth, full_range, &ys, &yo, &cs, &co);
+
+    job.src  = src;
+    job.dst  = dst;
+    job.sx   = YUV_444P == format ? 0 : 1;
+    job.sy   = (YUV_I420 == format || YUV_NV12 == format) ? 1 : 0;
+
+    job.ry   = q16(kr * ys / m);
+    job.gy   = q16(kg * ys / m);
+    job.by   = q16(kb * ys / m);
+    job.yoff = q16(yo) + (1 << 15);
+
+    job.ru   = q16(-kr / (2.0 * (1.0 - kb)) * cs / m);
+    job.gu   = q16(-kg / (2.0 * (1.0 - kb)) * cs / m);
+    job.bu   = q16(0.5 * cs / m);
+    job.rv   = q16(0.5 * cs / m);
+    job.gv   = q16(-kg / (2.0 * (1.0 - kr)) * cs / m);
+    job.bv   = q16(-kb / (2.0 * (1.0 - kr)) * cs / m);
+    job.coff = (long long) co;
+
+    parallel_for_bytes(dst->cheight, 8, ((size_t) (src->width * 4 << job.sy) + 2 * dst->cwidth) * sizeof(u_short),
+                       encode_rows, &job);
+
+    return dst;
+}
+
+/* chroma sample of a subsampled axis at full resolution, x4: 3:1 taps toward the neighbour */
+static int upsample_index(int i, int shift, int size, int *near)
+{
+    int c = i >> shift;
+
+    if (!shift) {
+        *near = c;
+        return c;
+    }
+
+    *near = (i & 1) ? c + 1 : c - 1;
+    if (*near < 0)     { *near = 0; }
+    if (*near >= size) { *near = size - 1; }
+
+    return c;
+}
+
+static void decode_rows(void *arg, int begin, int end)
+{
+    decode_job_t *job = (decode_job_t *) arg;
+    yuv_t *src = job->src;
+    ppm_t *dst = job->dst;
+    int w = src->width, cw = src->cwidth, top = dst->maxval;
+    int *tu = (int *) malloc(2 * cw * sizeof(int));
+    int *tv = tu + cw;
+    int x, y, cx, c, n;
+
+    if (!tu) { die("cannot allocate memory for scratch row"); }
+
+    for (y = begin; y < end; y++) {
+        const u_short *luma = src->y + (size_t) y * w;
+        const u_short *u0, *u1, *v0, *v1;
+        size_t o = (size_t) y * w;
+
+        c  = upsample_index(y, job->sy, src->cheight, &n);
+        u0 = src->u + (size_t) c * cw;
+        u1 = src->u + (size_t) n * cw;
+        v0 = src->v + (size_t) c * cw;
+        v1 = src->v + (size_t) n * cw;
+
+        /* vertical chroma taps, x4 */
+        for (cx = 0; cx < cw; cx++) {
+            tu[cx] = 3 * u0[cx] + u1[cx];
+            tv[cx] = 3 * v0[cx] + v1[cx];
+        }
+
+        for (x = 0; x < w; x++) {
+            long long yy, uu, vv;
+
+            c  = upsample_index(x, job->sx, cw, &n);
+            yy = job->ay * (16LL * luma[x] - job->yoff);
+            uu = (long long) (3 * tu[c] + tu[n]) - job->coff;    /* x16 */
+            vv = (long long) (3 * tv[c] + tv[n]) - job->coff;
+
+            dst->ch1[o + x] = clamp_sample((yy + job->rv * vv + (1 << 19)) >> 20, top);
+            dst->ch2[o + x] = clamp_sample((yy + job->gu * uu + job->gv * vv + (1 << 19)) >> 20, top);
+            dst->ch3[o + x] = clamp_sample((yy + job->bu * uu + (1 << 19)) >> 20, top);
+        }
+    }
+
+    free(tu);
+}
+
+/* convert planar YCbCr to RGB of the same bit depth, upsampling chroma on the fly */
+ppm_t* yuv_to_ppm(yuv_t *src, yuv_matrix_t matrix, int full_range)
+{
+    double kr = yuv_coef[matrix].kr, kb = yuv_coef[matrix].kb, kg = 1.0 - kr - kb;
+    double ys, yo, cs, co, m = (double) ((1 << src->depth) - 1);
+    ppm_t *dst = alloc_ppm_buffer(src->width, src->height, (1 << src->depth) - 1);
+    decode_job_t job;
+
+    if (!dst) { die("cannot allocate memory for new image"); }
+
+    get_range(src->depth, full_range, &ys, &yo, &cs, &co);
+
+    job.src  = src;
+    job.dst  = dst;
+    job.sx   = src->cwidth < src->width ? 1 : 0;
+    job.sy   = src->cheight < src->height ? 1 : 0;
+
+    job.ay   = q16(m / ys);
+    job.yoff = (long long) (16.0 * yo);
+    job.rv   = q16(m * 2.0 * (1.0 - kr) / cs);
+    job.gu   = q16(-m * 2.0 * kb * (1.0 - kb) / (kg * cs));
+    job.gv   = q16(-m * 2.0 * kr * (1.0 - kr) / (kg * cs));
+    job.bu   = q16(m * 2.0 * (1.0 - kb) / cs);
+    job.coff = (long long) (16.0 * co);
+
+    parallel_for_bytes(src->height, 8, (size_t) (src->width * 4 + 2 * src->cwidth) * sizeof(u_short), decode_rows, &job);
+
+    return dst;
+}
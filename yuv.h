@@ -0,0 +1,52 @@
+#ifndef YUV_H
+#define YUV_H
+
+#include "ppm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum yuv_format
+{
+    YUV_I420 = 0,       /* Y, U, V planes; chroma halved in both directions */
+    YUV_NV12,           /* Y plane, interleaved UV plane; 4:2:0 */
+    YUV_422P,           /* Y, U, V planes; chroma halved horizontally */
+    YUV_444P            /* Y, U, V planes at full resolution */
+} yuv_format_t;
+
+typedef enum yuv_matrix
+{
+    YUV_BT601 = 0,
+    YUV_BT709,
+    YUV_BT2020
+} yuv_matrix_t;
+
+/* planar YCbCr image, samples of 'depth' bits (8 - 16) */
+typedef struct yuv
+{
+    int width;
+    int height;
+    int cwidth;         /* chroma plane size */
+    int cheight;
+    int depth;
+    yuv_format_t format;
+    u_short *y;
+    u_short *u;
+    u_short *v;
+} yuv_t;
+
+yuv_t* alloc_yuv_buffer(int width, int height, int depth, yuv_format_t format);
+void   free_yuv_buffer(yuv_t *image);
+
+yuv_t* read_yuv_image(char *filename, int width, int height, int depth, yuv_format_t format);
+void   write_yuv_image(yuv_t *image, char *filename);
+
+yuv_t* ppm_to_yuv(ppm_t *src, yuv_format_t format, yuv_matrix_t matrix, int full_range);
+ppm_t* yuv_to_ppm(yuv_t *src, yuv_matrix_t matrix, int full_range);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* YUV_H */